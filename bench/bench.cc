@@ -0,0 +1,1184 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Benchmarks of the sheet engine.
+ * Benchmarks are picked by name from the command line;
+ * all of them are run if no name is given. With `-j'
+ * results are emitted as JSON, to be kept and compared
+ * between versions.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <Prof.h>
+#include <Value.h>
+#include <Cell.h>
+#include <Axis.h>
+#include <Store.h>
+#include <Kernel.h>
+#include <Formula.h>
+#include <Deps.h>
+#include <Pool.h>
+#include <Journal.h>
+#include <History.h>
+#include <Sheet.h>
+#include <Batch.h>
+#include <Output.h>
+#include <Screen.h>
+#include <Display.h>
+
+/* live heap bytes; every allocation carries its size in a header */
+static std::atomic<size_t> heap_live(0); /* allocated from threads of the sheet too */
+static bool json; /* results are emitted as a JSON object */
+static unsigned results; /* emitted so far */
+
+__attribute__((noinline)) void *
+operator new(size_t n)
+{
+	size_t *p = (size_t *)malloc(n + 16);
+	if (!p)
+		throw std::bad_alloc();
+	*p = n;
+	heap_live.fetch_add(n, std::memory_order_relaxed);
+	return (char *)p + 16;
+}
+
+__attribute__((noinline)) void
+operator delete(void *ptr) noexcept
+{
+	if (!ptr)
+		return;
+	size_t *p = (size_t *)((char *)ptr - 16);
+	heap_live.fetch_sub(*p, std::memory_order_relaxed);
+	free(p);
+}
+
+void
+operator delete(void *ptr, size_t) noexcept
+{
+	operator delete(ptr);
+}
+
+/**
+ * Run `fn' and return wall time in milliseconds
+ */
+static double
+timed(const std::function<void(void)> &fn)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	fn();
+	std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - t0;
+	return d.count();
+}
+
+/**
+ * Size of a file in megabytes
+ */
+static double
+file_mb(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	fseek(f, 0, SEEK_END);
+	double mb = ftell(f) / 1048576.0;
+	fclose(f);
+	return mb;
+}
+
+/**
+ * Print a JSON string
+ */
+static void
+put_json(const char *s)
+{
+	putchar('"');
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+/**
+ * Start a result emitted as JSON: the object's
+ * opening and names, after the previous result
+ */
+static void
+open_json(const char *bench, const char *what)
+{
+	printf("%s\t{\"bench\": ", results++ ? ",\n" : "");
+	put_json(bench);
+	printf(", \"name\": ");
+	put_json(what);
+}
+
+/**
+ * Report time taken by `n' operations
+ */
+static void
+report(const char *bench, const char *what, double ms, size_t n)
+{
+	if (!json) {
+		printf("%-8s %-24s %10.2f ms %10.1f ns/op\n", bench, what, ms, ms * 1e6 / (n ? n : 1));
+		return;
+	}
+	open_json(bench, what);
+	printf(", \"ms\": %.6g, \"ops\": %zu, \"ns_per_op\": %.6g}", ms, n, ms * 1e6 / (n ? n : 1));
+}
+
+/**
+ * Report a measure other than time, like memory or size
+ */
+static void
+note(const char *bench, const char *what, double value, const char *unit)
+{
+	if (!json) {
+		printf("%-8s %-24s %10.2f %s\n", bench, what, value, unit);
+		return;
+	}
+	open_json(bench, what);
+	printf(", \"value\": %.6g, \"unit\": \"%s\"}", value, unit);
+}
+
+/**
+ * Cell store against the std::map<Cell::Pos, Cell> it replaced:
+ * fill a dense block, look up random cells, scan viewports.
+ */
+static void
+bench_store(void)
+{
+	constexpr unsigned ROWS = 2000, COLS = 500, LOOKUPS = 1000000, VIEWS = 2000;
+	constexpr size_t N = (size_t)ROWS * COLS;
+	std::vector<Cell::Pos> probe(LOOKUPS);
+	std::vector<Cell::Range> views(VIEWS);
+	std::mt19937 rng(1);
+	for (auto &p : probe) {
+		p.row = rng() % ROWS + 1;
+		p.col = rng() % COLS + 1;
+	}
+	for (auto &v : views) {
+		v.begin.row = rng() % (ROWS - 40) + 1;
+		v.begin.col = rng() % (COLS - 10) + 1;
+		v.end.row = v.begin.row + 39;
+		v.end.col = v.begin.col + 9;
+	}
+	double sum = 0;
+	size_t base = heap_live;
+	{
+		std::map<Cell::Pos, Cell> m;
+		report("map", "insert", timed([&] {
+			Cell::Pos p;
+			for (p.col = 1; p.col <= COLS; ++p.col)
+				for (p.row = 1; p.row <= ROWS; ++p.row)
+					m[p] = Cell(p, Value((int)(p.row + p.col)));
+		}), N);
+		note("map", "memory", (heap_live - base) / 1048576.0, "MiB");
+		note("map", "memory per cell", (double)(heap_live - base) / N, "B");
+		report("map", "lookup", timed([&] {
+			for (auto &p : probe) {
+				auto it = m.find(p);
+				if (it != m.end())
+					sum += it->second.get_value().get_num();
+			}
+		}), LOOKUPS);
+		/* same walk Sheet::get_cells used to do */
+		report("map", "range scan 10x40", timed([&] {
+			for (auto &v : views)
+				for (auto it = m.lower_bound(v.begin), e = m.upper_bound(v.end); it != e; ++it)
+					if (v.contains(it->first))
+						sum += it->second.get_value().get_num();
+		}), VIEWS);
+	}
+	base = heap_live;
+	{
+		Store s;
+		report("store", "insert", timed([&] {
+			Cell::Pos p;
+			for (p.col = 1; p.col <= COLS; ++p.col)
+				for (p.row = 1; p.row <= ROWS; ++p.row)
+					s.set(p, Value((int)(p.row + p.col)));
+		}), N);
+		note("store", "memory", (heap_live - base) / 1048576.0, "MiB");
+		note("store", "memory per cell", (double)(heap_live - base) / N, "B");
+		report("store", "lookup", timed([&] {
+			for (auto &p : probe) {
+				auto v = s.get(p);
+				if (v)
+					sum += v->get_num();
+			}
+		}), LOOKUPS);
+		report("store", "range scan 10x40", timed([&] {
+			for (auto &v : views)
+				s.for_each(v, [&sum](const Cell::Pos &, const Value &val) {
+					sum += val.get_num();
+				});
+		}), VIEWS);
+		report("store", "range query 10x40", timed([&] {
+			for (auto &v : views)
+				for (auto c : s.query(v))
+					sum += c.value.get_num();
+		}), VIEWS);
+	}
+	if (sum == 0)
+		printf("\n"); /* keep the loops from being optimised out */
+}
+
+/**
+ * Column offsets: prefix sums against walking
+ * a map of sizes column by column.
+ */
+static void
+bench_axis(void)
+{
+	constexpr unsigned COLS = 100000, RESIZED = 1000, QUERIES = 1000;
+	std::map<unsigned, unsigned> m;
+	Axis a(10);
+	std::mt19937 rng(1);
+	for (unsigned i = 0; i < RESIZED; ++i) {
+		unsigned idx = rng() % COLS + 1, siz = rng() % 30 + 1;
+		m[idx] = siz;
+		a.set(idx, siz);
+	}
+	std::vector<unsigned> probe(QUERIES);
+	for (auto &p : probe)
+		p = rng() % COLS + 1;
+	unsigned long sum = 0;
+	report("map", "column offset", timed([&] {
+		for (auto p : probe)
+			for (unsigned i = 1; i < p; ++i)
+				sum += m.count(i) > 0 ? m.at(i) : 10;
+	}), QUERIES);
+	report("axis", "column offset", timed([&] {
+		for (unsigned n = 0; n < 1000; ++n)
+			for (auto p : probe)
+				sum += a.offset(p);
+	}), QUERIES * 1000);
+	report("axis", "column at offset", timed([&] {
+		for (unsigned n = 0; n < 1000; ++n)
+			for (auto p : probe)
+				sum += a.at(p * 10);
+	}), QUERIES * 1000);
+	if (sum == 0)
+		printf("\n");
+}
+
+/**
+ * Frame rendering into a memory sink: frames after the view
+ * jumps elsewhere (everything changes) and repeated frames
+ * of the same view (nothing changes).
+ */
+static void
+bench_frame(void)
+{
+	constexpr unsigned FRAMES = 2000;
+	auto sheet = std::make_shared<Sheet>();
+	sheet->insert(Cell::Range("A1:ZZ2000"), Value(1000));
+	sheet->insert(Cell::Range("C1:C2000"), Value("label"));
+	const unsigned siz[][2] = { { 80, 24 }, { 300, 100 } };
+	for (auto &sz : siz) {
+		Display::COLS = sz[0];
+		Display::LINES = sz[1];
+		Display d(sheet, -1);
+		std::string name = std::to_string(sz[0]) + "x" + std::to_string(sz[1]);
+		report("frame", (name + " full").c_str(), timed([&] {
+			for (unsigned i = 0; i < FRAMES; ++i) {
+				d.go_to(i % 2 ? "A1" : "B2");
+				d.redraw();
+			}
+		}), FRAMES);
+		report("frame", (name + " unchanged").c_str(), timed([&] {
+			for (unsigned i = 0; i < FRAMES; ++i)
+				d.redraw();
+		}), FRAMES);
+	}
+}
+
+/**
+ * Formula evaluation: a column of formulas filled from one
+ * compiled formula, and a sum over the whole of it.
+ */
+static void
+bench_formula(void)
+{
+	constexpr unsigned ROWS = 100000;
+	Sheet sheet;
+	sheet.insert(Cell::Range("A1:A" + std::to_string(ROWS)), Value(1));
+	sheet.insert(Cell::Range("B1:B" + std::to_string(ROWS)), sheet.parse("=A1*2+$A$1"));
+	sheet.insert(Cell::Range("C1:C1"), sheet.parse("=SUM(B1:B" + std::to_string(ROWS) + ")"));
+	report("formula", "recalc", timed([&] {
+		sheet.recalc();
+	}), ROWS + 1);
+	Store cells;
+	for (Cell::Pos p; p.row < ROWS; ) {
+		++p.row;
+		p.col = 1;
+		cells.set(p, Value((int)p.row));
+	}
+	Formula f("=A1*2+$A$1", Cell::Pos("B1"));
+	Cell::Pos at("B1");
+	double sum = 0;
+	report("formula", "eval", timed([&] {
+		for (at.row = 1; at.row <= ROWS; ++at.row)
+			sum += f.eval(at, cells).get_num();
+	}), ROWS);
+	if (sum == 0)
+		printf("\n");
+}
+
+/**
+ * Edits of a sheet full of formulas: only cells depending
+ * on an edited one should be recomputed.
+ */
+static void
+bench_recalc(void)
+{
+	constexpr unsigned ROWS = 100000, EDITS = 1000;
+	Sheet sheet;
+	std::string rows = std::to_string(ROWS);
+	sheet.insert(Cell::Range("A1:A" + rows), Value(1));
+	sheet.insert(Cell::Range("B1:B" + rows), sheet.parse("=A1*2"));
+	sheet.insert(Cell::Range("C2:C" + rows), sheet.parse("=SUM(B1:B2)"));
+	sheet.insert(Cell::Range("D1:D1"), sheet.parse("=MAX(C2:C" + rows + ")"));
+	double ms = timed([&] {
+		sheet.recalc();
+	});
+	report("recalc", "full", ms, sheet.get_stats().cells);
+	std::mt19937 rng(1);
+	size_t cells = 0;
+	report("recalc", "edit", timed([&] {
+		for (unsigned i = 0; i < EDITS; ++i) {
+			Cell::Pos p;
+			p.col = 1;
+			p.row = rng() % ROWS + 1;
+			sheet.insert(Cell::Range(p, p), Value((int)i));
+			cells += sheet.get_stats().cells;
+		}
+	}), EDITS);
+	note("recalc", "recomputed per edit", (double)cells / EDITS, "cells");
+}
+
+/**
+ * Recalculation of many independent chains of formulas
+ * with growing number of threads
+ */
+static void
+bench_threads(void)
+{
+	constexpr unsigned CHAINS = 2000, DEPTH = 50;
+	Sheet sheet;
+	Cell::Pos b, e;
+	b.row = 1;
+	b.col = 1;
+	e.row = 1;
+	e.col = CHAINS;
+	sheet.insert(Cell::Range(b, e), Value(1));
+	b.row = 2;
+	e.row = DEPTH;
+	sheet.insert(Cell::Range(b, e), sheet.parse("=SQRT(A1*A1+1)+SUM($A$1:$J$1)/10"));
+	unsigned max = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned> counts;
+	for (unsigned n = 1; n < max; n *= 2)
+		counts.push_back(n);
+	counts.push_back(max);
+	for (auto n : counts) {
+		sheet.set_threads(n);
+		std::string name = std::to_string(n) + (n > 1 ? " threads" : " thread");
+		report("threads", name.c_str(), timed([&] {
+			sheet.recalc();
+		}), CHAINS * (DEPTH - 1));
+	}
+}
+
+/**
+ * Fill a sheet like those saved by the load benches:
+ * numbers in every cell, but fractions in column C
+ * and text in column G
+ */
+static void
+fill_sample(Sheet &sheet, unsigned rows, unsigned cols)
+{
+	Cell::Pos b, e;
+	b.row = b.col = 1;
+	e.row = rows;
+	e.col = cols;
+	sheet.insert(Cell::Range(b, e), Value(1000));
+	b.col = e.col = 3;
+	sheet.insert(Cell::Range(b, e), Value(0.5));
+	b.col = e.col = 7;
+	sheet.insert(Cell::Range(b, e), Value("label"));
+}
+
+/**
+ * Loading a saved sheet of a million cells:
+ * mostly numbers with some fractions and text
+ */
+static void
+bench_load(void)
+{
+	constexpr unsigned COLS = 100, ROWS = 10000;
+	const char *path = "/tmp/cells-bench.cells";
+	{
+		Sheet sheet;
+		fill_sample(sheet, ROWS, COLS);
+		sheet.save(path);
+	}
+	double mb = file_mb(path);
+	size_t cells = (size_t)COLS * ROWS;
+	Sheet sheet;
+	double ms = timed([&] {
+		sheet.load(path);
+	});
+	report("load", "1M cells", ms, cells);
+	note("load", "throughput", mb / (ms / 1000), "MB/s");
+	note("load", "cells per second", cells / (ms / 1000) / 1e6, "Mcells/s");
+	remove(path);
+}
+
+/**
+ * Open the same sheet saved as text and in binary; binary
+ * cells are decoded only as they're looked at.
+ */
+static void
+bench_open(void)
+{
+	constexpr unsigned COLS = 100, ROWS = 10000;
+	const char *text = "/tmp/cells-bench.cells", *binary = "/tmp/cells-bench.cellsb";
+	{
+		Sheet sheet;
+		fill_sample(sheet, ROWS, COLS);
+		Cell::Pos b, e;
+		b.row = 1;
+		e.row = ROWS;
+		b.col = e.col = COLS + 1;
+		sheet.insert(Cell::Range(b, e), sheet.parse("=A1*2"));
+		sheet.save(text);
+		sheet.save(binary);
+	}
+	size_t cells = (size_t)(COLS + 1) * ROWS;
+	note("open", "text size", file_mb(text), "MB");
+	note("open", "binary size", file_mb(binary), "MB");
+	{
+		Sheet sheet;
+		report("open", "text", timed([&] { sheet.load(text); }), cells);
+	}
+	Sheet sheet;
+	report("open", "binary", timed([&] { sheet.load(binary); }), cells);
+	Cell::Range view(Cell::Pos("A1"), Cell::Pos("H24"));
+	size_t n = 0;
+	report("open", "first screen", timed([&] {
+		for (auto c : sheet.query(view))
+			n += c.value.is_num();
+	}), 8 * 24);
+	double sum = 0;
+	report("open", "decode the rest", timed([&] {
+		for (auto c : sheet.query(Cell::Range(Cell::Pos("A1"), Cell::Pos("ZZ99999"))))
+			sum += c.value.get_num();
+	}), cells);
+	remove(text);
+	remove(binary);
+}
+
+/**
+ * Memory taken by a million cells of repeated labels,
+ * as separate strings and interned
+ */
+static void
+bench_strings(void)
+{
+	constexpr unsigned ROWS = 100000, COLS = 10, LABELS = 50;
+	constexpr size_t N = (size_t)ROWS * COLS;
+	const char *kinds[] = { "Electronics", "Home & Garden", "Sports and Outdoors",
+	                        "Books", "Health & Personal Care", "Toys" };
+	std::vector<std::string> labels;
+	for (unsigned i = 0; i < LABELS; ++i)
+		labels.push_back(std::string(kinds[i % 6]) + " " + std::to_string(i));
+	std::mt19937 rng(1);
+	std::vector<unsigned> pick(N);
+	for (auto &i : pick)
+		i = rng() % LABELS;
+	size_t base = heap_live;
+	{
+		Store s;
+		size_t i = 0;
+		report("strings", "insert copied", timed([&] {
+			Cell::Pos p;
+			for (p.col = 1; p.col <= COLS; ++p.col)
+				for (p.row = 1; p.row <= ROWS; ++p.row)
+					s.set(p, Value(labels[pick[i++]]));
+		}), N);
+		note("strings", "memory copied", (heap_live - base) / 1048576.0, "MiB");
+		note("strings", "copied per cell", (double)(heap_live - base) / N, "B");
+	}
+	base = heap_live;
+	{
+		Store s;
+		size_t i = 0;
+		report("strings", "insert interned", timed([&] {
+			Cell::Pos p;
+			for (p.col = 1; p.col <= COLS; ++p.col)
+				for (p.row = 1; p.row <= ROWS; ++p.row)
+					s.set(p, s.intern(labels[pick[i++]]));
+		}), N);
+		note("strings", "memory interned", (heap_live - base) / 1048576.0, "MiB");
+		note("strings", "interned per cell", (double)(heap_live - base) / N, "B");
+	}
+}
+
+/**
+ * Fill a 1000x1000 selection and clear it again
+ */
+static void
+bench_fill(void)
+{
+	constexpr unsigned N = 1000;
+	Cell::Range r(Cell::Pos("A1"), Cell::Pos("ALL1000"));
+	Sheet sheet;
+	report("fill", "insert 1000x1000", timed([&] { sheet.insert(r, Value(1)); }), (size_t)N * N);
+	report("fill", "overwrite 1000x1000", timed([&] { sheet.insert(r, Value("label")); }), (size_t)N * N);
+	report("fill", "remove 1000x1000", timed([&] { sheet.remove(r); }), (size_t)N * N);
+}
+
+/**
+ * Generated data kept as runs against the same cells
+ * set one by one: a long column of a sequence and
+ * a 1000x1000 block, their memory, scan and save
+ */
+static void
+bench_runs(void)
+{
+	constexpr unsigned ROWS = 1000000, N = 1000;
+	Cell::Range col(Cell::Pos("A1"), Cell::Pos("A1000000"));
+	Cell::Range block(Cell::Pos("C1"), Cell::Pos("ALN1000"));
+	const size_t cells = ROWS + (size_t)N * N;
+	const char *text = "/tmp/cells-bench.cells", *binary = "/tmp/cells-bench.cellsb";
+	double sum = 0;
+	for (int runs = 0; runs < 2; ++runs) {
+		const char *name = runs ? "runs" : "cells";
+		size_t base = heap_live;
+		Sheet sheet;
+		report(name, "fill", timed([&] {
+			if (runs) {
+				sheet.insert(col, Value(5));
+				sheet.insert(block, Value(1.5));
+				return;
+			}
+			/* as loaded from a file of single cells */
+			auto store = [&sheet](const Cell::Range &r, const Value &v) {
+				Cell::Pos p;
+				for (p.col = r.begin.col; p.col <= r.end.col; ++p.col)
+					for (p.row = r.begin.row; p.row <= r.end.row; ++p.row)
+						sheet.insert(Cell::Range(p, p), v + r.index_of(p));
+			};
+			store(col, Value(5));
+			store(block, Value(1.5));
+		}), cells);
+		note(name, "memory", (heap_live - base) / 1048576.0, "MiB");
+		note(name, "memory per cell", (double)(heap_live - base) / cells, "B");
+		report(name, "sum scan", timed([&] {
+			sheet.for_each_in(block, [&sum](const Cell::Pos &, const Value &v) { sum += v.get_num(); });
+		}), (size_t)N * N);
+		report(name, "save text", timed([&] { sheet.save(text); }), cells);
+		note(name, "text size", file_mb(text), "MB");
+		report(name, "save binary", timed([&] { sheet.save(binary); }), cells);
+		note(name, "binary size", file_mb(binary), "MB");
+	}
+	remove(text);
+	remove(binary);
+	if (sum == 0)
+		printf("\n");
+}
+
+/**
+ * Aggregates over 10M numbers: folding Values one by one
+ * against kernels of every level over the column arrays,
+ * with whole columns and with every other row left out
+ */
+static void
+bench_agg(void)
+{
+	constexpr unsigned ROWS = 100000, COLS = 100, REPS = 5;
+	constexpr size_t N = (size_t)ROWS * COLS;
+	Store s;
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<double> dist(-1000, 1000);
+	Cell::Pos p;
+	for (p.col = 1; p.col <= COLS; ++p.col)
+		for (p.row = 1; p.row <= ROWS; ++p.row)
+			s.set(p, Value(dist(rng)));
+	Cell::Range all(Cell::Pos("A1"), Cell::Pos("CV100000"));
+	double sum = 0;
+	report("agg", "values 10M", timed([&] {
+		for (unsigned i = 0; i < REPS; ++i)
+			s.for_each(all, [&sum](const Cell::Pos &, const Value &v) {
+				if (v.is_num())
+					sum += v.get_num();
+			});
+	}) / REPS, N);
+	Kernel::Level best = Kernel::get_level();
+	for (int l = Kernel::SCALAR; l <= best; ++l) {
+		Kernel::set_level((Kernel::Level)l);
+		std::string what = std::string(Kernel::name((Kernel::Level)l)) + " 10M";
+		report("agg", what.c_str(), timed([&] {
+			for (unsigned i = 0; i < REPS; ++i)
+				sum += s.summarize(all).variance();
+		}) / REPS, N);
+	}
+	for (p.col = 1; p.col <= COLS; ++p.col)
+		for (p.row = 2; p.row <= ROWS; p.row += 2)
+			s.set(p, Value("x"));
+	for (int l = Kernel::SCALAR; l <= best; ++l) {
+		Kernel::set_level((Kernel::Level)l);
+		std::string what = std::string(Kernel::name((Kernel::Level)l)) + " 10M, half numbers";
+		report("agg", what.c_str(), timed([&] {
+			for (unsigned i = 0; i < REPS; ++i)
+				sum += s.summarize(all).variance();
+		}) / REPS, N);
+	}
+	if (sum == 0)
+		printf("\n");
+}
+
+/**
+ * Extend selection over 100x5000 numbers a row at a time,
+ * the status bar summing up only each new row, against
+ * summing up the whole selection on every key
+ */
+static void
+bench_select(void)
+{
+	constexpr unsigned ROWS = 5000, COLS = 100;
+	auto sheet = std::make_shared<Sheet>();
+	std::mt19937 rng(1);
+	Cell::Pos p;
+	for (p.col = 1; p.col <= COLS; ++p.col)
+		for (p.row = 1; p.row <= ROWS; ++p.row)
+			sheet->insert(Cell::Range(p, p), Value((int)(rng() % 1000)));
+	Display::COLS = 80;
+	Display::LINES = 24;
+	Display d(sheet, -1);
+	d.go_to("A1");
+	for (unsigned c = 1; c < COLS; ++c)
+		d.key('L');
+	report("select", "extend, incremental", timed([&] {
+		for (unsigned r = 1; r < ROWS; ++r)
+			d.key('J');
+	}), ROWS);
+	report("select", "retract, incremental", timed([&] {
+		for (unsigned r = 1; r < ROWS; ++r)
+			d.key('K');
+	}), ROWS);
+	double sum = 0;
+	Cell::Range sel(Cell::Pos("A1"), Cell::Pos("CV1"));
+	report("select", "extend, rescanning", timed([&] {
+		for (unsigned r = 1; r < ROWS; ++r, ++sel.end.row)
+			sum += sheet->summarize(sel).sum;
+	}), ROWS);
+	if (sum == 0)
+		printf("\n");
+}
+
+/**
+ * Sorting a million rows of three columns by numbers and
+ * by strings, with one thread and with all of them
+ */
+static void
+bench_sort(void)
+{
+	constexpr unsigned ROWS = 1000000;
+	const char *words[] = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel" };
+	std::mt19937 rng(1);
+	unsigned max = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned n : { 1u, max }) {
+		Sheet sheet;
+		sheet.set_threads(n);
+		Cell::Pos p;
+		for (p.row = 1; p.row <= ROWS; ++p.row) {
+			p.col = 1;
+			sheet.insert(Cell::Range(p, p), Value((double)(rng() % 1000000) / 8));
+			p.col = 2;
+			sheet.insert(Cell::Range(p, p), Value(std::string(words[rng() % 8]) + std::to_string(rng() % 1000)));
+			p.col = 3;
+			sheet.insert(Cell::Range(p, p), Value((int)p.row));
+		}
+		Cell::Range all = sheet.bounds();
+		std::string name = std::to_string(n) + (n > 1 ? " threads" : " thread");
+		report("sort", (name + ", numbers").c_str(), timed([&] {
+			sheet.sort(all, 1);
+		}), ROWS);
+		report("sort", (name + ", numbers desc").c_str(), timed([&] {
+			sheet.sort(all, 1, true);
+		}), ROWS);
+		report("sort", (name + ", strings").c_str(), timed([&] {
+			sheet.sort(all, 2);
+		}), ROWS);
+	}
+}
+
+/**
+ * Exact lookups in a column of a hundred thousand
+ * numbers through its index against scanning it,
+ * formulas looking values up and searching the sheet
+ */
+static void
+bench_lookup(void)
+{
+	constexpr unsigned ROWS = 100000, SCANS = 1000, FORMULAS = 2000;
+	Sheet sheet;
+	std::mt19937 rng(1);
+	std::vector<unsigned> keys(ROWS);
+	for (unsigned i = 0; i < ROWS; ++i)
+		keys[i] = i * 7;
+	std::shuffle(keys.begin(), keys.end(), rng);
+	Store store;
+	Cell::Pos p;
+	for (p.row = 1; p.row <= ROWS; ++p.row) {
+		p.col = 1;
+		sheet.insert(Cell::Range(p, p), Value((int)keys[p.row - 1]));
+		store.set(p, Value((int)keys[p.row - 1]));
+		p.col = 2;
+		sheet.insert(Cell::Range(p, p), sheet.parse("item" + std::to_string(p.row)));
+	}
+	Cell::Range col(Cell::Pos("A1"), Cell::Pos("A" + std::to_string(ROWS)));
+	unsigned row, found = 0;
+	report("lookup", "exact, building index", timed([&] {
+		found += store.find(col, Value(0), Store::EXACT, row);
+	}), 1);
+	report("lookup", "exact, indexed", timed([&] {
+		for (unsigned i = 0; i < ROWS; ++i)
+			found += store.find(col, Value((int)(rng() % ROWS * 7)), Store::EXACT, row);
+	}), ROWS);
+	report("lookup", "exact, scanning", timed([&] {
+		for (unsigned i = 0; i < SCANS; ++i) {
+			double key = rng() % ROWS * 7;
+			for (auto e : store.query(col))
+				if (e.value.get_num() == key) {
+					++found;
+					break;
+				}
+		}
+	}), SCANS);
+	for (p.row = 1, p.col = 3; p.row <= FORMULAS; ++p.row)
+		sheet.insert(Cell::Range(p, p), Value((int)(rng() % ROWS * 7)));
+	Cell::Range d(Cell::Pos("D1"), Cell::Pos("D" + std::to_string(FORMULAS)));
+	report("lookup", "vlookup", timed([&] {
+		sheet.insert(d, sheet.parse("=VLOOKUP(C1, $A$1:$B$100000, 2)"));
+	}), FORMULAS);
+	Cell::Pos at("A1"), cell;
+	report("lookup", "search, first", timed([&] {
+		found += sheet.find("item9999", at, cell);
+	}), 1);
+	report("lookup", "search, indexed", timed([&] {
+		for (unsigned i = 0; i < SCANS; ++i)
+			found += sheet.find("item" + std::to_string(i * 97 + 1), at, cell);
+	}), SCANS);
+	if (!found)
+		printf("\n");
+}
+
+/**
+ * Fill a block of cells with random numbers one by one,
+ * as if they were typed in
+ */
+static void
+fill_random(Sheet &sheet, unsigned rows, unsigned cols, std::mt19937 &rng)
+{
+	Cell::Pos p;
+	for (p.row = 1; p.row <= rows; ++p.row)
+		for (p.col = 1; p.col <= cols; ++p.col)
+			sheet.insert(Cell::Range(p, p), Value((double)(rng() % 1000000) / 8));
+}
+
+/**
+ * Set `n' random cells of a block, one edit each
+ */
+static void
+edit_random(Sheet &sheet, unsigned rows, unsigned cols, unsigned n, std::mt19937 &rng)
+{
+	Cell::Pos p;
+	for (unsigned i = 0; i < n; ++i) {
+		p.row = rng() % rows + 1;
+		p.col = rng() % cols + 1;
+		sheet.insert(Cell::Range(p, p), Value((int)i));
+	}
+}
+
+/**
+ * Saving a million cells: the time a save held the
+ * screen up for against starting one in the background,
+ * and editing cells while it's being written
+ */
+static void
+bench_save(void)
+{
+	constexpr unsigned ROWS = 200000, COLS = 5, EDITS = 1000;
+	const char *path = "/tmp/cells-bench.cellsb";
+	std::mt19937 rng(1);
+	Sheet sheet;
+	fill_random(sheet, ROWS, COLS, rng);
+	report("save", "in foreground", timed([&] { sheet.save(path); }), 1);
+	std::atomic<unsigned> notes(0);
+	sheet.set_background([&notes] { ++notes; });
+	report("save", "starting in background", timed([&] { sheet.save_background(path); }), 1);
+	report("save", "edits while saving", timed([&] { edit_random(sheet, ROWS, COLS, EDITS, rng); }), EDITS);
+	std::string err;
+	report("save", "rest of it", timed([&] {
+		while (!sheet.saved(err))
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}), 1);
+	note("save", "notifications", notes.load(), "");
+	if (!err.empty())
+		fprintf(stderr, "save: %s\n", err.c_str());
+	sheet.set_background(nullptr);
+	remove(path);
+}
+
+/**
+ * Edits of single cells with and without a journal kept,
+ * then recovery of a sheet from the journal they left
+ */
+static void
+bench_journal(void)
+{
+	constexpr unsigned ROWS = 100000, COLS = 5, EDITS = 100000;
+	const char *path = "/tmp/cells-bench.cellsb";
+	std::string journal = std::string(path) + ".journal";
+	remove(path);
+	std::string copy;
+	for (bool journaled : {false, true}) {
+		std::mt19937 rng(1);
+		Sheet sheet;
+		if (journaled)
+			report("journal", "starting", timed([&] { sheet.recover(path); }), 1);
+		sheet.set_background([] {});
+		fill_random(sheet, ROWS, COLS, rng);
+		report("journal", journaled ? "edits journaled" : "edits not journaled",
+		       timed([&] { edit_random(sheet, ROWS, COLS, EDITS, rng); }), EDITS);
+		if (journaled) {
+			/* what a crash would leave behind, once the writer is done */
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			std::ifstream is(journal, std::ios::binary);
+			copy.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+		}
+		sheet.set_background(nullptr);
+	}
+	std::ofstream(journal, std::ios::binary) << copy;
+	Sheet sheet;
+	size_t n = 0;
+	report("journal", "recovery", timed([&] { n = sheet.recover(path); }), 1);
+	note("journal", "edits replayed", n, "");
+	note("journal", "size", copy.size(), "bytes");
+}
+
+/**
+ * Edits of single cells with history kept and not, removal
+ * of a million cells and undoing it, then undoing every edit
+ */
+static void
+bench_undo(void)
+{
+	constexpr unsigned ROWS = 100000, COLS = 10, EDITS = 100000;
+	Cell::Range all(Cell::Pos("A1"), Cell::Pos("J100000"));
+	for (bool kept : {false, true}) {
+		std::mt19937 rng(1);
+		Sheet sheet;
+		fill_random(sheet, ROWS, COLS, rng);
+		sheet.set_undo(kept ? (size_t)1 << 30 : 0);
+		report("undo", kept ? "edits kept" : "edits not kept",
+		       timed([&] { edit_random(sheet, ROWS, COLS, EDITS, rng); }), EDITS);
+		report("undo", kept ? "removing 1M kept" : "removing 1M not kept",
+		       timed([&] { sheet.remove(all); }), 1);
+		if (!kept)
+			continue;
+		report("undo", "undoing removal", timed([&] { sheet.undo(); }), 1);
+		report("undo", "redoing removal", timed([&] { sheet.redo(); }), 1);
+		sheet.undo();
+		report("undo", "undoing edits", timed([&] {
+			for (unsigned i = 0; i < EDITS; ++i)
+				sheet.undo();
+		}), EDITS);
+		note("undo", "cells after", sheet.summarize(all).count, "");
+	}
+}
+
+/**
+ * Import a CSV file parsed by one thread and by the whole
+ * pool, then export it back
+ */
+static void
+bench_csv(void)
+{
+	constexpr unsigned ROWS = 200000, COLS = 10;
+	const char *path = "/tmp/cells-bench.csv", *out = "/tmp/cells-bench-out.csv";
+	{
+		std::mt19937 rng(1);
+		std::ofstream fs(path);
+		for (unsigned r = 0; r < ROWS; ++r) {
+			fs << rng() % 100000 << ',' << (double)(rng() % 100000) / 8 << ",label" << rng() % 50
+			   << ",\"quoted, with \"\"quotes\"\" inside " << rng() % 1000 << '"';
+			for (unsigned c = 4; c < COLS; ++c)
+				fs << ',' << rng() % 1000;
+			fs << '\n';
+		}
+	}
+	double mb = file_mb(path);
+	size_t cells = (size_t)ROWS * COLS;
+	Sheet sheet;
+	unsigned threads = sheet.get_threads();
+	for (unsigned n : {1u, threads}) {
+		sheet.set_threads(n);
+		double ms = timed([&] { sheet.import_csv(path); });
+		std::string what = "import, " + std::to_string(n) + " thread" + (n > 1 ? "s" : "");
+		report("csv", what.c_str(), ms, cells);
+		note("csv", (what + " throughput").c_str(), mb / (ms / 1000), "MB/s");
+		note("csv", (what + " cells per second").c_str(), cells / (ms / 1000) / 1e6, "Mcells/s");
+		if (threads == 1)
+			break;
+	}
+	double ms = timed([&] { sheet.export_csv(out); });
+	report("csv", "export", ms, cells);
+	note("csv", "export throughput", file_mb(out) / (ms / 1000), "MB/s");
+	remove(path);
+	remove(out);
+}
+
+/**
+ * Edits made by a script run in batch mode against the
+ * same edits made on the sheet directly, then a script of
+ * whole-sheet commands
+ */
+static void
+bench_batch(void)
+{
+	constexpr unsigned ROWS = 100000, COLS = 10, EDITS = 100000;
+	std::mt19937 rng(1);
+	std::vector<std::pair<Cell::Pos, unsigned>> edits(EDITS);
+	std::string script;
+	for (auto &e : edits) {
+		e.first.row = rng() % ROWS + 1;
+		e.first.col = rng() % COLS + 1;
+		e.second = rng() % 1000;
+		script += "i " + e.first.get_addr() + " " + std::to_string(e.second) + "\n";
+	}
+	{
+		auto sheet = std::make_shared<Sheet>();
+		report("batch", "edits made directly", timed([&] {
+			for (auto &e : edits)
+				sheet->insert(Cell::Range(e.first, e.first), sheet->parse(std::to_string(e.second)));
+		}), EDITS);
+	}
+	auto sheet = std::make_shared<Sheet>();
+	std::ostringstream out;
+	Batch b(sheet, out);
+	sheet->set_undo(0);
+	std::istringstream edit_script(script);
+	report("batch", "edits by script", timed([&] { b.run(edit_script); }), EDITS);
+	std::istringstream whole("i K1:K100000 =SUM(A1:J1)\nrecalc\nsort A1:K100000 K\np A1:K100000\n");
+	report("batch", "fill, recalc, sort, print", timed([&] { b.run(whole); }), 1);
+	note("batch", "printed", out.str().size(), "bytes");
+}
+
+/**
+ * Sheets of 100k cells of different shapes, dense, sparse,
+ * wide and tall: inserting cells one by one, looking them
+ * up, walking viewports, placing cells on screen, saving
+ * and loading, rendering frames into a memory sink and
+ * removing cells a row at a time
+ */
+static void
+bench_shapes(void)
+{
+	constexpr unsigned CELLS = 100000, LOOKUPS = 1000000, VIEWS = 10000, FRAMES = 1000;
+	const char *text = "/tmp/cells-bench.cells", *binary = "/tmp/cells-bench.cellsb";
+	const struct {
+		const char *name;
+		unsigned rows, cols;
+		bool sparse; /* cells scattered at random */
+	} shapes[] = {
+		{ "dense", 1000, 100, false },
+		{ "sparse", 100000, 1000, true },
+		{ "wide", 10, 10000, false },
+		{ "tall", 100000, 1, false },
+	};
+	for (auto &sh : shapes) {
+		std::mt19937 rng(1);
+		auto sheet = std::make_shared<Sheet>();
+		std::vector<std::pair<Cell::Pos, Value>> cells(CELLS);
+		for (unsigned i = 0; i < CELLS; ++i) {
+			Cell::Pos &p = cells[i].first;
+			p.row = sh.sparse ? rng() % sh.rows + 1 : i / sh.cols + 1;
+			p.col = sh.sparse ? rng() % sh.cols + 1 : i % sh.cols + 1;
+			cells[i].second = i % 4 ? Value((int)(rng() % 1000)) : sheet->parse("label" + std::to_string(i % 100));
+		}
+		std::vector<Cell::Pos> probe(LOOKUPS);
+		for (auto &p : probe) {
+			p.row = rng() % sh.rows + 1;
+			p.col = rng() % sh.cols + 1;
+		}
+		std::vector<Cell::Range> views(VIEWS);
+		for (auto &v : views) {
+			v.begin = probe[rng() % LOOKUPS];
+			v.end.row = v.begin.row + 39;
+			v.end.col = v.begin.col + 9;
+		}
+		for (unsigned i = 0; i < sh.cols / 100 + 1; ++i)
+			sheet->set_col_siz(rng() % sh.cols + 1, rng() % 30 + 1);
+		for (unsigned i = 0; i < sh.rows / 100 + 1; ++i)
+			sheet->set_row_siz(rng() % sh.rows + 1, rng() % 3 + 1);
+		report(sh.name, "insert", timed([&] {
+			for (auto &c : cells)
+				sheet->insert(Cell::Range(c.first, c.first), c.second);
+		}), CELLS);
+		double sum = 0;
+		report(sh.name, "get", timed([&] {
+			for (auto &p : probe) {
+				const Value *v = sheet->get(p);
+				if (v)
+					sum += v->get_num();
+			}
+		}), LOOKUPS);
+		report(sh.name, "viewport 10x40", timed([&] {
+			for (auto &v : views)
+				sheet->for_each_in(v, [&sum](const Cell::Pos &, const Value &val) {
+					sum += val.get_num();
+				});
+		}), VIEWS);
+		report(sh.name, "get_abs_pos", timed([&] {
+			for (auto &p : probe)
+				sum += sheet->get_abs_pos(p).first;
+		}), LOOKUPS);
+		report(sh.name, "save text", timed([&] { sheet->save(text); }), CELLS);
+		report(sh.name, "save binary", timed([&] { sheet->save(binary); }), CELLS);
+		report(sh.name, "load text", timed([&] { Sheet().load(text); }), CELLS);
+		report(sh.name, "load binary", timed([&] { Sheet().load(binary); }), CELLS);
+		{
+			Display::COLS = 80;
+			Display::LINES = 24;
+			Display d(sheet, -1);
+			sheet->set_undo(0); /* edits below time the sheet alone */
+			report(sh.name, "frame 80x24", timed([&] {
+				for (unsigned i = 0; i < FRAMES; ++i) {
+					d.go_to(probe[i].get_addr());
+					d.redraw();
+				}
+			}), FRAMES);
+		}
+		report(sh.name, "remove rows", timed([&] {
+			Cell::Range r;
+			r.begin.col = 1;
+			r.end.col = sh.cols;
+			for (r.begin.row = 1; r.begin.row <= sh.rows; ++r.begin.row) {
+				r.end.row = r.begin.row;
+				sheet->remove(r);
+			}
+		}), sh.rows);
+		if (sum == 0)
+			printf("\n");
+	}
+	remove(text);
+	remove(binary);
+}
+
+/**
+ * Cost of probes: the same frames drawn with timers off,
+ * when probes only count, and on, along with what the
+ * probes tell of a frame
+ */
+static void
+bench_prof(void)
+{
+	constexpr unsigned FRAMES = 2000;
+	auto sheet = std::make_shared<Sheet>();
+	sheet->insert(Cell::Range("A1:ZZ2000"), Value(1000));
+	Display::COLS = 80;
+	Display::LINES = 24;
+	Display d(sheet, -1);
+	for (int on = 0; on < 2; ++on) {
+		Prof::enable(on);
+		report("prof", on ? "frame timed" : "frame counted", timed([&] {
+			for (unsigned i = 0; i < FRAMES; ++i) {
+				d.go_to(i % 2 ? "A1" : "B2");
+				d.redraw();
+			}
+		}), FRAMES);
+	}
+	Prof::enable(false);
+	for (unsigned p = Prof::TIMERS; p < Prof::PROBES; ++p)
+		note("prof", (std::string(Prof::name(Prof::Probe(p))) + " per frame").c_str(),
+		     Prof::last(Prof::Probe(p)), "");
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(void);
+} benches[] = {
+	{ "store", bench_store },
+	{ "axis", bench_axis },
+	{ "frame", bench_frame },
+	{ "formula", bench_formula },
+	{ "recalc", bench_recalc },
+	{ "threads", bench_threads },
+	{ "load", bench_load },
+	{ "open", bench_open },
+	{ "strings", bench_strings },
+	{ "fill", bench_fill },
+	{ "runs", bench_runs },
+	{ "agg", bench_agg },
+	{ "select", bench_select },
+	{ "sort", bench_sort },
+	{ "lookup", bench_lookup },
+	{ "save", bench_save },
+	{ "journal", bench_journal },
+	{ "undo", bench_undo },
+	{ "csv", bench_csv },
+	{ "batch", bench_batch },
+	{ "shapes", bench_shapes },
+	{ "prof", bench_prof },
+};
+
+int
+main(int argc, char *argv[])
+{
+	int picked = 0;
+	for (int i = 1; i < argc; ++i)
+		if (!strcmp(argv[i], "-j"))
+			json = true;
+		else
+			++picked;
+	if (json)
+		printf("{\"threads\": %u, \"results\": [\n", std::thread::hardware_concurrency());
+	for (auto &b : benches) {
+		bool run = !picked;
+		for (int i = 1; i < argc; ++i)
+			run |= !strcmp(argv[i], b.name);
+		if (run)
+			b.fn();
+	}
+	if (json)
+		printf("\n]}\n");
+	return 0;
+}
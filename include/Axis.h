@@ -0,0 +1,34 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Sizes of columns or rows along one axis of a sheet.
+ * Only sizes differing from the default are stored, sorted
+ * by index and accompanied by prefix sums of their difference
+ * from the default. This way both the offset of any column and
+ * the column found under any offset take a binary search.
+ */
+
+class Axis
+{
+	public:
+	struct Entry {
+		unsigned idx, siz;
+	};
+
+	Axis(unsigned);
+
+	unsigned get(unsigned) const;
+	void set(unsigned, unsigned);
+	unsigned offset(unsigned) const;
+	unsigned at(unsigned) const;
+	std::vector<Entry>::const_iterator begin(void) const;
+	std::vector<Entry>::const_iterator end(void) const;
+
+	private:
+	unsigned start(size_t) const;
+
+	unsigned m_def;
+	std::vector<Entry> m_siz;
+	std::vector<long long> m_sum; /* m_sum[n]: size surplus of first n entries */
+};
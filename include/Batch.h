@@ -0,0 +1,31 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Runs scripts of commands against a sheet with no terminal,
+ * for pipelines and jobs run unattended. A script has one
+ * command per line, named like keys and commands of the
+ * interface; blank lines and those starting with `#' are
+ * skipped. Ranges printed go to the output stream, tab
+ * separated, and a script stops at the first command that
+ * fails. Any command can be timed, which makes scripts
+ * benchmarks of the sheet as well.
+ */
+
+class Batch
+{
+	public:
+	Batch(std::shared_ptr<Sheet>, std::ostream &);
+
+	void set_filename(const std::string &);
+	size_t run(std::istream &);
+	void exec(const std::string &);
+
+	private:
+	void print(const Cell::Range &);
+
+	std::shared_ptr<Sheet> m_sheet;
+	std::ostream &m_out;
+	std::string m_filename; /* written to by default */
+	std::istringstream m_in; /* command being run, kept to be cheap to reset */
+};
@@ -14,11 +14,15 @@ class Cell
 		struct address_error : public std::runtime_error {
 			address_error(const std::string &);
 		};
+		struct Hash {
+			size_t operator()(const Pos &) const;
+		};
 
 		unsigned row, col;
 		bool row_iter, col_iter; /* is iterable */
 		Pos(void);
 		Pos(const std::string &);
+		static bool parse(std::string_view, Pos &);
 		bool operator<(const Pos &) const;
 		bool operator==(const Pos &) const;
 		bool operator<=(const Pos &) const;
@@ -33,15 +37,16 @@ class Cell
 		Range(Pos, Pos);
 		Range(const std::string &);
 		std::string get_addr(void) const;
+		bool operator==(const Range &) const;
 		bool contains(const Pos &) const;
 		unsigned index_of(const Pos &) const;
 	};
 
 	Cell(const Pos & = Pos(), const Value & = Value());
-	std::shared_ptr<Value> get_value(void) const;
-	Pos get_pos(void) const;
+	const Value &get_value(void) const;
+	const Pos &get_pos(void) const;
 
 	private:
-	std::shared_ptr<Value> m_value;
+	Value m_value;
 	Pos m_pos;
 };
@@ -0,0 +1,98 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Dependencies between formula cells.
+ * Maps precedents, cells a formula refers to, onto its
+ * dependents. Single cell references are kept in a hash map
+ * keyed by the referenced cell. Range references are kept as
+ * intervals of rows, not expanded per cell: sorted by their
+ * first row, the array is read as an implicit binary search
+ * tree where every node also knows the last row covered
+ * by its subtree, so ranges overlapping a given one are found
+ * without looking at ones that can't overlap.
+ */
+
+class Deps
+{
+	public:
+	Deps(void);
+
+	void add(const Cell::Pos &, const Cell::Range &);
+	void remove(const Cell::Pos &, const Cell::Range &);
+	void clear(void);
+	template <typename F> void dependents(const Cell::Range &, F) const;
+
+	private:
+	struct Interval {
+		Cell::Range prec;
+		Cell::Pos dep;
+		unsigned reach; /* last row of intervals in subtree */
+	};
+
+	void flush(void) const;
+
+	std::unordered_map<Cell::Pos, std::vector<Cell::Pos>, Cell::Pos::Hash> m_cells;
+	mutable std::vector<Interval> m_ranges;
+	mutable size_t m_sorted; /* intervals past this one wait to be merged in */
+	mutable unsigned m_depth; /* of the tree */
+	mutable std::unordered_set<Cell::Pos, Cell::Pos::Hash> m_gone; /* dependents to be dropped */
+};
+
+/**
+ * Call `fn(dep)' for every dependent of any cell within a range;
+ * a dependent referring to the range several times is passed
+ * as many times.
+ */
+template <typename F> void
+Deps::dependents(const Cell::Range &r, F fn) const
+{
+	uint64_t area = (uint64_t)(r.end.row - r.begin.row + 1) * (r.end.col - r.begin.col + 1);
+	if (area > m_cells.size()) {
+		for (auto &c : m_cells)
+			if (r.contains(c.first))
+				for (auto &d : c.second)
+					fn(d);
+	} else {
+		for (Cell::Pos p = r.begin; p.col <= r.end.col; ++p.col)
+			for (p.row = r.begin.row; p.row <= r.end.row; ++p.row) {
+				auto it = m_cells.find(p);
+				if (it != m_cells.end())
+					for (auto &d : it->second)
+						fn(d);
+			}
+	}
+	flush();
+	if (m_ranges.empty())
+		return;
+	/* node at level k has index with k lowest bits set */
+	struct Node {
+		unsigned k;
+		size_t x;
+		bool left_done;
+	};
+	size_t n = m_ranges.size(), sp = 0;
+	Node stack[2 * 64]; /* at most two nodes per level */
+	stack[sp++] = Node{m_depth, ((size_t)1 << m_depth) - 1, false};
+	auto hit = [&](const Interval &i) {
+		if (i.prec.end.row >= r.begin.row && i.prec.begin.col <= r.end.col && i.prec.end.col >= r.begin.col)
+			fn(i.dep);
+	};
+	while (sp) {
+		Node z = stack[--sp];
+		if (z.k <= 2) {
+			/* small subtree; scan it */
+			size_t i = z.x >> z.k << z.k, e = std::min(i + ((size_t)1 << (z.k + 1)) - 1, n);
+			for (; i < e && m_ranges[i].prec.begin.row <= r.end.row; ++i)
+				hit(m_ranges[i]);
+		} else if (!z.left_done) {
+			size_t y = z.x - ((size_t)1 << (z.k - 1));
+			stack[sp++] = Node{z.k, z.x, true};
+			if (y >= n || m_ranges[y].reach >= r.begin.row)
+				stack[sp++] = Node{z.k - 1, y, false};
+		} else if (z.x < n && m_ranges[z.x].prec.begin.row <= r.end.row) {
+			hit(m_ranges[z.x]);
+			stack[sp++] = Node{z.k - 1, z.x + ((size_t)1 << (z.k - 1)), false};
+		}
+	}
+}
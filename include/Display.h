@@ -5,7 +5,8 @@
  * This class handles terminal-based display and user input.
  * It manipulates current terminal flags to switch between
  * input and interactive modes and does the rendering by
- * printng sequences of escape codes.
+ * drawing into a screen buffer, which is then written out
+ * as sequences of escape codes.
  */
 
 class Display
@@ -17,41 +18,83 @@ class Display
 		COMMAND
 	};
 
-	Display(std::shared_ptr<Sheet>);
+	Display(std::shared_ptr<Sheet>, int fd = 1); /* stdout by default */
 	~Display(void);
 
 	void take_cmd(void);
 	void take_input(void);
+	void key(char);
 	void take_value(void);
 	void set_sheet_filename(const std::string &);
+	void go_to(const std::string &);
+	void sort(const std::string &);
+	void search(void);
+	void find_next(void);
 	void save_sheet(void);
+	void check_save(void);
 	void load_sheet(void);
+	void recover_sheet(void);
+	void import_sheet(const std::string &);
+	void export_sheet(const std::string &);
+	void redraw(void);
 
 	static void update_win_size(void);
 	static unsigned int COLS, LINES;
 
 	private:
 	struct Tty; /* hides termios data struct from this interface */
+	enum Look {
+		CELL,
+		NUMBER,
+		TEXT,
+		MARGIN,
+		MODE,
+		STATUS,
+		ERROR,
+		LOOKS
+	};
 
-	void clear(void);
-	void move(unsigned, unsigned);
 	void set_raw(void);
 	void set_cooked(void);
 	void update_view(void);
 	void update_hview(void); /* update horizontal view */
 	void update_vview(void); /* update vertical view */
+	Cell::Pos last_visible(const Cell::Pos &) const;
+	Cell::Pos first_visible(const Cell::Pos &) const;
+	Cell::Range visible(const Cell::Range &) const;
 	void print_err(const char *);
 
 	std::pair<unsigned, unsigned> get_disp_pos(const Cell::Pos &) const;
-	void draw_status_bar(const std::string &str = "");
-	void draw_cell(const std::string &s, unsigned l, bool highlight = false, bool fill = true, int fg = -1, int bg = -1);
+	void redraw_cursor(const Cell::Range &);
+	void draw_status_bar(void);
+	std::string summary(void);
+	void update_summary(void);
+	void draw_msg(void);
+	void draw_stats(void); /* profiling overlay */
+	void draw_cell(unsigned, unsigned, std::string_view, unsigned, Look, bool highlight = false, bool fill = true);
+	void draw_pos(const Cell::Pos &);
+	void draw_value(unsigned, unsigned, const Value &, unsigned, bool);
 	void draw_margins(void);
+	void draw_margin_col(unsigned);
+	void draw_margin_row(unsigned);
 	void draw_cells(void); /* draw all the cells within view range */
 
 	std::unique_ptr<Tty> m_tty;
 	std::shared_ptr<Sheet> m_sheet;
+	Screen m_screen;
+	Screen::Style m_style[LOOKS][2]; /* plain and highlighted */
 	Cell::Range m_view, m_cursor;
+	Store::Summary m_sel; /* of numbers selected */
+	Cell::Range m_sel_range; /* the summary is of */
+	uint64_t m_sel_version; /* of cells the summary is of */
 	std::string m_filename;
+	std::string m_saving; /* file being saved in the background */
+	std::string m_search; /* last pattern searched for */
+	std::string m_status, m_msg; /* status bar text, one-off message */
+	bool m_msg_err;
 	bool m_taking_input;
+	bool m_damaged; /* more than cursor position changed */
+	size_t m_key_bytes; /* written in response to the last key */
+	bool m_stats; /* profiling overlay shown */
 	Mode m_mode;
 };
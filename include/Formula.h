@@ -0,0 +1,90 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Formula of a cell.
+ * Formula text is compiled once into bytecode for a small
+ * stack machine. Cell references stay relative to the cell
+ * formula was entered into, unless anchored with `$', so one
+ * compiled formula is shared by all cells of a filled range.
+ * Aggregate functions fold their arguments into accumulators
+ * kept on a separate stack; whole ranges are folded by a
+ * single instruction, which has the store sum them up.
+ * Lookups likewise have the store find the row matching
+ * a key, through an index of the column searched.
+ */
+
+class Formula
+{
+	public:
+	struct syntax_error : public std::runtime_error {
+		syntax_error(const std::string &);
+	};
+
+	Formula(const std::string &, const Cell::Pos &);
+
+	Value eval(const Cell::Pos &, const Store &) const;
+	std::string get_src(const Cell::Pos &) const;
+	const Cell::Pos &get_origin(void) const;
+	template <typename F> void each_ref(const Cell::Pos &, F) const;
+
+	private:
+	class Parser;
+	enum Op : unsigned char {
+		NUM, /* push constant */
+		REF, /* push value of a cell */
+		ADD,
+		SUB,
+		MUL,
+		DIV,
+		POW,
+		NEG,
+		ABS,
+		SQRT,
+		AGG, /* push accumulator for a function */
+		AGG_VAL, /* fold value from stack into accumulator */
+		AGG_RANGE, /* fold range of cells into accumulator */
+		AGG_END, /* replace accumulator with its result */
+		VLOOKUP /* replace key, column and match type with value found in range */
+	};
+	struct Instr {
+		Op op;
+		unsigned arg;
+	};
+	struct Ref {
+		int row, col; /* offset from origin when iterable, address otherwise */
+		bool row_iter, col_iter;
+	};
+	struct Span {
+		size_t begin, len; /* position in source text */
+		unsigned ref; /* index of reference; ranges take two */
+		bool range;
+	};
+
+	bool resolve(const Ref &, const Cell::Pos &, Cell::Pos &) const;
+	bool resolve(unsigned, const Cell::Pos &, Cell::Range &) const;
+
+	std::string m_src;
+	Cell::Pos m_origin;
+	std::vector<Instr> m_code;
+	std::vector<double> m_num;
+	std::vector<Ref> m_refs;
+	std::vector<Span> m_spans;
+};
+
+/**
+ * Call `fn(range)' for every cell or range referenced
+ * by formula placed at a given cell; single cells are
+ * passed as one-cell ranges.
+ */
+template <typename F> void
+Formula::each_ref(const Cell::Pos &at, F fn) const
+{
+	Cell::Range r;
+	for (auto &s : m_spans)
+		if (s.range ? resolve(s.ref, at, r) : resolve(m_refs[s.ref], at, r.begin)) {
+			if (!s.range)
+				r.end = r.begin;
+			fn(r);
+		}
+}
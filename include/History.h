@@ -0,0 +1,52 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * History of edits of a sheet, for undoing and redoing them.
+ * An entry holds only what an edit changed, as it was before:
+ * contents of the range of cells written, kept by the store
+ * so that big ranges cost a tile each and share the tiles
+ * with the store, along with formulas of the range; or size
+ * of a column or row. Undoing the edit puts that back, the
+ * entry keeping what it replaced instead, to redo the edit.
+ * Entries are kept within a limit of memory, the oldest ones
+ * being forgotten first.
+ */
+
+class History
+{
+	public:
+	enum Kind : unsigned char {
+		CELLS,
+		COL_SIZ,
+		ROW_SIZ
+	};
+	typedef std::vector<std::pair<Cell::Pos, std::shared_ptr<const Formula>>> Formulas;
+	struct Entry {
+		size_t bytes(void) const;
+		Kind kind;
+		Cell::Range range; /* of cells; a column or row resized is at its beginning */
+		Store::Region cells; /* contents of the range */
+		Formulas formulas; /* of the range */
+		unsigned siz; /* of column or row */
+		size_t epoch; /* of the journal as the entry was made or last applied */
+		size_t size; /* bytes counted against the limit */
+	};
+
+	History(void);
+
+	void set_max(size_t);
+	size_t get_max(void) const;
+	size_t get_bytes(void) const;
+	bool empty(bool) const;
+	void add(Entry &&);
+	Entry take(bool);
+	void put(Entry &&, bool);
+	void clear(void);
+
+	private:
+	void trim(void);
+
+	std::deque<Entry> m_undo, m_redo; /* latest at the back */
+	size_t m_bytes, m_max;
+};
@@ -0,0 +1,90 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Journal of edits of a sheet, kept next to its file so
+ * edits not saved yet survive the program being killed.
+ * Every edit is appended as a record to a buffer, which a
+ * thread of the journal writes out and syncs to disk; edits
+ * made while it's syncing go out together with the next
+ * write, so editing never waits for the disk.
+ * A journal is kept either over the sheet file as it was
+ * when the journal was started, told by its inode, size and
+ * time of modification, or over a checkpoint: a copy of the
+ * sheet in binary format heading the journal itself. Taking
+ * a checkpoint makes a new journal that replaces the old
+ * one once it's synced, so the journal stays short.
+ * Records carry their length and a checksum; replay stops
+ * at the first one torn by a crash. Undoing an edit is
+ * journaled as just that, history being rebuilt by replay,
+ * unless the edit came before the last checkpoint; then
+ * what the edit is undone to is journaled instead.
+ * Importing a file is journaled by its path, and followed
+ * by a checkpoint so the file isn't needed for long.
+ */
+
+class Journal
+{
+	public:
+	enum Op : unsigned char {
+		INSERT,
+		REMOVE,
+		SORT,
+		COL_SIZ,
+		ROW_SIZ,
+		UNDO,
+		REDO,
+		IMPORT
+	};
+	struct Edit {
+		Op op;
+		Cell::Range range; /* of cells; a column or row resized is at its beginning */
+		Value value; /* inserted, or path of a file imported */
+		unsigned n; /* column sorted by or size set */
+		bool desc; /* sorted in descending order */
+		Op of; /* edit undone or redone, the same as op if it's taken from history */
+		std::vector<std::pair<Cell::Pos, Value>> cells; /* range is left with, if that edit is INSERT */
+	};
+
+	Journal(const std::string &);
+	~Journal(void);
+
+	const std::string &get_path(void) const;
+	void start(void);
+	void resume(size_t, size_t, bool);
+	void insert(const Cell::Range &, const Value &);
+	void remove(const Cell::Range &);
+	void sort(const Cell::Range &, unsigned, bool);
+	void resize(Op, unsigned, unsigned);
+	void step(Op, const Cell::Range &);
+	void restore(Op, Op, const Cell::Range &, unsigned, const std::vector<std::pair<Cell::Pos, Value>> &);
+	void import(const std::string &);
+	size_t size(void) const;
+	size_t epoch(void) const;
+	bool standalone(void) const;
+	std::string get_error(void);
+	std::string checkpoint(void);
+	void commit(void);
+	void abort(void);
+	static size_t head(std::string_view, const std::string &);
+	static size_t replay(std::string_view, const std::function<void(const Edit &)> &);
+
+	private:
+	Journal(const Journal &) = delete;
+	void attach(int, size_t, bool);
+	void append(Op, const Cell::Range &, const std::string &);
+	void run(void);
+
+	std::string m_file, m_path; /* sheet file and the journal */
+	int m_fd; /* journal being appended to */
+	std::string m_buf; /* records not written yet */
+	std::string m_held; /* records since a checkpoint began, for the journal it makes */
+	size_t m_size; /* bytes of records since the journal was started */
+	size_t m_epoch; /* checkpoints begun */
+	bool m_standalone; /* kept over a checkpoint rather than the sheet file */
+	bool m_checkpoint, m_writing, m_stop;
+	int m_err; /* of a write that failed, until told */
+	mutable std::mutex m_lock;
+	std::condition_variable m_work, m_idle; /* records to write, writer done */
+	std::thread m_writer;
+};
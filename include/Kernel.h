@@ -0,0 +1,27 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Kernels summing up numbers of the store.
+ * A kernel folds a block of TILE_SIZ doubles, those marked
+ * in a bitmap, into a summary at once: count, sum, extremes
+ * and sums of differences from a shift and their squares,
+ * which give variance without losing precision.
+ * The widest vector version the processor runs is picked on
+ * first use; the scalar one works everywhere.
+ */
+
+class Kernel
+{
+	public:
+	enum Level {
+		SCALAR,
+		SSE2,
+		AVX2
+	};
+
+	static void fold(Store::Summary &, const double *, uint64_t);
+	static Level get_level(void);
+	static Level set_level(Level);
+	static const char *name(Level);
+};
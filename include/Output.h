@@ -0,0 +1,47 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Terminal output buffer.
+ * Escape sequences and text of a whole frame are appended
+ * to a single buffer that keeps its capacity between frames,
+ * and written out with one write(2) call.
+ * Negative file descriptor makes a memory sink that only
+ * counts bytes; it's used for measurements.
+ */
+
+class Output
+{
+	public:
+	Output(int);
+
+	void put(char);
+	void put(const char *, size_t);
+	void put(std::string_view);
+	void put_uint(unsigned);
+	void move(unsigned, unsigned);
+	size_t flush(void);
+	size_t size(void) const;
+
+	private:
+	int m_fd;
+	std::string m_buf;
+};
+
+inline void
+Output::put(char c)
+{
+	m_buf.push_back(c);
+}
+
+inline void
+Output::put(const char *s, size_t n)
+{
+	m_buf.append(s, n);
+}
+
+inline void
+Output::put(std::string_view s)
+{
+	m_buf.append(s.data(), s.size());
+}
@@ -0,0 +1,102 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Work-stealing thread pool.
+ * A job is a number of independent items split into chunks
+ * that are dealt out to per-thread queues; a thread runs
+ * chunks off the back of its own queue and once it's empty
+ * steals from the front of the others. The thread that
+ * submits a job works on it as well and returns when all
+ * the items are done.
+ * Sorting splits an array into a piece per thread, sorts
+ * the pieces side by side and merges them pairwise.
+ */
+
+class Pool
+{
+	public:
+	Pool(unsigned = 0);
+	~Pool(void);
+
+	void resize(unsigned);
+	unsigned size(void) const;
+	template <typename F> void run(size_t, F);
+	template <typename T, typename C> void sort(std::vector<T> &, C);
+
+	private:
+	static constexpr size_t SORT_MIN = 4096; /* least items of a piece sorted apart */
+
+	struct Chunk {
+		size_t begin, end;
+	};
+	struct Queue {
+		std::mutex lock;
+		std::deque<Chunk> chunks;
+	};
+
+	void start(unsigned);
+	void stop(void);
+	void exec(size_t, const std::function<void(size_t)> &);
+	void work(unsigned);
+	void drain(unsigned);
+	bool take(unsigned, Chunk &);
+
+	std::vector<std::thread> m_threads;
+	std::vector<std::unique_ptr<Queue>> m_queues; /* last one belongs to submitting thread */
+	std::mutex m_lock;
+	std::condition_variable m_wake, m_done;
+	const std::function<void(size_t)> *m_job;
+	std::atomic<size_t> m_left; /* items of current job not done yet */
+	unsigned m_gen; /* bumped for every job */
+	bool m_quit;
+};
+
+/**
+ * Call `fn(i)' for every `i' from 0 to `n' - 1,
+ * spread among threads of the pool
+ */
+template <typename F> void
+Pool::run(size_t n, F fn)
+{
+	if (m_threads.empty() || n < 2) {
+		for (size_t i = 0; i < n; ++i)
+			fn(i);
+		return;
+	}
+	exec(n, std::function<void(size_t)>(fn));
+}
+
+/**
+ * Sort an array by `less', keeping items that compare
+ * equal in their order
+ */
+template <typename T, typename C> void
+Pool::sort(std::vector<T> &v, C less)
+{
+	size_t n = v.size(), k = std::min<size_t>(size(), n / SORT_MIN);
+	if (k < 2) {
+		std::stable_sort(v.begin(), v.end(), less);
+		return;
+	}
+	std::vector<size_t> at(k + 1);
+	for (size_t i = 0; i <= k; ++i)
+		at[i] = n * i / k;
+	run(k, [&](size_t i) {
+		std::stable_sort(v.begin() + at[i], v.begin() + at[i + 1], less);
+	});
+	std::vector<T> tmp(n);
+	for (; k > 1; k = (k + 1) / 2) {
+		run((k + 1) / 2, [&](size_t i) {
+			auto a = std::make_move_iterator(v.begin() + at[2 * i]);
+			auto b = std::make_move_iterator(v.begin() + at[std::min(2 * i + 1, k)]);
+			auto e = std::make_move_iterator(v.begin() + at[std::min(2 * i + 2, k)]);
+			std::merge(a, b, b, e, tmp.begin() + at[2 * i], less);
+		});
+		v.swap(tmp);
+		for (size_t i = 0; 2 * i <= k; ++i)
+			at[i] = at[std::min(2 * i, k)];
+		at.resize((k + 1) / 2 + 1);
+		at.back() = n;
+	}
+}
@@ -0,0 +1,99 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Profiling probes of hot paths: scoped timers and counters
+ * summed up per thread, so probes of threads never contend.
+ * Timers read the clock only while profiling is turned on;
+ * counters always count, being as cheap as an addition.
+ * A frame of the interface takes what probes of its thread
+ * added up to while it was being drawn as its values, which
+ * go into a histogram per probe. Timed scopes and frames
+ * can be recorded as a trace of Chrome's trace event format.
+ * Probes are put in by macros, which compile to nothing if
+ * NPROF is defined.
+ */
+
+#ifdef NPROF
+#define PROF_SCOPE(probe)
+#define PROF_COUNT(probe, n)
+#define PROF_FRAME()
+#else
+#define PROF_SCOPE(probe) Prof::Scope prof_scope(Prof::probe)
+#define PROF_COUNT(probe, n) Prof::count(Prof::probe, n)
+#define PROF_FRAME() Prof::Frame prof_frame
+#endif
+
+class Prof
+{
+	public:
+	enum Probe : unsigned char {
+		/* timers, in nanoseconds */
+		FRAME,
+		CELLS, /* walking and placing cells of the view */
+		EMIT, /* writing out what changed */
+		LOAD,
+		TIMERS,
+		/* counters */
+		BYTES = TIMERS, /* written to the terminal */
+		VISITED, /* cells of the sheet looked at */
+		DRAWN, /* glyphs of the screen changed */
+		LOOKUPS, /* of tiles of cells */
+		ABS_POS, /* cells placed on screen, too many to time each */
+		PROBES
+	};
+	struct Histogram {
+		static constexpr unsigned BUCKETS = 65; /* by bit length of values */
+		void add(uint64_t);
+		uint64_t quantile(double) const;
+		uint64_t buckets[BUCKETS];
+		uint64_t count;
+	};
+	class Scope;
+	class Frame;
+
+	static void enable(bool);
+	static bool enabled(void);
+	static void count(Probe, uint64_t);
+	static uint64_t last(Probe);
+	static uint64_t latest(Probe);
+	static const Histogram &histogram(Probe);
+	static const char *name(Probe);
+	static void trace(const std::string &);
+	static bool tracing(void);
+	static void finish(void);
+
+	private:
+	static uint64_t now(void);
+	static void record(Probe, uint64_t, uint64_t, const uint64_t * = nullptr);
+};
+
+/*
+ * Timer of a scope: time spent within it is added to
+ * its probe
+ */
+class Prof::Scope
+{
+	public:
+	Scope(Probe);
+	~Scope(void);
+
+	private:
+	Probe m_probe;
+	uint64_t m_start; /* zero if not timed */
+};
+
+/*
+ * Frame drawn: probes of the thread are taken as they
+ * were before and after it
+ */
+class Prof::Frame
+{
+	public:
+	Frame(void);
+	~Frame(void);
+
+	private:
+	uint64_t m_start; /* zero if not profiled */
+	uint64_t m_sums[PROBES];
+};
@@ -0,0 +1,51 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Screen contents kept in memory.
+ * Everything is drawn into a back buffer first; flushing
+ * compares it against what the terminal is known to show
+ * and emits escape codes only for the spans that differ.
+ * Text attributes are registered up front as styles, so
+ * their escape codes are built only once.
+ * Coordinates are those of the terminal, counted from 1.
+ */
+
+class Screen
+{
+	public:
+	typedef unsigned char Style;
+	struct Attr {
+		short fg, bg; /* 256 colour palette index or -1 for default */
+		bool bold, inverse;
+	};
+
+	Screen(int);
+
+	Style style(const Attr &);
+	void resize(unsigned, unsigned);
+	void clear(void);
+	void clear_line(unsigned);
+	void put(unsigned, unsigned, std::string_view, unsigned, Style, bool fill = true);
+	void invalidate(void);
+	size_t flush(unsigned, unsigned);
+	void write(std::string_view);
+	size_t get_bytes(void) const;
+	size_t get_frame_bytes(void) const;
+
+	private:
+	struct Glyph {
+		char ch;
+		Style style;
+		bool operator==(const Glyph &) const;
+	};
+
+	Glyph *at(std::vector<Glyph> &, unsigned, unsigned);
+
+	Output m_out;
+	std::vector<std::string> m_sgr; /* escape code of every style */
+	std::vector<Glyph> m_back, m_front;
+	unsigned m_cols, m_lines;
+	bool m_valid; /* front buffer reflects the terminal */
+	size_t m_bytes, m_frame_bytes;
+};
@@ -3,22 +3,63 @@
  * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
  *
  * This class manages spreadheet data.
- * Cells and spreadsheet dimensions are stored in a map
- * so the address of a given cell is unconstrained.
+ * Cells are kept in a tiled store and spreadsheet dimensions
+ * in a sparse index of sizes so the address of a given cell
+ * is unconstrained.
  * Arbitrary string can be converted to adequate value type
  * by using parse method.
+ * Values are searched for through indexes of columns kept
+ * by the store.
+ * Formulas are tracked in a dependency graph so an edit only
+ * recomputes cells that depend on what was changed.
+ * Recalculation goes level by level in dependency order,
+ * cells of a level being evaluated by a pool of threads.
+ * It can also run in the background, in which case readers
+ * of cell values must hold the lock of the sheet.
+ * Sheets are saved either as text or in a binary format,
+ * picked by file name extension or contents of the file
+ * being overwritten. Binary files are read lazily: cells
+ * are decoded as they're first looked at, and values of
+ * formulas are saved so they're not recomputed on load.
+ * Saving can go on in the background too: it writes a copy
+ * of the sheet that shares tiles of cells with it, a tile
+ * being copied only as it's written before the save is done.
+ * Edits can be journaled next to the sheet file, to be
+ * recovered if the program dies before they're saved; the
+ * journal is kept short by checkpoints written the same way.
+ * Cells can be imported from CSV files, parsed in pieces by
+ * the pool of threads, and exported to them.
+ * Edits are kept in a history for undoing them as well, each
+ * with contents of the cells it wrote as they were before.
  */
 
 class Sheet
 {
 	public:
+	struct Stats {
+		size_t cells; /* recomputed after the last edit */
+		size_t cycles; /* of them caught in cycles */
+		size_t total; /* recomputed since the sheet was created */
+	};
+
 	Sheet(void);
 	~Sheet(void);
 
 	void insert(const Cell::Range &, const Value &);
 	void remove(const Cell::Range &);
-	Value parse(const std::string &);
-	std::vector<Cell> get_cells(const Cell::Range &) const;
+	void sort(const Cell::Range &, unsigned, bool = false);
+	bool undo(void);
+	bool redo(void);
+	void set_undo(size_t);
+	size_t get_undo(void) const;
+	Cell::Range bounds(void) const;
+	Value parse(std::string_view);
+	const Value *get(const Cell::Pos &) const;
+	template <typename F> void for_each_in(const Cell::Range &, F) const;
+	Store::Query query(const Cell::Range &) const;
+	Store::Summary summarize(const Cell::Range &) const;
+	bool find(std::string_view, const Cell::Pos &, Cell::Pos &);
+	uint64_t version(void) const;
 	unsigned get_col_siz(unsigned) const;
 	unsigned get_row_siz(unsigned) const;
 	void set_col_siz(unsigned, unsigned);
@@ -26,10 +67,75 @@ class Sheet
 	void increase_col_siz(unsigned);
 	void decrease_col_siz(unsigned);
 	std::pair<unsigned, unsigned> get_abs_pos(const Cell::Pos &) const;
+	Cell::Pos get_pos_at(unsigned, unsigned) const;
 	void load(const std::string &);
+	size_t recover(const std::string &);
 	void save(const std::string &) const;
+	void save_background(const std::string &);
+	size_t import_csv(const std::string &);
+	size_t export_csv(const std::string &);
+	int saving(void) const;
+	bool saved(std::string &);
+	std::string journal_error(void);
+	void recalc(void);
+	void wait(void);
+	bool busy(void) const;
+	void set_background(std::function<void(void)>);
+	void set_threads(unsigned);
+	unsigned get_threads(void) const;
+	std::unique_lock<std::mutex> lock(void) const;
+	Stats get_stats(void) const;
 
 	private:
-	std::map<unsigned, unsigned> m_col_siz, m_row_siz;
-	std::map<Cell::Pos, Cell> m_cells;
+	struct Image;
+
+	void recalc(const Cell::Range &);
+	void start(std::vector<Cell::Pos> &);
+	void stop(void);
+	void recompute(const std::vector<Cell::Pos> &);
+	void load_text(std::string_view);
+	void load_binary(std::string_view, std::shared_ptr<const void>);
+	std::unique_ptr<Image> image(void) const;
+	void spawn(const std::string &, bool);
+	void checkpoint(bool = false);
+	static void write(Image &, const std::string &);
+	static void save_text(std::ostream &, Image &);
+	static void save_binary(std::ostream &, Image &);
+	void set_formula(const Cell::Pos &, std::shared_ptr<const Formula>);
+	void bind(const Cell::Pos &, std::shared_ptr<const Formula>);
+	void drop_formulas(const Cell::Range &);
+	History::Formulas formulas(const Cell::Range &) const;
+	History::Entry keep(const Cell::Range &) const;
+	History::Entry keep(History::Kind, unsigned) const;
+	bool step(bool);
+	void apply(const Journal::Edit &);
+	void reset(void);
+	void revert(const Journal::Edit &);
+
+	Axis m_col_siz, m_row_siz;
+	Store m_cells;
+	Deps m_deps;
+	std::unordered_map<Cell::Pos, std::shared_ptr<const Formula>, Cell::Pos::Hash> m_formulas;
+	Stats m_stats;
+	Pool m_pool;
+	std::thread m_job; /* background recalculation */
+	std::atomic<bool> m_busy, m_cancel;
+	std::function<void(void)> m_notify; /* called as values land */
+	std::vector<Cell::Pos> m_left; /* cells cancelled recalculation didn't get to */
+	mutable std::mutex m_lock; /* held while results are written */
+	std::thread m_saver; /* background save */
+	std::unique_ptr<Image> m_save; /* copy of the sheet it's writing */
+	std::unique_ptr<Journal> m_journal; /* of edits not saved yet */
+	History m_history; /* of edits, for undoing them */
 };
+
+/**
+ * Call `fn(pos, value)' for every cell holding a value
+ * within a range; values are passed by reference, nothing
+ * is copied or allocated.
+ */
+template <typename F> void
+Sheet::for_each_in(const Cell::Range &r, F fn) const
+{
+	m_cells.for_each(r, fn);
+}
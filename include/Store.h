@@ -0,0 +1,391 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ *
+ * Cell storage of a sheet.
+ * Cells are grouped into square tiles of TILE_SIZ x TILE_SIZ
+ * that are allocated on demand and indexed by tile coordinates,
+ * so empty regions of a sheet take no space at all.
+ * Inside a tile every column is a flat array of values with
+ * a presence bitmap; numbers are additionally mirrored into
+ * a plain array of doubles so numeric scans don't have to
+ * look at Value at all. Cells whose values are results of
+ * formulas are marked in a separate bitmap.
+ * Ranges filled with one value, or with numbers growing by
+ * one from cell to cell as Sheet::insert makes them, are kept
+ * as runs: the value of the first cell and the rectangle the
+ * run covers within a tile. A run is split only as a cell of
+ * it is written or removed; tiles holding nothing but runs
+ * don't allocate their columns at all.
+ * Numbers of a range are summed up by vector kernels going
+ * straight through the arrays of doubles.
+ * Columns that values are looked up in get an index, built
+ * as a column is first searched and kept up to date as its
+ * cells are written; big ranges written over it just drop
+ * it, to be built again by the next search.
+ * Strings of cells are interned in a pool of the store,
+ * which is purged of unused ones as cells are dropped.
+ * Tiles can be encoded into blocks of a binary sheet file;
+ * a store attached to such file decodes every tile only when
+ * it's first accessed.
+ * Copying a store takes a snapshot of it: tiles are shared
+ * by both copies, a tile being copied only as either of them
+ * writes to it. Contents of a range can be kept the same way,
+ * to be put back later: tiles of big ranges are shared, cells
+ * of small ones copied.
+ */
+
+class Store
+{
+	public:
+	static constexpr unsigned TILE_BITS = 6;
+	static constexpr unsigned TILE_SIZ = 1 << TILE_BITS;
+	static constexpr unsigned TILE_MASK = TILE_SIZ - 1;
+
+	struct Column {
+		Column(void);
+		uint64_t present; /* bit n is set if row n holds a value */
+		uint64_t numeric; /* subset of present rows holding numbers */
+		uint64_t formula; /* subset of present rows computed by formulas */
+		double num[TILE_SIZ];
+		Value val[TILE_SIZ];
+	};
+	struct Run {
+		bool has(unsigned, unsigned) const;
+		Value at(unsigned, unsigned) const;
+		Value base; /* value of the first cell */
+		unsigned char r0, r1, c0, c1; /* rows and columns within tile, inclusive */
+	};
+	struct Tile {
+		Tile(void);
+		Tile(const Tile &);
+		Column *get(unsigned) const;
+		Column &make(unsigned);
+		uint64_t run_rows(unsigned, bool, unsigned char *) const;
+		std::unique_ptr<std::unique_ptr<Column>[]> col; /* TILE_SIZ of them, allocated with the first column */
+		std::vector<Run> runs; /* cells not in columns */
+		unsigned count; /* values held by the tile */
+		std::atomic<const char *> src; /* encoded contents, until decoded */
+		uint32_t len; /* of encoded contents */
+	};
+	struct Entry {
+		const Cell::Pos &pos;
+		const Value &value;
+	};
+	struct Region {
+		Region(void);
+		Cell::Range extent(void) const;
+		size_t bytes(void) const;
+		Cell::Range range; /* of cells kept */
+		bool whole; /* kept by whole tiles */
+		std::vector<std::pair<uint64_t, std::shared_ptr<Tile>>> tiles; /* overlapping range, if whole */
+		std::vector<std::pair<Cell::Pos, Value>> cells; /* in range otherwise */
+		std::vector<bool> formula; /* of those cells, computed by formulas */
+	};
+	struct Summary {
+		Summary(void);
+		void add(double);
+		void add(double, size_t);
+		void add(const Summary &);
+		void remove(const Summary &);
+		double variance(void) const;
+		size_t count; /* of numbers */
+		double sum, min, max;
+		double shift, dsum, dsq; /* sums of differences of numbers from shift and of their squares */
+		int err; /* first error come across or -1 */
+	};
+	enum Match {
+		EXACT, /* value equal to the key */
+		BELOW, /* greatest value of type of the key not above it */
+		PREFIX /* string beginning with the key */
+	};
+	class Query;
+	class Bulk;
+	class Strings;
+	class Index;
+
+	Store(void);
+	Store(const Store &);
+
+	void set(const Cell::Pos &, const Value &, bool formula = false);
+	void fill(const Cell::Range &, const Value &, bool formula = false);
+	bool erase(const Cell::Pos &);
+	size_t erase(const Cell::Range &);
+	const Value *get(const Cell::Pos &) const;
+	bool is_formula(const Cell::Pos &) const;
+	size_t size(void) const;
+	Cell::Range bounds(void) const;
+	uint64_t version(void) const;
+	void clear(void);
+	template <typename F> void for_each(F, uint64_t Column::*rows = &Column::present,
+	                                    bool runs = true) const;
+	template <typename F> void for_each(const Cell::Range &, F,
+	                                    uint64_t Column::*rows = &Column::present) const;
+	Query query(const Cell::Range &) const;
+	Summary summarize(const Cell::Range &) const;
+	bool find(const Cell::Range &, const Value &, Match, unsigned &) const;
+	std::vector<std::pair<Cell::Range, Value>> runs(void) const;
+	Region keep(const Cell::Range &) const;
+	void restore(Region &);
+	Value intern(std::string_view);
+	uint64_t encode(std::ostream &, Strings &, const std::function<void(size_t)> & = nullptr) const;
+	void attach(std::string_view, uint64_t, const Strings &, std::shared_ptr<const void>);
+
+	private:
+	typedef std::map<uint64_t, std::shared_ptr<Tile>> Tiles; /* shared with snapshots */
+
+	Tile &own(std::shared_ptr<Tile> &);
+	void put(Tile &, const Cell::Pos &, Value, bool);
+	void drop(size_t);
+	void fill(Column &, uint64_t, unsigned, const Value &, bool);
+	size_t erase(Tile &, unsigned, unsigned, uint64_t);
+	size_t cut(Tile &, unsigned, unsigned, unsigned, unsigned);
+	void spill(Tile &);
+	Index *indexed(unsigned) const;
+	Index &index(unsigned) const;
+	void unindex(const Cell::Range &);
+	Value unpack(unsigned, uint64_t) const;
+	const Tile &fetch(const Tile &) const;
+	void decode(const Tile &) const;
+	void decode(Tile &, std::string_view) const;
+	static uint64_t progression(const Column &, bool);
+	static uint64_t pack(const Value &, Strings &);
+	static uint64_t key(unsigned, unsigned);
+	static uint64_t row_mask(unsigned, unsigned);
+	template <typename F> static void visit(unsigned, unsigned, const Tile &, unsigned, unsigned,
+	                                        uint64_t, uint64_t Column::*, bool, F &);
+
+	Tiles m_tiles;
+	size_t m_count;
+	uint64_t m_version; /* changes made so far */
+	mutable Value::Intern m_intern;
+	size_t m_dropped, m_purge_at; /* strings dropped since the pool was purged */
+	std::shared_ptr<const Strings> m_strings; /* of the attached file */
+	std::shared_ptr<const void> m_file; /* keeps the attached file around */
+	std::shared_ptr<std::mutex> m_decode; /* shared with snapshots along with tiles */
+	mutable std::unordered_map<unsigned, std::unique_ptr<Index>> m_index; /* of columns searched */
+	mutable std::mutex m_index_lock; /* held while searching */
+};
+
+/*
+ * Lazy view of stored cells within a rectangle
+ * Iterating it yields position and value of every cell in
+ * range without copying; only tiles overlapping the range
+ * are looked up, one seek per row of tiles.
+ */
+class Store::Query
+{
+	public:
+	class iterator {
+		public:
+		iterator(void);
+		iterator(const Store *, const Cell::Range &);
+		Entry operator*(void) const;
+		iterator &operator++(void);
+		bool operator!=(const iterator &) const;
+
+		private:
+		bool seek_row(void);
+		void seek_tile(void);
+		void seek_col(void);
+
+		const Store *m_store;
+		Cell::Range m_range;
+		Tiles::const_iterator m_tile;
+		const Column *m_col;
+		unsigned m_tr, m_cur, m_last; /* tile row, column in tile, last column */
+		uint64_t m_rows, m_bits, m_held; /* rows in range, left, of them held by runs */
+		unsigned char m_which[TILE_SIZ]; /* run holding a row */
+		mutable Value m_num; /* value of a numeric run cell */
+		Cell::Pos m_pos;
+	};
+
+	Query(const Store *, const Cell::Range &);
+	iterator begin(void) const;
+	iterator end(void) const;
+
+	private:
+	const Store *m_store;
+	Cell::Range m_range;
+};
+
+/*
+ * Inserter for cells coming in order of the store,
+ * as written by for_each. The tile of the last cell
+ * is kept at hand and new tiles are appended at the
+ * end of the map without searching it; cells coming
+ * out of order are still stored, only slower.
+ * Cells must not be erased while it's in use.
+ */
+class Store::Bulk
+{
+	public:
+	Bulk(Store &);
+	void set(const Cell::Pos &, Value, bool formula = false);
+
+	private:
+	Store &m_store;
+	Tile *m_tile;
+	uint64_t m_key;
+};
+
+/*
+ * Table of strings of a binary sheet file;
+ * encoded cells refer to strings by index.
+ * A table is either built while encoding or
+ * read in place from an encoded one.
+ */
+class Store::Strings
+{
+	public:
+	Strings(void);
+	Strings(std::string_view);
+	uint64_t add(const std::string &);
+	std::string_view get(uint64_t) const;
+	void encode(std::ostream &) const;
+
+	private:
+	std::string_view m_data; /* count, offsets of count + 1 strings, text */
+	uint64_t m_size;
+	std::vector<std::string> m_list;
+	std::unordered_map<std::string, uint64_t> m_ids;
+};
+
+/*
+ * Index of values of a column: rows holding every value,
+ * ordered by value for ranges and prefixes and hashed
+ * for exact matches. Values are ordered by type first:
+ * numbers, strings, errors.
+ */
+class Store::Index
+{
+	public:
+	void add(const Value &, unsigned);
+	void remove(const Value &, unsigned);
+	bool find(const Value &, Match, unsigned, unsigned, unsigned &) const;
+	static int compare(const Value &, const Value &);
+	static bool matches(const Value &, const Value &, Match);
+
+	private:
+	struct Less {
+		bool operator()(const Value &, const Value &) const;
+	};
+	struct Hash {
+		size_t operator()(const Value *) const;
+	};
+	struct Equal {
+		bool operator()(const Value *, const Value *) const;
+	};
+	typedef std::map<Value, std::vector<unsigned>, Less> Sorted; /* rows in order */
+
+	static bool first(const std::vector<unsigned> &, unsigned, unsigned, unsigned &);
+
+	Sorted m_sorted;
+	std::unordered_map<const Value *, Sorted::iterator, Hash, Equal> m_hash; /* keys point into m_sorted */
+};
+
+/**
+ * Get tile with its contents decoded
+ */
+inline const Store::Tile &
+Store::fetch(const Tile &t) const
+{
+	if (t.src.load(std::memory_order_acquire))
+		decode(t);
+	return t;
+}
+
+/**
+ * Tile map key; tiles are ordered row by row
+ */
+inline uint64_t
+Store::key(unsigned trow, unsigned tcol)
+{
+	return (uint64_t)trow << 32 | tcol;
+}
+
+/**
+ * Bitmap of tile rows from `b' to `e' inclusive
+ */
+inline uint64_t
+Store::row_mask(unsigned b, unsigned e)
+{
+	uint64_t m = e == TILE_MASK ? ~(uint64_t)0 : ((uint64_t)1 << (e + 1)) - 1;
+	return m & ~(((uint64_t)1 << b) - 1);
+}
+
+/**
+ * Call `fn' for columns `c0' to `c1' and rows in `rows'
+ * of a single tile, limited to those marked in `mask' bitmap.
+ * Cells of runs are taken unless `runs' is false; they count
+ * as present, numeric if they are, and never as formulas.
+ */
+template <typename F> void
+Store::visit(unsigned trow, unsigned tcol, const Tile &t, unsigned c0, unsigned c1,
+             uint64_t rows, uint64_t Column::*mask, bool runs, F &fn)
+{
+	Cell::Pos p;
+	unsigned char which[TILE_SIZ] = {}; /* run of each row held by one */
+	runs = runs && !t.runs.empty() && mask != &Column::formula;
+	for (unsigned c = c0; c <= c1; ++c) {
+		const Column *col = t.get(c);
+		uint64_t own = col ? col->*mask & rows : 0;
+		uint64_t held = runs ? t.run_rows(c, mask == &Column::numeric, which) & rows : 0;
+		if (!(own | held))
+			continue;
+		p.col = tcol << TILE_BITS | c;
+		for (uint64_t bits = own | held; bits; bits &= bits - 1) {
+			unsigned r = __builtin_ctzll(bits);
+			p.row = trow << TILE_BITS | r;
+			if (own >> r & 1)
+				fn(p, col->val[r]);
+			else if (t.runs[which[r]].base.is_num())
+				fn(p, t.runs[which[r]].at(r, c));
+			else
+				fn(p, t.runs[which[r]].base);
+		}
+	}
+}
+
+/**
+ * Call `fn(pos, value)' for every stored cell;
+ * tiles are visited row by row and cells within
+ * a tile column by column.
+ * Passing &Column::formula as `rows' limits
+ * the walk to formula cells; cells of runs
+ * are left out if `runs' is false.
+ */
+template <typename F> void
+Store::for_each(F fn, uint64_t Column::*rows, bool runs) const
+{
+	for (auto &t : m_tiles)
+		visit(t.first >> 32, t.first & 0xffffffff, fetch(*t.second), 0, TILE_MASK, ~(uint64_t)0,
+		      rows, runs, fn);
+}
+
+/**
+ * Call `fn(pos, value)' for every stored cell within
+ * a given range. Only tiles overlapping the range are
+ * looked up, one seek per row of tiles.
+ */
+template <typename F> void
+Store::for_each(const Cell::Range &r, F fn, uint64_t Column::*mask) const
+{
+	if (r.end.row < r.begin.row || r.end.col < r.begin.col)
+		return;
+	unsigned tr0 = r.begin.row >> TILE_BITS, tr1 = r.end.row >> TILE_BITS;
+	unsigned tc0 = r.begin.col >> TILE_BITS, tc1 = r.end.col >> TILE_BITS;
+	for (unsigned tr = tr0; tr <= tr1; ++tr) {
+		uint64_t rows = row_mask(tr == tr0 ? r.begin.row & TILE_MASK : 0,
+		                         tr == tr1 ? r.end.row & TILE_MASK : TILE_MASK);
+		PROF_COUNT(LOOKUPS, 1);
+		auto it = m_tiles.lower_bound(key(tr, tc0));
+		for (; it != m_tiles.end() && it->first <= key(tr, tc1); ++it) {
+			unsigned tc = it->first & 0xffffffff;
+			visit(tr, tc, fetch(*it->second),
+			      tc == tc0 ? r.begin.col & TILE_MASK : 0,
+			      tc == tc1 ? r.end.col & TILE_MASK : TILE_MASK,
+			      rows, mask, true, fn);
+		}
+	}
+}
@@ -6,35 +6,93 @@
  * There are free possible types;
  * anything that's not an integer or decimal (double)
  * is stored as a string.
+ * Additionally a value can hold formula text, as entered by
+ * user, or an error resulting from formula evaluation.
+ * A value takes 16 bytes: short strings are kept inline,
+ * longer ones are shared between copies and counted.
+ * Strings coming through an interning pool are shared
+ * by every value holding the same text.
  */
 
 class Value
 {
 	public:
-	enum Type {
+	enum Type : unsigned char {
 		INTEGER,
 		DOUBLE,
-		STRING
+		STRING,
+		FORMULA,
+		ERROR
 	};
+	enum Error {
+		DIV0,
+		VALUE,
+		REF,
+		NUM,
+		CYCLE,
+		NA
+	};
+	class Intern;
+
 	Value(void);
 	Value(const Value &);
+	Value(Value &&) noexcept;
 	Value(double);
 	Value(int);
 	Value(const std::string &);
 	Value(const char *);
 	~Value(void);
+	static Value formula(const std::string &);
+	static Value error(Error);
+	static Value number(double);
 
 	Value &operator=(const Value &);
+	Value &operator=(Value &&) noexcept;
 	Value operator+(unsigned) const;
 	std::string eval(void) const;
+	std::string_view get_str(void) const;
 	Type get_type(void) const;
+	double get_num(void) const;
+	bool is_num(void) const;
+	Error get_error(void) const;
 
 	private:
-	union _Value {
-		int i;
-		double d;
-		std::string *s;
+	static constexpr unsigned SHORT_MAX = 14;
+	struct Text {
+		std::atomic<unsigned> refs;
+		size_t len; /* text follows */
 	};
-	_Value m_value;
+
+	Value(Type, std::string_view);
+	bool is_shared(void) const;
+	Text *get_text(void) const;
+	void set_text(Text *);
+	void release(void);
+	static Text *make_text(std::string_view);
+
+	alignas(8) char m_data[SHORT_MAX]; /* number, shared text or short text itself */
+	unsigned char m_len; /* of short text; SHORT_MAX + 1 for shared */
 	Type m_type;
 };
+
+/*
+ * Pool of strings of a sheet; every string that goes
+ * through it shares a single copy of its text. Texts stay
+ * in the pool until purged after no value holds them.
+ * Safe to use from many threads.
+ */
+class Value::Intern
+{
+	public:
+	Intern(void);
+	~Intern(void);
+	Value get(std::string_view);
+	size_t size(void) const;
+	size_t purge(void);
+
+	private:
+	Intern(const Intern &) = delete;
+
+	std::unordered_map<std::string_view, Text *> m_texts;
+	mutable std::mutex m_lock;
+};
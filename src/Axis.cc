@@ -0,0 +1,112 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <algorithm>
+#include <vector>
+#include <Axis.h>
+
+/**
+ * Init axis where every column is `def' wide
+ */
+Axis::Axis(unsigned def) : m_def(def), m_sum(1, 0)
+{}
+
+/**
+ * Get size of a column
+ */
+unsigned
+Axis::get(unsigned idx) const
+{
+	auto it = std::lower_bound(m_siz.cbegin(), m_siz.cend(), idx,
+	                           [](const Entry &e, unsigned i) { return e.idx < i; });
+	return (it != m_siz.cend() && it->idx == idx) ? it->siz : m_def;
+}
+
+/**
+ * Set size of a column
+ * Prefix sums from the changed entry onwards are
+ * recomputed; sizes change rarely compared to lookups.
+ */
+void
+Axis::set(unsigned idx, unsigned siz)
+{
+	auto it = std::lower_bound(m_siz.begin(), m_siz.end(), idx,
+	                           [](const Entry &e, unsigned i) { return e.idx < i; });
+	size_t n = it - m_siz.begin();
+	if (it != m_siz.end() && it->idx == idx) {
+		if (siz == m_def)
+			m_siz.erase(it);
+		else
+			it->siz = siz;
+	} else if (siz != m_def)
+		m_siz.insert(it, Entry{idx, siz});
+	else
+		return;
+	m_sum.resize(m_siz.size() + 1);
+	for (; n < m_siz.size(); ++n)
+		m_sum[n + 1] = m_sum[n] + (long long)m_siz[n].siz - m_def;
+}
+
+/**
+ * Distance from the beginning of the first column
+ * to the beginning of a given one
+ */
+unsigned
+Axis::offset(unsigned idx) const
+{
+	if (idx < 1)
+		return 0;
+	auto it = std::lower_bound(m_siz.cbegin(), m_siz.cend(), idx,
+	                           [](const Entry &e, unsigned i) { return e.idx < i; });
+	return (idx - 1) * m_def + m_sum[it - m_siz.cbegin()];
+}
+
+/**
+ * Find column under a given offset
+ */
+unsigned
+Axis::at(unsigned off) const
+{
+	/* find the last resized column starting at or before offset */
+	size_t lo = 0, hi = m_siz.size();
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (start(mid) <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return off / m_def + 1;
+	const Entry &e = m_siz[lo - 1];
+	unsigned end = start(lo - 1) + e.siz;
+	if (off < end)
+		return e.idx;
+	return e.idx + 1 + (off - end) / m_def;
+}
+
+/**
+ * Offset of n-th resized column
+ */
+unsigned
+Axis::start(size_t n) const
+{
+	return (m_siz[n].idx - 1) * m_def + m_sum[n];
+}
+
+/**
+ * Iterate over columns with non-default size
+ */
+std::vector<Axis::Entry>::const_iterator
+Axis::begin(void) const
+{
+	return m_siz.cbegin();
+}
+
+std::vector<Axis::Entry>::const_iterator
+Axis::end(void) const
+{
+	return m_siz.cend();
+}
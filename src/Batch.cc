@@ -0,0 +1,207 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <Prof.h>
+#include <Value.h>
+#include <Cell.h>
+#include <Axis.h>
+#include <Store.h>
+#include <Formula.h>
+#include <Deps.h>
+#include <Pool.h>
+#include <Journal.h>
+#include <History.h>
+#include <Sheet.h>
+#include <Batch.h>
+
+#define UNDO_MB 64 /* of edits kept to undo, like the interface does */
+
+/**
+ * Take the next word of a command, which must be there
+ */
+static std::string
+word(std::istream &in, const char *what)
+{
+	std::string w;
+	if (!(in >> w))
+		throw std::runtime_error(std::string(what) + " expected");
+	return w;
+}
+
+/**
+ * Take a range like `A1:C5' or a single cell
+ */
+static Cell::Range
+range(std::istream &in)
+{
+	std::string addr = word(in, "range");
+	size_t colon = addr.find(':');
+	Cell::Range r;
+	r.begin = Cell::Pos(addr.substr(0, colon));
+	r.end = colon == std::string::npos ? r.begin : Cell::Pos(addr.substr(colon + 1));
+	return r;
+}
+
+Batch::Batch(std::shared_ptr<Sheet> sht, std::ostream &out) : m_sheet(sht), m_out(out)
+{
+	m_sheet->set_undo((size_t)UNDO_MB << 20);
+}
+
+/**
+ * Set file the sheet is written to unless told otherwise
+ */
+void
+Batch::set_filename(const std::string &filename)
+{
+	m_filename = filename;
+}
+
+/**
+ * Run every command of a script; a command that fails
+ * stops it, the error telling the line it's on.
+ * Returns number of commands run.
+ */
+size_t
+Batch::run(std::istream &is)
+{
+	size_t n = 0, line = 0;
+	for (std::string ln; std::getline(is, ln);) {
+		++line;
+		if (!ln.empty() && ln.back() == '\r')
+			ln.pop_back();
+		size_t b = ln.find_first_not_of(" \t");
+		if (b == std::string::npos || ln[b] == '#')
+			continue;
+		try {
+			exec(ln);
+		} catch (const std::exception &e) {
+			throw std::runtime_error("line " + std::to_string(line) + ": " + e.what());
+		}
+		++n;
+	}
+	return n;
+}
+
+/**
+ * Run a single command; throws if it fails
+ */
+void
+Batch::exec(const std::string &line)
+{
+	std::istringstream &in = m_in;
+	in.clear();
+	in.str(line);
+	std::string cmd = word(in, "command");
+	if (cmd == "time") {
+		std::string rest;
+		std::getline(in >> std::ws, rest);
+		auto start = std::chrono::steady_clock::now();
+		exec(rest);
+		std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+		std::cerr << rest << ": " << ms.count() << " ms\n";
+	} else if (cmd == "i") {
+		Cell::Range r = range(in);
+		std::string val;
+		std::getline(in >> std::ws, val);
+		m_sheet->insert(r, m_sheet->parse(val));
+	} else if (cmd == "d")
+		m_sheet->remove(range(in));
+	else if (cmd == "sort") {
+		Cell::Range r = range(in);
+		Cell::Pos p;
+		if (!Cell::Pos::parse(word(in, "column") + "1", p))
+			throw std::runtime_error("column expected");
+		std::string order;
+		in >> order;
+		if (!order.empty() && order != "asc" && order != "desc")
+			throw std::runtime_error("asc or desc expected");
+		if (p.col < r.begin.col || p.col > r.end.col)
+			throw std::runtime_error("column outside of range sorted");
+		m_sheet->sort(r, p.col, order == "desc");
+	} else if (cmd == "u")
+		m_sheet->undo();
+	else if (cmd == "redo")
+		m_sheet->redo();
+	else if (cmd == "recalc") {
+		m_sheet->recalc();
+		m_sheet->wait();
+	} else if (cmd == "p") {
+		m_sheet->wait(); /* for bounds to be taken safely */
+		in >> std::ws;
+		print(in.eof() ? m_sheet->bounds() : range(in));
+	} else if (cmd == "w" || cmd == "r") {
+		std::string file;
+		if (!(in >> file))
+			file = m_filename;
+		if (file.empty())
+			throw std::runtime_error("no filename set");
+		if (cmd == "w")
+			m_sheet->save(file);
+		else
+			m_sheet->load(file);
+		m_filename = file;
+	} else if (cmd == "import")
+		m_sheet->import_csv(word(in, "file"));
+	else if (cmd == "export")
+		m_sheet->export_csv(word(in, "file"));
+	else if (cmd == "set") {
+		cmd = word(in, "option");
+		size_t n;
+		if (cmd != "threads" && cmd != "undo")
+			throw std::runtime_error("unrecognised option " + cmd);
+		if (!(in >> n))
+			throw std::runtime_error("number expected");
+		if (cmd == "threads")
+			m_sheet->set_threads(n);
+		else
+			m_sheet->set_undo(n << 20);
+	} else
+		throw std::runtime_error("unrecognised command " + cmd);
+}
+
+/**
+ * Print values of a range, a row per line
+ * and cells of a row separated by tabs
+ */
+void
+Batch::print(const Cell::Range &area)
+{
+	m_sheet->wait();
+	std::string ln;
+	for (Cell::Range r = area; r.begin.row <= area.end.row; ++r.begin.row) {
+		r.end.row = r.begin.row;
+		unsigned col = area.begin.col;
+		ln.clear();
+		m_sheet->for_each_in(r, [&ln, &col](const Cell::Pos &p, const Value &v) {
+			ln.append(p.col - col, '\t');
+			col = p.col;
+			ln += v.eval();
+		});
+		ln.append(area.end.col - col, '\t');
+		m_out << ln << '\n';
+		if (r.begin.row == ~0u)
+			break;
+	}
+}
@@ -3,9 +3,15 @@
  * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
  */
 
+#include <atomic>
+#include <charconv>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include <Value.h>
 #include <Cell.h>
@@ -14,17 +20,17 @@
 #define LAST_LETTER 0x5a
 #define IS_LETTER(c) (c >= FIRST_LETTER && c <= LAST_LETTER)
 
-Cell::Cell(const Cell::Pos &p, const Value &v) : m_value(std::make_shared<Value>(v)), m_pos(p)
+Cell::Cell(const Cell::Pos &p, const Value &v) : m_value(v), m_pos(p)
 {
 }
 
-std::shared_ptr<Value>
+const Value &
 Cell::get_value(void) const
 {
 	return m_value;
 }
 
-Cell::Pos
+const Cell::Pos &
 Cell::get_pos(void) const
 {
 	return m_pos;
@@ -40,35 +46,38 @@ Cell::Pos::Pos(void) : row(0), col(0), row_iter(true), col_iter(true)
  */
 Cell::Pos::Pos(const std::string &addr) : row(0), col(0), row_iter(true), col_iter(true)
 {
-	std::vector<char> l;
-	unsigned mag;
-	std::string::const_iterator it = addr.cbegin();
-	if (*it == '$') {
-		col_iter = false;
-		++it;
-	}
-	for (; it != addr.cend(); ++it) {
-		if (IS_LETTER(*it))
-			l.push_back(*it);
-		else
-			break;
-	}
-	if (l.size() < 1)
+	if (!parse(addr, *this))
 		throw address_error(addr);
-	if (*it == '$') {
-		row_iter = false;
-		++it; /* const */
-	}
-	std::string row_addr(it, addr.cend());
-	try {
-		row = std::stoi(row_addr);
-	} catch (const std::exception &e) {
-		throw address_error(addr);
-	}
-	for (mag = 1; !l.empty(); l.pop_back()) {
-		col += mag * (l.back() + 1 - FIRST_LETTER);
-		mag *= LAST_LETTER - FIRST_LETTER + 1;
-	}
+}
+
+/**
+ * Parse cell address without throwing or allocating;
+ * returns false if it's not a valid address.
+ */
+bool
+Cell::Pos::parse(std::string_view addr, Pos &p)
+{
+	const char *it = addr.data(), *end = it + addr.size();
+	p.col_iter = it == end || *it != '$';
+	if (!p.col_iter)
+		++it;
+	constexpr unsigned diff = LAST_LETTER - FIRST_LETTER + 1;
+	unsigned col = 0;
+	const char *letters = it;
+	for (; it != end && IS_LETTER(*it); ++it)
+		col = col * diff + (*it + 1 - FIRST_LETTER);
+	if (it == letters)
+		return false;
+	p.row_iter = it == end || *it != '$';
+	if (!p.row_iter)
+		++it;
+	unsigned row;
+	auto r = std::from_chars(it, end, row);
+	if (r.ec != std::errc() || r.ptr != end)
+		return false;
+	p.row = row;
+	p.col = col;
+	return true;
 }
 
 /**
@@ -77,6 +86,15 @@ Cell::Pos::Pos(const std::string &addr) : row(0), col(0), row_iter(true), col_it
 Cell::Pos::address_error::address_error(const std::string &a) : runtime_error(a + " is not a cell addr")
 {}
 
+/**
+ * Hash of a position for use in unordered containers
+ */
+size_t
+Cell::Pos::Hash::operator()(const Pos &p) const
+{
+	return std::hash<uint64_t>()((uint64_t)p.row << 32 | p.col);
+}
+
 /**
  * Operator overload needed for map sorting;
  * this struct is used as a map key.
@@ -165,6 +183,12 @@ Cell::Range::get_addr(void) const
 	return begin.get_addr() + ":" + end.get_addr();
 }
 
+bool
+Cell::Range::operator==(const Range &r) const
+{
+	return begin == r.begin && end == r.end;
+}
+
 /**
  * Check if this range contains given address
  */
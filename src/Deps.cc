@@ -0,0 +1,122 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <Value.h>
+#include <Cell.h>
+#include <Deps.h>
+
+Deps::Deps(void) : m_sorted(0), m_depth(0)
+{}
+
+/**
+ * Record that a cell depends on a cell or range of cells
+ */
+void
+Deps::add(const Cell::Pos &dep, const Cell::Range &prec)
+{
+	if (prec.begin == prec.end) {
+		m_cells[prec.begin].push_back(dep);
+		return;
+	}
+	if (!m_gone.empty())
+		flush(); /* dep may be among the dropped ones */
+	m_ranges.push_back(Interval{prec, dep, prec.end.row});
+}
+
+/**
+ * Forget that a cell depends on a cell or range of cells;
+ * range dependencies are dropped for all the ranges
+ * of a given dependent at once.
+ */
+void
+Deps::remove(const Cell::Pos &dep, const Cell::Range &prec)
+{
+	if (prec.begin == prec.end) {
+		auto it = m_cells.find(prec.begin);
+		if (it == m_cells.end())
+			return;
+		auto &v = it->second;
+		auto d = std::find(v.begin(), v.end(), dep);
+		if (d != v.end())
+			v.erase(d);
+		if (v.empty())
+			m_cells.erase(it);
+		return;
+	}
+	m_gone.insert(dep);
+}
+
+/**
+ * Drop all the dependencies
+ */
+void
+Deps::clear(void)
+{
+	m_cells.clear();
+	m_ranges.clear();
+	m_gone.clear();
+	m_sorted = 0;
+	m_depth = 0;
+}
+
+/**
+ * Apply pending removals, merge recently added
+ * intervals into sorted ones and rebuild the tree.
+ */
+void
+Deps::flush(void) const
+{
+	if (m_gone.empty() && m_sorted == m_ranges.size())
+		return;
+	auto by_row = [](const Interval &a, const Interval &b) {
+		return a.prec.begin.row < b.prec.begin.row;
+	};
+	if (!m_gone.empty()) {
+		auto gone = [this](const Interval &i) { return m_gone.count(i.dep) > 0; };
+		auto sorted = m_ranges.begin() + m_sorted;
+		auto kept = std::remove_if(m_ranges.begin(), sorted, gone);
+		auto tail = std::remove_if(sorted, m_ranges.end(), gone);
+		m_sorted = kept - m_ranges.begin();
+		m_ranges.erase(std::move(sorted, tail, kept), m_ranges.end());
+		m_gone.clear();
+	}
+	std::sort(m_ranges.begin() + m_sorted, m_ranges.end(), by_row);
+	std::inplace_merge(m_ranges.begin(), m_ranges.begin() + m_sorted, m_ranges.end(), by_row);
+	m_sorted = m_ranges.size();
+	/*
+	 * Leaves sit at even indices; a node at level k has
+	 * its k lowest index bits set and children 2^(k-1) away.
+	 * Nodes past the end of array are missing, so reach of
+	 * the last subtree is carried along separately.
+	 */
+	size_t n = m_ranges.size(), last_i = 0;
+	unsigned last = 0, k;
+	for (size_t i = 0; i < n; i += 2) {
+		last = m_ranges[i].reach = m_ranges[i].prec.end.row;
+		last_i = i;
+	}
+	for (k = 1; ((size_t)1 << k) <= n; ++k) {
+		size_t x = (size_t)1 << (k - 1);
+		for (size_t i = (x << 1) - 1; i < n; i += x << 2) {
+			unsigned l = m_ranges[i - x].reach, r = i + x < n ? m_ranges[i + x].reach : last;
+			m_ranges[i].reach = std::max({m_ranges[i].prec.end.row, l, r});
+		}
+		last_i = last_i >> k & 1 ? last_i - x : last_i + x;
+		if (last_i < n)
+			last = std::max(last, m_ranges[last_i].reach);
+	}
+	m_depth = k - 1;
+}
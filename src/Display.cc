@@ -4,38 +4,70 @@
  */
 
 #include <unistd.h>
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <Prof.h>
 #include <Value.h>
 #include <Cell.h>
+#include <Axis.h>
+#include <Store.h>
+#include <Formula.h>
+#include <Deps.h>
+#include <Pool.h>
+#include <Journal.h>
+#include <History.h>
 #include <Sheet.h>
+#include <Output.h>
+#include <Screen.h>
 #include <Display.h>
 
 #define MARGIN_FG 244
 #define MARGIN_BG 232
+#define UNDO_MB 64 /* memory history of edits may take by default, in megabytes */
+#define STATS_W 42 /* width of profiling overlay */
 
 static void signal_handler(int);
 
 static const char *mode_str[] = {
-	"NORMAL",
-	"INPUT",
-	"COMMAND"
+	"NORMAL ",
+	"INPUT ",
+	"COMMAND "
 };
 
 unsigned int Display::COLS = 0, Display::LINES = 0;
 
 struct Display::Tty {
 	struct termios orig_conf;
+	int wake[2]; /* pipe poked by background recalculation and saving */
 };
 
 /**
@@ -44,12 +76,32 @@ struct Display::Tty {
  * along with signal handler which is used
  * to trigger column/row count reeevaluation
  * when screen size is changed.
+ * With negative descriptor the display is detached from
+ * terminal and renders into memory; COLS and LINES are
+ * then left for the caller to set.
  */
-Display::Display(std::shared_ptr<Sheet> sht) : m_sheet(sht), m_cursor("A1:A1"), m_mode(NORMAL)
+Display::Display(std::shared_ptr<Sheet> sht, int fd)
+	: m_sheet(sht), m_screen(fd), m_cursor("A1:A1"), m_sel_version(~(uint64_t)0), m_msg_err(false),
+	  m_key_bytes(0), m_stats(false), m_mode(NORMAL)
 {
+	m_style[CELL][0] = m_screen.style(Screen::Attr{-1, -1, false, false});
+	m_style[CELL][1] = m_screen.style(Screen::Attr{-1, -1, false, true});
+	m_style[NUMBER][0] = m_screen.style(Screen::Attr{1, -1, false, false});
+	m_style[NUMBER][1] = m_screen.style(Screen::Attr{1, -1, false, true});
+	m_style[TEXT][0] = m_screen.style(Screen::Attr{7, -1, false, false});
+	m_style[TEXT][1] = m_screen.style(Screen::Attr{7, -1, false, true});
+	m_style[MARGIN][0] = m_screen.style(Screen::Attr{MARGIN_FG, MARGIN_BG, false, false});
+	m_style[MARGIN][1] = m_screen.style(Screen::Attr{MARGIN_FG, MARGIN_BG, false, true});
+	m_style[MODE][0] = m_style[MODE][1] = m_screen.style(Screen::Attr{7, 236, true, false});
+	m_style[STATUS][0] = m_style[STATUS][1] = m_screen.style(Screen::Attr{248, 238, false, false});
+	m_style[ERROR][0] = m_style[ERROR][1] = m_screen.style(Screen::Attr{1, -1, true, false});
+	m_sheet->set_undo((size_t)UNDO_MB << 20);
+	if (fd < 0) {
+		update_view();
+		return;
+	}
 	m_tty = std::make_unique<Tty>();
-	printf("\33[?1049h"); /* save screen */
-	fflush(stdout);
+	m_screen.write("\33[?1049h"); /* save screen */
 	tcgetattr(STDIN_FILENO, &m_tty->orig_conf);
 	/* place for initialisations and stuff */
 	struct sigaction sa;
@@ -61,6 +113,15 @@ Display::Display(std::shared_ptr<Sheet> sht) : m_sheet(sht), m_cursor("A1:A1"),
 	update_win_size();
 	update_view();
 	set_raw();
+	if (pipe(m_tty->wake) == -1)
+		throw std::runtime_error("failed creating pipe");
+	for (int fd : m_tty->wake)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	int wake = m_tty->wake[1];
+	m_sheet->set_background([wake] {
+		ssize_t n = write(wake, "", 1); /* full pipe is as good */
+		(void)n;
+	});
 }
 
 /**
@@ -69,121 +130,174 @@ Display::Display(std::shared_ptr<Sheet> sht) : m_sheet(sht), m_cursor("A1:A1"),
  */
 Display::~Display(void)
 {
+	if (!m_tty)
+		return;
+	m_sheet->set_background(nullptr);
+	close(m_tty->wake[0]);
+	close(m_tty->wake[1]);
 	tcsetattr(STDIN_FILENO, TCSAFLUSH, &m_tty->orig_conf);
-	printf("\33[?1049l"); /* restore terminal content */
-	fflush(stdout);
+	m_screen.write("\33[?1049l"); /* restore terminal content */
 }
 
 /**
  * Take input from user while in raw terminal mode.
  * Fetch char after every key stroke and interpret
  * it as a interactive (NORMAL) mode command.
+ * Only the parts of the screen that changed get redrawn.
+ * Values landing from background recalculation are
+ * drawn in between key strokes, as is progress of saving.
  */
 void
 Display::take_input(void)
 {
 	m_taking_input = true;
-	clear();
-	draw_status_bar("Hello!");
-	draw_margins();
-	draw_cells();
-	auto curp = get_disp_pos(m_cursor.end);
-	move(curp.first, curp.second);
-	fflush(stdout);
+	m_status = "Hello!";
+	redraw();
 	char c;
-	while (m_taking_input && read(STDIN_FILENO, &c, 1)) {
-		clear();
-		switch (c) {
-		case 'j':
-			++m_cursor.end.row;
-			m_cursor.begin = m_cursor.end;
-			update_vview();
-			draw_status_bar("down");
-			break;
-		case 'k':
-			if (m_cursor.end.row > 1)
-				--m_cursor.end.row;
-			m_cursor.begin = m_cursor.end;
-			update_vview();
-			draw_status_bar("up");
-			break;
-		case 'l':
-			++m_cursor.end.col;
-			m_cursor.begin = m_cursor.end;
-			update_hview();
-			draw_status_bar("right");
-			break;
-		case 'h':
-			if (m_cursor.end.col > 1)
-				--m_cursor.end.col;
-			m_cursor.begin = m_cursor.end;
-			update_hview();
-			draw_status_bar("left");
-			break;
-		case 'g':
-			m_cursor = Cell::Range("A1:A1");
-			update_view();
-			draw_status_bar("go to top");
-			break;
-		case 'J':
-			++m_cursor.end.row;
-			update_vview();
-			draw_status_bar("extend vertical");
-			break;
-		case 'K':
-			if (m_cursor.end.row > m_cursor.begin.row)
-				--m_cursor.end.row;
-			update_vview();
-			draw_status_bar("retract vertical");
-			break;
-		case 'L':
-			++m_cursor.end.col;
-			update_hview();
-			draw_status_bar("extend horizontal");
-			break;
-		case 'H':
-			if (m_cursor.end.col > m_cursor.begin.col)
-				--m_cursor.end.col;
-			update_hview();
-			draw_status_bar("retract horizontal");
-			break;
-		case 'G':
-			m_cursor.begin = m_cursor.end = m_view.end;
-			draw_status_bar("go to bottom edge");
-			break;
-		case ':':
-			draw_status_bar();
-			take_cmd();
-			break;
-		case 'i':
-			take_value();
-			clear();
-			draw_status_bar();
-			break;
-		case 'd':
-			m_sheet->remove(m_cursor);
-			clear();
-			draw_status_bar("remove");
-			break;
-		case '+':
-			m_sheet->increase_col_siz(m_cursor.end.col);
-			update_hview();
-			break;
-		case '-':
-			m_sheet->decrease_col_siz(m_cursor.end.col);
-			update_hview();
-			break;
-		default:
-			draw_status_bar();
+	struct pollfd fds[2] = {
+		{ STDIN_FILENO, POLLIN, 0 },
+		{ m_tty ? m_tty->wake[0] : -1, POLLIN, 0 }
+	};
+	while (m_taking_input) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno != EINTR)
+				break;
+			redraw(); /* interrupted by window size change */
+			continue;
+		}
+		if (fds[1].revents & POLLIN) {
+			while (read(fds[1].fd, &c, 1) > 0)
+				;
+			if (!m_sheet->busy() && m_sheet->get_stats().cycles)
+				print_err("circular reference");
+			check_save();
+			redraw();
 		}
-		draw_margins();
-		draw_cells();
-		auto curp = get_disp_pos(m_cursor.end);
-		move(curp.first, curp.second); /* jump to cursor (selection) end postion */
-		fflush(stdout);
+		if (!(fds[0].revents & POLLIN))
+			continue;
+		ssize_t n = read(STDIN_FILENO, &c, 1);
+		if (n == 0 || (n < 0 && errno != EINTR))
+			break;
+		if (n < 0)
+			continue;
+		key(c);
 	}
 }
 
+/**
+ * Act on a key stroke of interactive (NORMAL) mode
+ * and update the screen
+ */
+void
+Display::key(char c)
+{
+	Cell::Range view = m_view, cursor = m_cursor;
+	m_key_bytes = m_screen.get_frame_bytes();
+	m_damaged = false;
+	switch (c) {
+	case 'j':
+		++m_cursor.end.row;
+		m_cursor.begin = m_cursor.end;
+		update_vview();
+		m_status = "down";
+		break;
+	case 'k':
+		if (m_cursor.end.row > 1)
+			--m_cursor.end.row;
+		m_cursor.begin = m_cursor.end;
+		update_vview();
+		m_status = "up";
+		break;
+	case 'l':
+		++m_cursor.end.col;
+		m_cursor.begin = m_cursor.end;
+		update_hview();
+		m_status = "right";
+		break;
+	case 'h':
+		if (m_cursor.end.col > 1)
+			--m_cursor.end.col;
+		m_cursor.begin = m_cursor.end;
+		update_hview();
+		m_status = "left";
+		break;
+	case 'g':
+		m_cursor = Cell::Range("A1:A1");
+		update_view();
+		m_status = "go to top";
+		break;
+	case 'J':
+		++m_cursor.end.row;
+		update_vview();
+		m_status = "extend vertical";
+		break;
+	case 'K':
+		if (m_cursor.end.row > m_cursor.begin.row)
+			--m_cursor.end.row;
+		update_vview();
+		m_status = "retract vertical";
+		break;
+	case 'L':
+		++m_cursor.end.col;
+		update_hview();
+		m_status = "extend horizontal";
+		break;
+	case 'H':
+		if (m_cursor.end.col > m_cursor.begin.col)
+			--m_cursor.end.col;
+		update_hview();
+		m_status = "retract horizontal";
+		break;
+	case 'G':
+		m_cursor.begin = m_cursor.end = m_view.end;
+		m_status = "go to bottom edge";
+		break;
+	case ':':
+		m_status.clear();
+		take_cmd();
+		break;
+	case '/':
+		search();
+		break;
+	case 'n':
+		find_next();
+		break;
+	case 'i':
+		take_value();
+		m_status.clear();
+		break;
+	case 'd':
+		m_sheet->remove(m_cursor);
+		m_damaged = true;
+		m_status = "remove";
+		break;
+	case 'u':
+		m_damaged = m_sheet->undo();
+		m_status = m_damaged ? "undo" : "already at oldest change";
+		break;
+	case 'R' & 0x1f: /* Ctrl-R */
+		m_damaged = m_sheet->redo();
+		m_status = m_damaged ? "redo" : "already at newest change";
+		break;
+	case '+':
+		m_sheet->increase_col_siz(m_cursor.end.col);
+		update_hview();
+		m_damaged = true;
+		break;
+	case '-':
+		m_sheet->decrease_col_siz(m_cursor.end.col);
+		update_hview();
+		m_damaged = true;
+		break;
+	default:
+		m_status.clear();
+	}
+	if (m_damaged || !(m_view == view))
+		redraw();
+	else
+		redraw_cursor(cursor);
+}
+
 /**
  * Enter command mode
  * Set terminal to cooked mode and
@@ -194,70 +308,150 @@ void
 Display::take_cmd(void)
 {
 	m_mode = COMMAND;
-	draw_status_bar("command");
-	draw_margins();
-	draw_cells();
+	m_status = "command";
+	redraw();
 	set_cooked();
-	move(0, LINES);
-	printf(":");
-	fflush(stdout);
+	m_screen.write("\33[" + std::to_string(LINES) + ";1H:");
 	std::string cmd;
 	std::cin >> cmd;
 	if (cmd == "f") {
 		std::cin >> cmd;
 		set_sheet_filename(cmd);
+	} else if (cmd == "g") {
+		std::cin >> cmd;
+		go_to(cmd);
+	} else if (cmd == "sort") {
+		std::getline(std::cin, cmd);
+		sort(cmd);
 	} else if (cmd == "w")
 		save_sheet();
 	else if (cmd == "r")
 		load_sheet();
-	else if (cmd == "q")
+	else if (cmd == "import") {
+		std::cin >> cmd;
+		import_sheet(cmd);
+	} else if (cmd == "export") {
+		std::cin >> cmd;
+		export_sheet(cmd);
+	} else if (cmd == "q")
 		m_taking_input = false;
+	else if (cmd == "stats") {
+#ifdef NPROF
+		print_err("profiling compiled out");
+#else
+		m_stats = !m_stats;
+		Prof::enable(m_stats);
+#endif
+	} else if (cmd == "bytes")
+		m_msg = std::to_string(m_key_bytes) + " bytes written for last key, "
+		      + std::to_string(m_screen.get_bytes()) + " in total";
+	else if (cmd == "set") {
+		std::cin >> cmd;
+		if (cmd == "threads") {
+			unsigned n;
+			if (std::cin >> n) {
+				m_sheet->set_threads(n);
+				m_msg = "recalculating with " + std::to_string(m_sheet->get_threads()) + " threads";
+			} else {
+				std::cin.clear();
+				print_err("number of threads expected");
+			}
+		} else if (cmd == "undo") {
+			size_t n;
+			if (std::cin >> n) {
+				m_sheet->set_undo(n << 20);
+				m_msg = n ? "keeping up to " + std::to_string(n) + " MB of edits to undo"
+				          : "not keeping edits to undo";
+			} else {
+				std::cin.clear();
+				print_err("number of megabytes expected");
+			}
+		} else
+			print_err("unrecognised option");
+	} else if (cmd == "recalc")
+		m_msg = std::to_string(m_sheet->get_stats().cells) + " cells recomputed after last edit, "
+		      + std::to_string(m_sheet->get_stats().total) + " in total";
 	else
 		print_err("unrecognised command");
 	set_raw();
+	m_screen.invalidate(); /* echoed input scrolled the terminal */
+	m_damaged = true;
 	m_mode = NORMAL;
 }
 
 /**
- * Take new cell value
- * Enter cooked terminal mode and
- * take a line of text to be interpreted as
- * either string or number and put it into
- * selected cell[s]
+ * Take a pattern to search for and go
+ * to the first cell after cursor matching it
  */
 void
-Display::take_value(void)
+Display::search(void)
 {
-	m_mode = INPUT;
-	draw_status_bar("input");
-	draw_margins();
-	draw_cells();
+	m_mode = COMMAND;
+	m_status = "search";
+	redraw();
 	set_cooked();
-	auto curp = get_disp_pos(m_cursor.end);
-	move(curp.first, curp.second);
-	std::string val;
-	std::getline(std::cin, val);
-	m_sheet->insert(m_cursor, m_sheet->parse(val));
+	m_screen.write("\33[" + std::to_string(LINES) + ";1H/");
+	std::getline(std::cin, m_search);
 	set_raw();
+	m_screen.invalidate(); /* echoed input scrolled the terminal */
+	m_damaged = true;
 	m_mode = NORMAL;
+	find_next();
 }
 
 /**
- * Clear screen magical escape sequence
+ * Go to the next cell matching the last pattern searched for:
+ * a number equal to it or a string beginning with it
  */
 void
-Display::clear(void)
+Display::find_next(void)
 {
-	printf("\33[2J");
+	if (m_search.empty()) {
+		print_err("no pattern");
+		return;
+	}
+	Cell::Pos p;
+	bool found;
+	{
+		auto lock = m_sheet->lock();
+		found = m_sheet->find(m_search, m_cursor.end, p);
+	}
+	if (!found) {
+		print_err("pattern not found");
+		return;
+	}
+	m_cursor.begin = m_cursor.end = p;
+	update_view();
+	m_status = "/" + m_search;
 }
 
 /**
- * This escape sequence changes position of the cursor
+ * Take new cell value
+ * Enter cooked terminal mode and
+ * take a line of text to be interpreted as
+ * either string or number and put it into
+ * selected cell[s]
  */
 void
-Display::move(unsigned x, unsigned y)
+Display::take_value(void)
 {
-	printf("\33[%u;%uH", y, x);
+	m_mode = INPUT;
+	m_status = "input";
+	redraw();
+	set_cooked();
+	std::string val;
+	std::getline(std::cin, val);
+	try {
+		m_sheet->insert(m_cursor, m_sheet->parse(val));
+		if (!m_sheet->busy() && m_sheet->get_stats().cycles)
+			print_err("circular reference");
+	} catch (const Formula::syntax_error &e) {
+		print_err(e.what());
+	}
+	set_raw();
+	m_screen.invalidate(); /* input was echoed over the cells */
+	m_damaged = true;
+	m_mode = NORMAL;
 }
 
 /**
@@ -268,6 +462,8 @@ Display::move(unsigned x, unsigned y)
 void
 Display::set_raw(void)
 {
+	if (!m_tty)
+		return;
 	struct termios raw;
 	tcgetattr(STDIN_FILENO, &raw); /* load stdin config */
 	raw.c_lflag &= ~(ECHO | ICANON); /* disable flags */
@@ -283,6 +479,8 @@ Display::set_raw(void)
 void
 Display::set_cooked(void)
 {
+	if (!m_tty)
+		return;
 	struct termios cooked;
 	tcgetattr(STDIN_FILENO, &cooked);
 	cooked.c_lflag |= (ECHO | ICANON);
@@ -305,31 +503,232 @@ Display::get_disp_pos(const Cell::Pos &p) const
 	return absp;
 }
 
+/**
+ * Draw the whole screen from scratch and
+ * write out whatever differs from the last frame
+ */
+void
+Display::redraw(void)
+{
+	PROF_FRAME();
+	auto lock = m_sheet->lock();
+	m_screen.resize(COLS, LINES);
+	if (!(m_view.end == last_visible(m_view.begin))) { /* window size changed */
+		update_hview();
+		update_vview();
+	}
+	m_screen.clear();
+	draw_margins();
+	draw_cells();
+	draw_status_bar();
+	draw_msg();
+	if (m_stats)
+		draw_stats();
+	auto curp = get_disp_pos(m_cursor.end);
+	m_screen.flush(curp.first, curp.second); /* jump to cursor (selection) end postion */
+}
+
+/**
+ * Update screen after cursor movement within the view;
+ * only cells and margins under the previous and the new
+ * cursor position are drawn again.
+ */
+void
+Display::redraw_cursor(const Cell::Range &prev)
+{
+	PROF_FRAME();
+	auto lock = m_sheet->lock();
+	Cell::Pos p;
+	for (int i = 0; i < 2; ++i) {
+		const Cell::Range &r = i ? prev : m_cursor;
+		auto vis = visible(r);
+		for (p.col = vis.begin.col; p.col <= vis.end.col; ++p.col)
+			for (p.row = vis.begin.row; p.row <= vis.end.row; ++p.row)
+				if (!i || !m_cursor.contains(p))
+					draw_pos(p);
+		draw_margin_col(r.end.col);
+		draw_margin_row(r.end.row);
+	}
+	draw_status_bar();
+	draw_msg();
+	if (m_stats)
+		draw_stats();
+	auto curp = get_disp_pos(m_cursor.end);
+	m_screen.flush(curp.first, curp.second);
+}
+
 /**
  * Draw a nice status bar at the bottom of the screen.
- * ATM it shows mode and last interactive command issued.
+ * It shows mode, last interactive command issued or what's
+ * going on in the background and, if more than a cell is
+ * selected, what its numbers sum to.
+ */
+void
+Display::draw_status_bar(void)
+{
+	std::string sum = summary();
+	unsigned w = sum.size() + 1 < COLS - 9 ? sum.size() : 0;
+	int saved = m_sheet->saving();
+	std::string status = m_sheet->busy() ? "recalculating"
+	                   : saved >= 0 ? "saving " + std::to_string(saved) + "%" : m_status;
+	m_screen.put(1, LINES - 1, mode_str[m_mode], 9, m_style[MODE][0]);
+	m_screen.put(10, LINES - 1, status, COLS - 9 - w, m_style[STATUS][0]);
+	if (w)
+		m_screen.put(COLS - w + 1, LINES - 1, sum, w, m_style[STATUS][0]);
+}
+
+/**
+ * Describe numbers of the selection, as in `sum 10 avg 2.5 count 4';
+ * empty for a single cell or a selection with no numbers
+ */
+std::string
+Display::summary(void)
+{
+	if (m_cursor.begin == m_cursor.end)
+		return std::string();
+	update_summary();
+	const Store::Summary &s = m_sel;
+	if (!s.count)
+		return std::string();
+	char buf[96];
+	snprintf(buf, sizeof(buf), "sum %.10g avg %.6g count %zu", s.sum, s.sum / s.count, s.count);
+	return buf;
+}
+
+/**
+ * Find strip of cells `big' has over `small', the two
+ * differing only by where their last row or column is
+ */
+static bool
+strip(const Cell::Range &small, const Cell::Range &big, Cell::Range &r)
+{
+	if (!(small.begin == big.begin))
+		return false;
+	r = big;
+	if (small.end.col == big.end.col && small.end.row < big.end.row)
+		r.begin.row = small.end.row + 1;
+	else if (small.end.row == big.end.row && small.end.col < big.end.col)
+		r.begin.col = small.end.col + 1;
+	else
+		return false;
+	return true;
+}
+
+/**
+ * Bring summary of the selection up to date. As long as
+ * cells stay the same, a selection extended or retracted
+ * by a strip only has the strip summed up.
+ */
+void
+Display::update_summary(void)
+{
+	Cell::Range r;
+	uint64_t version = m_sheet->version();
+	if (version == m_sel_version) {
+		if (m_sel_range == m_cursor)
+			return;
+		if (strip(m_sel_range, m_cursor, r)) {
+			m_sel.add(m_sheet->summarize(r));
+			m_sel_range = m_cursor;
+			return;
+		}
+		if (strip(m_cursor, m_sel_range, r)) {
+			Store::Summary s = m_sheet->summarize(r);
+			if (s.err < 0) { /* errors left elsewhere can't be told */
+				m_sel.remove(s);
+				m_sel_range = m_cursor;
+				return;
+			}
+		}
+	}
+	m_sel = m_sheet->summarize(m_cursor);
+	m_sel_range = m_cursor;
+	m_sel_version = version;
+}
+
+/**
+ * Draw message line below the status bar;
+ * a message is shown only once.
  */
 void
-Display::draw_status_bar(const std::string &str)
+Display::draw_msg(void)
 {
-	move(0, LINES - 1);
-	std::string fmt = "\33[1;48;5;236;38;5;7m %7.7s \33[48;5;238;38;5;248m%" + std::to_string(COLS - 9) +"s\33[0m";
-	printf(fmt.c_str(), mode_str[m_mode], str.c_str());
+	m_screen.clear_line(LINES);
+	if (m_msg_err) {
+		m_screen.put(1, LINES, "error:", 6, m_style[ERROR][0]);
+		m_screen.put(8, LINES, m_msg, COLS - 7, m_style[CELL][0], false);
+	} else
+		m_screen.put(1, LINES, m_msg, COLS, m_style[CELL][0], false);
+	m_msg.clear();
+	m_msg_err = false;
+}
+
+/**
+ * Draw profiling overlay in the top right corner:
+ * probes of the frame drawn before this one and
+ * their medians and 99th percentiles so far,
+ * then how long the latest load took
+ */
+void
+Display::draw_stats(void)
+{
+	unsigned x = COLS - STATS_W + 1, y = 2;
+	if (COLS < STATS_W + 6 || LINES < Prof::PROBES + 4)
+		return;
+	char buf[64];
+	snprintf(buf, sizeof(buf), " %-11s %9s %9s %9s", "per frame", "last", "p50", "p99");
+	m_screen.put(x, y++, buf, STATS_W, m_style[MODE][0]);
+	for (unsigned i = 0; i < Prof::PROBES; ++i) {
+		Prof::Probe p = Prof::Probe(i);
+		const Prof::Histogram &h = Prof::histogram(p);
+		if (p == Prof::LOAD)
+			continue;
+		if (p < Prof::TIMERS)
+			snprintf(buf, sizeof(buf), " %-8s ms %9.3f %9.3f %9.3f", Prof::name(p),
+			         Prof::last(p) / 1e6, h.quantile(.5) / 1e6, h.quantile(.99) / 1e6);
+		else
+			snprintf(buf, sizeof(buf), " %-11s %9" PRIu64 " %9" PRIu64 " %9" PRIu64, Prof::name(p),
+			         Prof::last(p), h.quantile(.5), h.quantile(.99));
+		m_screen.put(x, y++, buf, STATS_W, m_style[STATUS][0]);
+	}
+	snprintf(buf, sizeof(buf), " %-8s ms %9.3f", Prof::name(Prof::LOAD), Prof::latest(Prof::LOAD) / 1e6);
+	m_screen.put(x, y, buf, STATS_W, m_style[STATUS][0]);
 }
 
 /**
  * Draw a cell on the screen
  */
 void
-Display::draw_cell(const std::string &s, unsigned l, bool highlight, bool fill, int fg, int bg)
+Display::draw_cell(unsigned x, unsigned y, std::string_view s, unsigned l, Look look, bool highlight, bool fill)
 {
-	std::string fgs = (fg < 0) ? "" : ";38;5;" + std::to_string(fg),
-	            bgs = (bg < 0) ? "" : ";48;5;" + std::to_string(bg),
-	            inv = highlight ? ";7" : "",
-	            len = std::to_string(l);
-	len = fill ? len + "." + len : "." + len;
-	std::string fmt = "\33[" + fgs + bgs + inv + "m%" + len + "s\33[0m";
-	printf(fmt.c_str(), s.c_str());
+	m_screen.put(x, y, s, l, m_style[look][highlight], fill);
+}
+
+/**
+ * Draw a single cell of the sheet along with its value
+ */
+void
+Display::draw_pos(const Cell::Pos &p)
+{
+	PROF_COUNT(VISITED, 1);
+	auto absp = get_disp_pos(p);
+	unsigned l = m_sheet->get_col_siz(p.col);
+	bool highlight = m_cursor.contains(p);
+	draw_cell(absp.first, absp.second, "", l, CELL, highlight);
+	if (auto v = m_sheet->get(p))
+		draw_value(absp.first, absp.second, *v, l, highlight);
+}
+
+/**
+ * Draw value of a cell
+ */
+void
+Display::draw_value(unsigned x, unsigned y, const Value &v, unsigned l, bool highlight)
+{
+	if (v.get_type() == Value::Type::STRING)
+		draw_cell(x, y, v.get_str(), l, TEXT, highlight, false);
+	else
+		draw_cell(x, y, v.eval(), l, NUMBER, highlight);
 }
 
 /**
@@ -337,16 +736,41 @@ Display::draw_cell(const std::string &s, unsigned l, bool highlight, bool fill,
  */
 void
 Display::draw_margins(void)
+{
+	for (unsigned col = m_view.begin.col; col <= m_view.end.col; ++col)
+		draw_margin_col(col);
+	for (unsigned row = m_view.begin.row; row <= m_view.end.row; ++row)
+		draw_margin_row(row);
+}
+
+/**
+ * Draw column address above the cells
+ */
+void
+Display::draw_margin_col(unsigned col)
 {
 	Cell::Pos p;
-	move(6, 0);
-	for (p.col = m_view.begin.col; p.col < m_view.end.col; ++p.col)
-		draw_cell(p.get_col_str(), m_sheet->get_col_siz(p.col), (p.col == m_cursor.end.col), true, MARGIN_FG, MARGIN_BG);
-	move(0, 2);
-	for (p.row = m_view.begin.row; p.row < m_view.end.row; ++p.row) {
-		draw_cell(std::to_string(p.row), 5, (p.row == m_cursor.end.row), true, MARGIN_FG, MARGIN_BG);
-		printf("\n");
-	}
+	p.col = col;
+	p.row = m_view.begin.row;
+	if (col < m_view.begin.col || col > m_view.end.col)
+		return;
+	draw_cell(get_disp_pos(p).first, 1, p.get_col_str(), m_sheet->get_col_siz(col),
+	          MARGIN, (col == m_cursor.end.col));
+}
+
+/**
+ * Draw row address left of the cells
+ */
+void
+Display::draw_margin_row(unsigned row)
+{
+	Cell::Pos p;
+	p.col = m_view.begin.col;
+	p.row = row;
+	if (row < m_view.begin.row || row > m_view.end.row)
+		return;
+	draw_cell(1, get_disp_pos(p).second, std::to_string(row), 5,
+	          MARGIN, (row == m_cursor.end.row));
 }
 
 /**
@@ -355,31 +779,36 @@ Display::draw_margins(void)
 void
 Display::draw_cells(void)
 {
-	/* first draw cursor range */
-	for (Cell::Pos cur = m_cursor.begin; cur.col <= m_cursor.end.col; ++cur.col)
-		for (cur.row = m_cursor.begin.row; cur.row <= m_cursor.end.row; ++cur.row)
-			if (m_view.contains(cur)) {
-				auto absp = get_disp_pos(cur); /* translate cell addr to coord */
-				move(absp.first, absp.second);
-				draw_cell("", m_sheet->get_col_siz(cur.col), true);
-			}
-	/* draw cells with values */
-	auto cells = m_sheet->get_cells(m_view);
-	for (auto &c : cells) {
-		auto p = c.get_pos();
-		if (m_view.contains(p)) {
-			auto absp = get_disp_pos(p); /* get absolute coordinates */
-			auto v = c.get_value();
-			unsigned colour = 1;
-			bool fill = true;
-			if (v->get_type() == Value::Type::STRING) {
-				colour = 7;
-				fill = false;
-			}
-			move(absp.first, absp.second);
-			draw_cell(v->eval(), m_sheet->get_col_siz(p.col), m_cursor.contains(p), fill, colour);
+	PROF_SCOPE(CELLS);
+	/* first draw visible part of cursor range */
+	auto vis = visible(m_cursor);
+	for (Cell::Pos cur = vis.begin; cur.col <= vis.end.col; ++cur.col)
+		for (cur.row = vis.begin.row; cur.row <= vis.end.row; ++cur.row) {
+			PROF_COUNT(VISITED, 1);
+			auto absp = get_disp_pos(cur); /* translate cell addr to coord */
+			draw_cell(absp.first, absp.second, "", m_sheet->get_col_siz(cur.col), CELL, true);
 		}
-	}
+	/* draw cells with values */
+	m_sheet->for_each_in(m_view, [this](const Cell::Pos &p, const Value &v) {
+		PROF_COUNT(VISITED, 1);
+		auto absp = get_disp_pos(p); /* get absolute coordinates */
+		draw_value(absp.first, absp.second, v, m_sheet->get_col_siz(p.col), m_cursor.contains(p));
+	});
+}
+
+/**
+ * Part of a range that lies within view;
+ * empty ranges have end before begin.
+ */
+Cell::Range
+Display::visible(const Cell::Range &r) const
+{
+	Cell::Range v;
+	v.begin.col = std::max(r.begin.col, m_view.begin.col);
+	v.begin.row = std::max(r.begin.row, m_view.begin.row);
+	v.end.col = std::min(r.end.col, m_view.end.col);
+	v.end.row = std::min(r.end.row, m_view.end.row);
+	return v;
 }
 
 /**
@@ -391,13 +820,8 @@ Display::draw_cells(void)
 void
 Display::update_view(void)
 {
-	m_view.begin = m_view.end = m_cursor.end;
-	unsigned tmp = m_sheet->get_col_siz(m_view.end.col);
-	while (tmp < COLS - 6)
-		tmp += m_sheet->get_col_siz(m_view.end.col++);
-	tmp = m_sheet->get_row_siz(m_view.end.row);
-	while (tmp < LINES - 3)
-		tmp += m_sheet->get_row_siz(++m_view.end.row);
+	m_view.begin = m_cursor.end;
+	m_view.end = last_visible(m_view.begin);
 }
 
 /**
@@ -407,22 +831,12 @@ Display::update_view(void)
 void
 Display::update_hview(void)
 {
+	if (m_view.begin.col > m_cursor.end.col)
+		m_view.begin.col = m_cursor.end.col;
+	m_view.end.col = last_visible(m_view.begin).col;
 	if (m_view.end.col < m_cursor.end.col) {
-		auto diff = m_cursor.end.col - m_view.end.col;
-		m_view.end.col += diff;
-		auto b = m_sheet->get_abs_pos(m_view.begin);
-		auto e = m_sheet->get_abs_pos(m_view.end);
-		diff = e.first - b.first;
-		while (diff > COLS - 6)
-			diff -= m_sheet->get_col_siz(m_view.begin.col++);
-	} else if (m_view.begin.col > m_cursor.end.col) {
-		auto diff = m_view.begin.col - m_cursor.end.col;
-		m_view.begin.col -= diff;
-		auto b = m_sheet->get_abs_pos(m_view.begin);
-		auto e = m_sheet->get_abs_pos(m_view.end);
-		diff = e.first - b.first;
-		while (diff > COLS - 6)
-			diff -= m_sheet->get_col_siz(m_view.end.col--);
+		m_view.end.col = m_cursor.end.col;
+		m_view.begin.col = first_visible(m_view.end).col;
 	}
 }
 
@@ -433,33 +847,110 @@ Display::update_hview(void)
 void
 Display::update_vview(void)
 {
+	if (m_view.begin.row > m_cursor.end.row)
+		m_view.begin.row = m_cursor.end.row;
+	m_view.end.row = last_visible(m_view.begin).row;
 	if (m_view.end.row < m_cursor.end.row) {
-		auto diff = m_cursor.end.row - m_view.end.row;
-		m_view.end.row += diff;
-		auto b = m_sheet->get_abs_pos(m_view.begin);
-		auto e = m_sheet->get_abs_pos(m_view.end);
-		diff = e.second - b.second;
-		while (diff > LINES - 4)
-			diff -= m_sheet->get_row_siz(m_view.begin.row++);
-	} else if (m_view.begin.row > m_cursor.end.row) {
-		auto diff = m_view.begin.row - m_cursor.end.row;
-		m_view.begin.row -= diff;
-		auto b = m_sheet->get_abs_pos(m_view.begin);
-		auto e = m_sheet->get_abs_pos(m_view.end);
-		diff = e.second - b.second;
-		while (diff > LINES - 4)
-			diff -= m_sheet->get_row_siz(m_view.end.row--);
+		m_view.end.row = m_cursor.end.row;
+		m_view.begin.row = first_visible(m_view.end).row;
 	}
 }
 
+/**
+ * Last cell that fits on the screen entirely
+ * if view starts at a given one
+ */
+Cell::Pos
+Display::last_visible(const Cell::Pos &first) const
+{
+	auto abs = m_sheet->get_abs_pos(first);
+	auto p = m_sheet->get_pos_at(abs.first + COLS - 6, abs.second + LINES - 3);
+	p.col = std::max(first.col, p.col - 1);
+	p.row = std::max(first.row, p.row - 1);
+	return p;
+}
+
+/**
+ * First cell of a view ending at a given one
+ */
+Cell::Pos
+Display::first_visible(const Cell::Pos &last) const
+{
+	Cell::Pos next = last;
+	++next.col;
+	++next.row;
+	auto abs = m_sheet->get_abs_pos(next);
+	unsigned x = abs.first > COLS - 6 ? abs.first - (COLS - 6) : 0;
+	unsigned y = abs.second > LINES - 3 ? abs.second - (LINES - 3) : 0;
+	auto p = m_sheet->get_pos_at(x, y);
+	abs = m_sheet->get_abs_pos(p);
+	if (abs.first < x) /* partially visible */
+		++p.col;
+	if (abs.second < y)
+		++p.row;
+	p.col = std::min(p.col, last.col);
+	p.row = std::min(p.row, last.row);
+	return p;
+}
+
 /**
  * Print error at the bottom of the screen
  */
 void
 Display::print_err(const char *e)
 {
-	move(0, LINES);
-	printf("\33[31;1merror:\33[0m %s", e);
+	m_msg = e;
+	m_msg_err = true;
+}
+
+/**
+ * Move cursor to a given address and
+ * jump the view straight there
+ */
+void
+Display::go_to(const std::string &addr)
+{
+	try {
+		m_cursor.begin = m_cursor.end = Cell::Pos(addr);
+	} catch (const std::exception &e) {
+		print_err(e.what());
+		return;
+	}
+	update_view();
+}
+
+/**
+ * Sort rows of the selection, or of all the cells if just
+ * one is selected, by a column given as `B' or `B desc'
+ */
+void
+Display::sort(const std::string &args)
+{
+	std::istringstream in(args);
+	std::string col, order;
+	in >> col >> order;
+	Cell::Pos p;
+	if (!Cell::Pos::parse(col + "1", p)) {
+		print_err("column expected");
+		return;
+	}
+	if (!order.empty() && order != "asc" && order != "desc") {
+		print_err("asc or desc expected");
+		return;
+	}
+	Cell::Range r = m_cursor;
+	if (m_cursor.begin == m_cursor.end) {
+		auto lock = m_sheet->lock();
+		r = m_sheet->bounds();
+	}
+	if (p.col < r.begin.col || p.col > r.end.col) {
+		print_err("column outside of range sorted");
+		return;
+	}
+	auto start = std::chrono::steady_clock::now();
+	m_sheet->sort(r, p.col, order == "desc");
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+	m_msg = "sorted " + r.get_addr() + " in " + std::to_string(ms.count()) + " ms";
 }
 
 /**
@@ -469,12 +960,12 @@ void
 Display::set_sheet_filename(const std::string &filename)
 {
 	m_filename = filename;
-	move(0, LINES); /* move to the bottom to print msg there */
-	printf("filename set to \"%s\"", filename.c_str());
+	m_msg = "filename set to \"" + filename + "\"";
 }
 
 /**
- * Save currenttly open sheet
+ * Save currenttly open sheet in the background;
+ * editing goes on while it's written
  */
 void
 Display::save_sheet(void)
@@ -484,14 +975,33 @@ Display::save_sheet(void)
 		return;
 	}
 	try {
-		m_sheet->save(m_filename);
-		move(0, LINES);
-		printf("written to file \"%s\"", m_filename.c_str());
+		m_sheet->save_background(m_filename);
+		m_saving = m_filename;
+		m_msg = "saving to file \"" + m_filename + "\"";
+		check_save();
 	} catch (const std::exception &e) {
 		print_err(e.what());
 	}
 }
 
+/**
+ * Tell how a background save went once it's done,
+ * and if journaling edits failed
+ */
+void
+Display::check_save(void)
+{
+	std::string err = m_sheet->journal_error();
+	if (!err.empty())
+		print_err(err.c_str());
+	if (!m_sheet->saved(err))
+		return;
+	if (err.empty())
+		m_msg = "written to file \"" + m_saving + "\"";
+	else
+		print_err(err.c_str());
+}
+
 /**
  * Load sheet located under currently selected filename
  */
@@ -504,8 +1014,54 @@ Display::load_sheet(void)
 	}
 	try {
 		m_sheet->load(m_filename);
-		move(0, LINES);
-		printf("read file \"%s\"", m_filename.c_str());
+		m_msg = "read file \"" + m_filename + "\"";
+	} catch (const std::exception &e) {
+		print_err(e.what());
+	}
+}
+
+/**
+ * Open sheet under currently selected filename along
+ * with edits journaled by a session that didn't end
+ * cleanly; edits are journaled from now on
+ */
+void
+Display::recover_sheet(void)
+{
+	try {
+		size_t n = m_sheet->recover(m_filename);
+		if (n)
+			m_msg = "recovered " + std::to_string(n) + " unsaved edits of \"" + m_filename + "\"";
+		else
+			m_msg = "read file \"" + m_filename + "\"";
+	} catch (const std::exception &e) {
+		print_err(e.what());
+	}
+}
+
+/**
+ * Replace cells of the sheet with a CSV file
+ */
+void
+Display::import_sheet(const std::string &filename)
+{
+	try {
+		size_t n = m_sheet->import_csv(filename);
+		m_msg = "imported " + std::to_string(n) + " rows of \"" + filename + "\"";
+	} catch (const std::exception &e) {
+		print_err(e.what());
+	}
+}
+
+/**
+ * Write values of the sheet into a CSV file
+ */
+void
+Display::export_sheet(const std::string &filename)
+{
+	try {
+		size_t n = m_sheet->export_csv(filename);
+		m_msg = "exported " + std::to_string(n) + " rows to \"" + filename + "\"";
 	} catch (const std::exception &e) {
 		print_err(e.what());
 	}
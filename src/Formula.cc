@@ -0,0 +1,692 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <Prof.h>
+#include <Value.h>
+#include <Cell.h>
+#include <Store.h>
+#include <Formula.h>
+
+#define STACK_MAX 32 /* values on machine stack */
+#define ACC_MAX 8 /* nested aggregate function calls */
+
+enum Agg {
+	SUM,
+	MIN,
+	MAX,
+	AVG,
+	COUNT,
+	STDEV
+};
+
+/*
+ * Recursive descent parser emitting bytecode
+ * straight into the formula being compiled.
+ */
+class Formula::Parser
+{
+	public:
+	Parser(Formula &);
+	void parse(void);
+
+	private:
+	void expr(void);
+	void term(void);
+	void power(void);
+	void unary(void);
+	void primary(void);
+	void call(const std::string &);
+	void arg(void);
+	void lookup(void);
+	bool range(unsigned &);
+	bool ref(size_t, Cell::Pos &, size_t &) const;
+	void add_ref(const Cell::Pos &);
+	void emit(Op, unsigned arg = 0);
+	void skip_space(void);
+	bool accept(char);
+	void expect(char);
+	[[noreturn]] void fail(const std::string &) const;
+
+	Formula &m_f;
+	const std::string &m_s;
+	size_t m_pos;
+	unsigned m_depth, m_acc;
+};
+
+/*
+ * Machine stack slot; either a number, an error
+ * or a pointer to non-numeric cell value
+ */
+struct Slot {
+	double num;
+	const Value *val;
+	int err;
+};
+
+/*
+ * Aggregate function accumulator
+ */
+struct Acc {
+	unsigned fn;
+	Store::Summary sum;
+
+	Slot result(void) const;
+};
+
+Formula::syntax_error::syntax_error(const std::string &s) : runtime_error(s)
+{}
+
+/**
+ * Compile formula text (with leading `=') entered
+ * into a given cell
+ */
+Formula::Formula(const std::string &src, const Cell::Pos &origin) : m_src(src), m_origin(origin)
+{
+	Parser(*this).parse();
+}
+
+Formula::Parser::Parser(Formula &f) : m_f(f), m_s(f.m_src), m_pos(0), m_depth(0), m_acc(0)
+{}
+
+void
+Formula::Parser::parse(void)
+{
+	accept('=');
+	expr();
+	skip_space();
+	if (m_pos < m_s.size())
+		fail("unexpected `" + m_s.substr(m_pos, 1) + "'");
+}
+
+/**
+ * expr := term (('+' | '-') term)*
+ */
+void
+Formula::Parser::expr(void)
+{
+	term();
+	for (;;) {
+		if (accept('+')) {
+			term();
+			emit(ADD);
+		} else if (accept('-')) {
+			term();
+			emit(SUB);
+		} else
+			return;
+	}
+}
+
+/**
+ * term := power (('*' | '/') power)*
+ */
+void
+Formula::Parser::term(void)
+{
+	power();
+	for (;;) {
+		if (accept('*')) {
+			power();
+			emit(MUL);
+		} else if (accept('/')) {
+			power();
+			emit(DIV);
+		} else
+			return;
+	}
+}
+
+/**
+ * power := unary ('^' power)?
+ */
+void
+Formula::Parser::power(void)
+{
+	unary();
+	if (accept('^')) {
+		power();
+		emit(POW);
+	}
+}
+
+/**
+ * unary := ('-' | '+') unary | primary
+ */
+void
+Formula::Parser::unary(void)
+{
+	if (accept('-')) {
+		unary();
+		emit(NEG);
+	} else if (accept('+'))
+		unary();
+	else
+		primary();
+}
+
+/**
+ * primary := number | address | function '(' args ')' | '(' expr ')'
+ */
+void
+Formula::Parser::primary(void)
+{
+	skip_space();
+	if (m_pos >= m_s.size())
+		fail("unexpected end of formula");
+	char c = m_s[m_pos];
+	if (accept('(')) {
+		expr();
+		expect(')');
+	} else if (std::isdigit(c) || c == '.') {
+		char *end;
+		double d = std::strtod(m_s.c_str() + m_pos, &end);
+		if (end == m_s.c_str() + m_pos)
+			fail("invalid number");
+		m_pos = end - m_s.c_str();
+		m_f.m_num.push_back(d);
+		emit(NUM, m_f.m_num.size() - 1);
+	} else if (std::isalpha(c) || c == '$') {
+		Cell::Pos p;
+		size_t len;
+		if (ref(m_pos, p, len)) {
+			m_f.m_spans.push_back(Span{m_pos, len, (unsigned)m_f.m_refs.size(), false});
+			add_ref(p);
+			emit(REF, m_f.m_refs.size() - 1);
+			m_pos += len;
+			return;
+		}
+		size_t b = m_pos;
+		while (m_pos < m_s.size() && std::isalpha(m_s[m_pos]))
+			++m_pos;
+		std::string name = m_s.substr(b, m_pos - b);
+		for (auto &ch : name)
+			ch = std::toupper(ch);
+		call(name);
+	} else
+		fail("unexpected `" + m_s.substr(m_pos, 1) + "'");
+}
+
+/**
+ * Function call; aggregates take any number of arguments,
+ * lookups their own, other functions exactly one
+ */
+void
+Formula::Parser::call(const std::string &name)
+{
+	static const struct {
+		const char *name;
+		Op op; /* AGG for aggregates */
+		unsigned agg;
+	} functions[] = {
+		{ "SUM", AGG, SUM },
+		{ "MIN", AGG, MIN },
+		{ "MAX", AGG, MAX },
+		{ "AVG", AGG, AVG },
+		{ "AVERAGE", AGG, AVG },
+		{ "COUNT", AGG, COUNT },
+		{ "STDEV", AGG, STDEV },
+		{ "ABS", ABS, 0 },
+		{ "SQRT", SQRT, 0 },
+		{ "VLOOKUP", VLOOKUP, 0 },
+	};
+	for (auto &f : functions) {
+		if (name != f.name)
+			continue;
+		expect('(');
+		if (f.op == VLOOKUP) {
+			lookup();
+			return;
+		}
+		if (f.op != AGG) {
+			expr();
+			expect(')');
+			emit(f.op);
+			return;
+		}
+		emit(AGG, f.agg);
+		if (!accept(')')) {
+			do
+				arg();
+			while (accept(','));
+			expect(')');
+		}
+		emit(AGG_END);
+		return;
+	}
+	fail("unknown function " + name);
+}
+
+/**
+ * Aggregate function argument; either a range or an expression
+ */
+void
+Formula::Parser::arg(void)
+{
+	unsigned idx;
+	if (range(idx)) {
+		emit(AGG_RANGE, idx);
+		return;
+	}
+	expr();
+	emit(AGG_VAL);
+}
+
+/**
+ * VLOOKUP(key, range, column[, approximate]) arguments;
+ * an exact match is looked for unless the last one is given
+ * and isn't zero
+ */
+void
+Formula::Parser::lookup(void)
+{
+	expr();
+	expect(',');
+	unsigned idx;
+	if (!range(idx))
+		fail("range expected");
+	expect(',');
+	expr();
+	if (accept(','))
+		expr();
+	else {
+		m_f.m_num.push_back(0);
+		emit(NUM, m_f.m_num.size() - 1);
+	}
+	expect(')');
+	emit(VLOOKUP, idx);
+}
+
+/**
+ * Read a range if there's one, giving index
+ * of the first of its two references
+ */
+bool
+Formula::Parser::range(unsigned &idx)
+{
+	skip_space();
+	Cell::Pos b, e;
+	size_t len, len2, p = m_pos;
+	if (!ref(p, b, len))
+		return false;
+	p += len;
+	while (p < m_s.size() && std::isspace(m_s[p]))
+		++p;
+	if (p >= m_s.size() || m_s[p] != ':')
+		return false;
+	++p;
+	while (p < m_s.size() && std::isspace(m_s[p]))
+		++p;
+	if (!ref(p, e, len2))
+		fail("invalid range");
+	idx = m_f.m_refs.size();
+	m_f.m_spans.push_back(Span{m_pos, p + len2 - m_pos, idx, true});
+	add_ref(b);
+	add_ref(e);
+	m_pos = p + len2;
+	return true;
+}
+
+/**
+ * Try to read cell address at a given position
+ * without consuming it
+ */
+bool
+Formula::Parser::ref(size_t pos, Cell::Pos &p, size_t &len) const
+{
+	size_t i = pos;
+	if (i < m_s.size() && m_s[i] == '$')
+		++i;
+	size_t letters = i;
+	while (i < m_s.size() && std::isalpha(m_s[i]))
+		++i;
+	if (i == letters)
+		return false;
+	if (i < m_s.size() && m_s[i] == '$')
+		++i;
+	size_t digits = i;
+	while (i < m_s.size() && std::isdigit(m_s[i]))
+		++i;
+	if (i == digits)
+		return false;
+	std::string addr = m_s.substr(pos, i - pos);
+	for (auto &ch : addr)
+		ch = std::toupper(ch);
+	try {
+		p = Cell::Pos(addr);
+	} catch (const Cell::Pos::address_error &) {
+		return false;
+	}
+	if (p.row < 1)
+		fail("invalid address " + addr);
+	len = i - pos;
+	return true;
+}
+
+/**
+ * Store reference relative to formula origin
+ */
+void
+Formula::Parser::add_ref(const Cell::Pos &p)
+{
+	Ref r;
+	r.row_iter = p.row_iter;
+	r.col_iter = p.col_iter;
+	r.row = p.row_iter ? (int)p.row - (int)m_f.m_origin.row : (int)p.row;
+	r.col = p.col_iter ? (int)p.col - (int)m_f.m_origin.col : (int)p.col;
+	m_f.m_refs.push_back(r);
+}
+
+/**
+ * Append instruction keeping track of how deep
+ * machine stacks get
+ */
+void
+Formula::Parser::emit(Op op, unsigned arg)
+{
+	switch (op) {
+	case NUM:
+	case REF:
+		++m_depth;
+		break;
+	case ADD:
+	case SUB:
+	case MUL:
+	case DIV:
+	case POW:
+	case AGG_VAL:
+		--m_depth;
+		break;
+	case VLOOKUP:
+		m_depth -= 2;
+		break;
+	case AGG:
+		++m_acc;
+		break;
+	case AGG_END:
+		--m_acc;
+		++m_depth;
+		break;
+	default:
+		break;
+	}
+	if (m_depth > STACK_MAX || m_acc > ACC_MAX)
+		fail("formula too complex");
+	m_f.m_code.push_back(Instr{op, arg});
+}
+
+void
+Formula::Parser::skip_space(void)
+{
+	while (m_pos < m_s.size() && std::isspace(m_s[m_pos]))
+		++m_pos;
+}
+
+bool
+Formula::Parser::accept(char c)
+{
+	skip_space();
+	if (m_pos < m_s.size() && m_s[m_pos] == c) {
+		++m_pos;
+		return true;
+	}
+	return false;
+}
+
+void
+Formula::Parser::expect(char c)
+{
+	if (!accept(c))
+		fail(std::string("expected `") + c + "'");
+}
+
+void
+Formula::Parser::fail(const std::string &e) const
+{
+	throw syntax_error(e + " in formula " + m_s);
+}
+
+/**
+ * Slot holding a value of a cell
+ */
+static Slot
+load(const Value *v)
+{
+	if (!v)
+		return Slot{0, nullptr, -1};
+	if (v->is_num())
+		return Slot{v->get_num(), nullptr, -1};
+	if (v->get_type() == Value::ERROR)
+		return Slot{0, nullptr, v->get_error()};
+	return Slot{0, v, -1};
+}
+
+/**
+ * Check slot for an error or text unusable in arithmetic
+ */
+static int
+bad(const Slot &s)
+{
+	if (s.err >= 0)
+		return s.err;
+	return s.val ? Value::VALUE : -1;
+}
+
+Slot
+Acc::result(void) const
+{
+	if (sum.err >= 0)
+		return Slot{0, nullptr, sum.err};
+	switch (fn) {
+	case SUM:
+		return Slot{sum.sum, nullptr, -1};
+	case MIN:
+		return Slot{sum.count ? sum.min : 0, nullptr, -1};
+	case MAX:
+		return Slot{sum.count ? sum.max : 0, nullptr, -1};
+	case AVG:
+		if (!sum.count)
+			return Slot{0, nullptr, Value::DIV0};
+		return Slot{sum.sum / sum.count, nullptr, -1};
+	case COUNT:
+		return Slot{(double)sum.count, nullptr, -1};
+	case STDEV:
+		if (sum.count < 2)
+			return Slot{0, nullptr, Value::DIV0};
+		return Slot{std::sqrt(sum.variance()), nullptr, -1};
+	}
+	return Slot{0, nullptr, -1};
+}
+
+/**
+ * Run formula for a given cell
+ */
+Value
+Formula::eval(const Cell::Pos &at, const Store &cells) const
+{
+	Slot stack[STACK_MAX];
+	Acc acc[ACC_MAX];
+	unsigned sp = 0, ap = 0;
+	Cell::Pos p;
+	Cell::Range r;
+	for (auto &in : m_code) {
+		Slot *a = sp > 1 ? &stack[sp - 2] : nullptr, *b = sp > 0 ? &stack[sp - 1] : nullptr;
+		switch (in.op) {
+		case NUM:
+			stack[sp++] = Slot{m_num[in.arg], nullptr, -1};
+			break;
+		case REF:
+			if (resolve(m_refs[in.arg], at, p))
+				stack[sp++] = load(cells.get(p));
+			else
+				stack[sp++] = Slot{0, nullptr, Value::REF};
+			break;
+		case ADD:
+		case SUB:
+		case MUL:
+		case DIV:
+		case POW:
+			--sp;
+			if (bad(*a) >= 0 || bad(*b) >= 0) {
+				*a = Slot{0, nullptr, bad(*a) >= 0 ? bad(*a) : bad(*b)};
+				break;
+			}
+			if (in.op == ADD)
+				a->num += b->num;
+			else if (in.op == SUB)
+				a->num -= b->num;
+			else if (in.op == MUL)
+				a->num *= b->num;
+			else if (in.op == POW)
+				a->num = std::pow(a->num, b->num);
+			else if (b->num == 0)
+				a->err = Value::DIV0;
+			else
+				a->num /= b->num;
+			break;
+		case NEG:
+		case ABS:
+		case SQRT:
+			if (bad(*b) >= 0)
+				*b = Slot{0, nullptr, bad(*b)};
+			else if (in.op == NEG)
+				b->num = -b->num;
+			else if (in.op == ABS)
+				b->num = std::fabs(b->num);
+			else if (b->num < 0)
+				b->err = Value::NUM;
+			else
+				b->num = std::sqrt(b->num);
+			break;
+		case AGG:
+			acc[ap++] = Acc{in.arg, Store::Summary()};
+			break;
+		case AGG_VAL:
+			--sp;
+			if (b->err >= 0) {
+				if (acc[ap - 1].sum.err < 0)
+					acc[ap - 1].sum.err = b->err;
+			} else if (!b->val)
+				acc[ap - 1].sum.add(b->num);
+			break;
+		case AGG_RANGE:
+			if (!resolve(in.arg, at, r)) {
+				acc[ap - 1].sum.err = Value::REF;
+				break;
+			}
+			acc[ap - 1].sum.add(cells.summarize(r));
+			break;
+		case AGG_END:
+			stack[sp++] = acc[--ap].result();
+			break;
+		case VLOOKUP: {
+			sp -= 2;
+			Slot &key = stack[sp - 1], &col = stack[sp], &approx = stack[sp + 1];
+			int err = key.err >= 0 ? key.err : bad(col) >= 0 ? bad(col) : bad(approx);
+			if (err < 0 && !resolve(in.arg, at, r))
+				err = Value::REF;
+			else if (err < 0 && (col.num < 1 || col.num >= r.end.col - r.begin.col + 2.0))
+				err = col.num < 1 ? Value::VALUE : Value::REF;
+			unsigned row;
+			if (err < 0 && !cells.find(r, key.val ? *key.val : Value::number(key.num),
+			                           approx.num ? Store::BELOW : Store::EXACT, row))
+				err = Value::NA;
+			if (err >= 0) {
+				key = Slot{0, nullptr, err};
+				break;
+			}
+			p.row = row;
+			p.col = r.begin.col + (unsigned)col.num - 1;
+			key = load(cells.get(p));
+			break;
+		}
+		}
+	}
+	const Slot &res = stack[0];
+	if (res.err >= 0)
+		return Value::error((Value::Error)res.err);
+	if (res.val)
+		return *res.val;
+	return Value::number(res.num);
+}
+
+/**
+ * Formula text as it would be entered into a given cell
+ */
+std::string
+Formula::get_src(const Cell::Pos &at) const
+{
+	std::string s;
+	size_t last = 0;
+	Cell::Pos p;
+	Cell::Range r;
+	for (auto &sp : m_spans) {
+		s.append(m_src, last, sp.begin - last);
+		if (sp.range)
+			s += resolve(sp.ref, at, r) ? r.get_addr() : "#REF!";
+		else
+			s += resolve(m_refs[sp.ref], at, p) ? p.get_addr() : "#REF!";
+		last = sp.begin + sp.len;
+	}
+	s.append(m_src, last, std::string::npos);
+	return s;
+}
+
+/**
+ * Get cell formula was compiled for
+ */
+const Cell::Pos &
+Formula::get_origin(void) const
+{
+	return m_origin;
+}
+
+/**
+ * Translate reference into address as seen from a given cell
+ */
+bool
+Formula::resolve(const Ref &ref, const Cell::Pos &at, Cell::Pos &p) const
+{
+	long row = ref.row_iter ? (long)at.row + ref.row : ref.row;
+	long col = ref.col_iter ? (long)at.col + ref.col : ref.col;
+	if (row < 1 || col < 1 || row > UINT32_MAX || col > UINT32_MAX)
+		return false;
+	p.row = row;
+	p.col = col;
+	p.row_iter = ref.row_iter;
+	p.col_iter = ref.col_iter;
+	return true;
+}
+
+/**
+ * Translate pair of references into a range as seen from
+ * a given cell; corners are put in order.
+ */
+bool
+Formula::resolve(unsigned idx, const Cell::Pos &at, Cell::Range &r) const
+{
+	if (!resolve(m_refs[idx], at, r.begin) || !resolve(m_refs[idx + 1], at, r.end))
+		return false;
+	if (r.end.row < r.begin.row)
+		std::swap(r.begin.row, r.end.row);
+	if (r.end.col < r.begin.col)
+		std::swap(r.begin.col, r.end.col);
+	return true;
+}
@@ -0,0 +1,140 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <Prof.h>
+#include <Value.h>
+#include <Cell.h>
+#include <Store.h>
+#include <Formula.h>
+#include <History.h>
+
+/**
+ * Memory taken by an entry
+ */
+size_t
+History::Entry::bytes(void) const
+{
+	return sizeof(*this) + cells.bytes() - sizeof(cells) + formulas.capacity() * sizeof(formulas[0]);
+}
+
+/**
+ * History keeps nothing until it's given a limit
+ */
+History::History(void) : m_bytes(0), m_max(0)
+{}
+
+/**
+ * Set limit of memory taken by entries,
+ * forgetting the oldest ones past it
+ */
+void
+History::set_max(size_t n)
+{
+	m_max = n;
+	trim();
+}
+
+size_t
+History::get_max(void) const
+{
+	return m_max;
+}
+
+/**
+ * Memory taken by entries
+ */
+size_t
+History::get_bytes(void) const
+{
+	return m_bytes;
+}
+
+/**
+ * Tell if there's nothing to redo
+ * or, if `redo' is false, to undo
+ */
+bool
+History::empty(bool redo) const
+{
+	return redo ? m_redo.empty() : m_undo.empty();
+}
+
+/**
+ * Add an entry for a new edit; edits
+ * undone before can't be redone anymore
+ */
+void
+History::add(Entry &&e)
+{
+	for (auto &r : m_redo)
+		m_bytes -= r.size;
+	m_redo.clear();
+	put(std::move(e), false);
+}
+
+/**
+ * Take the latest entry to redo or undo
+ */
+History::Entry
+History::take(bool redo)
+{
+	std::deque<Entry> &q = redo ? m_redo : m_undo;
+	Entry e = std::move(q.back());
+	q.pop_back();
+	m_bytes -= e.size;
+	return e;
+}
+
+/**
+ * Put an entry back as the latest to redo
+ * or undo, once it's been applied
+ */
+void
+History::put(Entry &&e, bool redo)
+{
+	e.size = e.bytes();
+	m_bytes += e.size;
+	(redo ? m_redo : m_undo).push_back(std::move(e));
+	trim();
+}
+
+/**
+ * Forget all of the entries
+ */
+void
+History::clear(void)
+{
+	m_undo.clear();
+	m_redo.clear();
+	m_bytes = 0;
+}
+
+/**
+ * Forget entries over the limit: the oldest
+ * to undo first, then those furthest to redo.
+ * An entry alone over the limit isn't kept.
+ */
+void
+History::trim(void)
+{
+	while (m_bytes > m_max) {
+		std::deque<Entry> &q = m_undo.empty() ? m_redo : m_undo;
+		m_bytes -= q.front().size;
+		q.pop_front();
+	}
+}
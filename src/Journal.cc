@@ -0,0 +1,629 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <Value.h>
+#include <Cell.h>
+#include <Journal.h>
+
+#define JOURNAL_EXT ".journal"
+#define JOURNAL_MAGIC "CELLSJ\0\1" /* version 1 */
+#define RECORD_HEAD 8 /* length and checksum of a record */
+#define SYNC_MS 10 /* least time between syncs, for edits to gather */
+
+/*
+ * Head of a journal kept over a sheet file
+ */
+struct Head {
+	char magic[8];
+	uint64_t ino, size, mtime; /* of the sheet file, all zero if there was none */
+};
+
+template <typename T> static void
+put(std::string &s, T v)
+{
+	s.append((const char *)&v, sizeof(v));
+}
+
+/**
+ * Cut a number off a record
+ */
+template <typename T> static bool
+take(std::string_view &s, T &v)
+{
+	if (s.size() < sizeof(v))
+		return false;
+	std::memcpy(&v, s.data(), sizeof(v));
+	s.remove_prefix(sizeof(v));
+	return true;
+}
+
+/**
+ * Append a value to a record: its type and contents
+ */
+static void
+put(std::string &s, const Value &v)
+{
+	put(s, (uint8_t)v.get_type());
+	switch (v.get_type()) {
+	case Value::INTEGER:
+		put(s, (int32_t)v.get_num());
+		break;
+	case Value::DOUBLE:
+		put(s, v.get_num());
+		break;
+	case Value::ERROR:
+		put(s, (uint8_t)v.get_error());
+		break;
+	default:
+		put(s, (uint32_t)v.get_str().size());
+		s.append(v.get_str());
+	}
+}
+
+/**
+ * Cut a value off a record
+ */
+static bool
+take(std::string_view &s, Value &v)
+{
+	uint8_t type = 0;
+	if (!take(s, type))
+		return false;
+	if (type == Value::INTEGER) {
+		int32_t i = 0;
+		if (!take(s, i))
+			return false;
+		v = Value((int)i);
+	} else if (type == Value::DOUBLE) {
+		double d = 0;
+		if (!take(s, d))
+			return false;
+		v = Value(d);
+	} else if (type == Value::ERROR) {
+		uint8_t err = 0;
+		if (!take(s, err) || err > Value::NA)
+			return false;
+		v = Value::error((Value::Error)err);
+	} else if (type <= Value::FORMULA) {
+		uint32_t n = 0;
+		if (!take(s, n) || n > s.size())
+			return false;
+		std::string str(s.substr(0, n));
+		s.remove_prefix(n);
+		v = type == Value::FORMULA ? Value::formula(str) : Value(str);
+	} else
+		return false;
+	return true;
+}
+
+/**
+ * Write all of a buffer to a file
+ */
+static bool
+put(int fd, std::string_view s)
+{
+	while (!s.empty()) {
+		ssize_t n = write(fd, s.data(), s.size());
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return false;
+		s.remove_prefix(n);
+	}
+	return true;
+}
+
+/**
+ * FNV-1a hash of a record, telling records torn by a crash
+ */
+static uint32_t
+checksum(std::string_view s)
+{
+	uint32_t h = 2166136261u;
+	for (unsigned char c : s)
+		h = (h ^ c) * 16777619u;
+	return h;
+}
+
+/**
+ * Fill in a journal head for the sheet file as it is now
+ */
+static Head
+identify(const std::string &file)
+{
+	Head h = {};
+	std::memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+	struct stat st;
+	if (stat(file.c_str(), &st) == 0) {
+		h.ino = st.st_ino;
+		h.size = st.st_size;
+		h.mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	}
+	return h;
+}
+
+/**
+ * Make a rename within the directory of a file last
+ * across a crash; it's fine if that can't be done
+ */
+static void
+sync_dir(const std::string &path)
+{
+	size_t slash = path.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+/**
+ * Journal for a sheet file; nothing is written
+ * until it's started or resumed
+ */
+Journal::Journal(const std::string &file)
+	: m_file(file), m_path(file + JOURNAL_EXT), m_fd(-1), m_size(0), m_epoch(0), m_standalone(false),
+	  m_checkpoint(false), m_writing(false), m_stop(false), m_err(0)
+{}
+
+/**
+ * Stop journaling, removing the journal; a sheet
+ * closed cleanly has nothing to be recovered
+ */
+Journal::~Journal(void)
+{
+	{
+		std::lock_guard<std::mutex> l(m_lock);
+		m_stop = true;
+		m_buf.clear();
+	}
+	m_work.notify_one();
+	if (m_writer.joinable())
+		m_writer.join();
+	if (m_fd != -1) {
+		close(m_fd);
+		unlink(m_path.c_str());
+	}
+}
+
+const std::string &
+Journal::get_path(void) const
+{
+	return m_path;
+}
+
+/**
+ * Start a journal over the sheet file as it is now,
+ * replacing any journal that was there
+ */
+void
+Journal::start(void)
+{
+	Head h = identify(m_file);
+	std::string tmp = m_path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	if (fd == -1 || !put(fd, std::string_view((const char *)&h, sizeof(h))) || fdatasync(fd) == -1 ||
+	    std::rename(tmp.c_str(), m_path.c_str()) == -1) {
+		std::string err = strerror(errno);
+		if (fd != -1)
+			close(fd);
+		unlink(tmp.c_str());
+		throw std::runtime_error(m_path + ": " + err);
+	}
+	sync_dir(m_path);
+	attach(fd, 0, false);
+}
+
+/**
+ * Go on with a journal being recovered, `end' bytes of it
+ * being good and `size' of them records of edits; whatever
+ * follows was torn by a crash and is cut off
+ */
+void
+Journal::resume(size_t end, size_t size, bool standalone)
+{
+	int fd = open(m_path.c_str(), O_WRONLY | O_APPEND);
+	if (fd == -1 || ftruncate(fd, end) == -1) {
+		std::string err = strerror(errno);
+		if (fd != -1)
+			close(fd);
+		throw std::runtime_error(m_path + ": " + err);
+	}
+	attach(fd, size, standalone);
+}
+
+/**
+ * Make a file the journal appended to, starting the
+ * writer if it's not running yet
+ */
+void
+Journal::attach(int fd, size_t size, bool standalone)
+{
+	std::lock_guard<std::mutex> l(m_lock);
+	if (m_fd != -1)
+		close(m_fd);
+	m_fd = fd;
+	m_size = size;
+	m_standalone = standalone;
+	m_buf.clear();
+	m_err = 0;
+	if (!m_writer.joinable())
+		m_writer = std::thread(&Journal::run, this);
+}
+
+/**
+ * Journal values put into a range
+ */
+void
+Journal::insert(const Cell::Range &r, const Value &v)
+{
+	std::string s;
+	put(s, v);
+	append(INSERT, r, s);
+}
+
+/**
+ * Journal values removed from a range
+ */
+void
+Journal::remove(const Cell::Range &r)
+{
+	append(REMOVE, r, std::string());
+}
+
+/**
+ * Journal rows of a range sorted by a column
+ */
+void
+Journal::sort(const Cell::Range &r, unsigned col, bool desc)
+{
+	std::string s;
+	put(s, (uint32_t)col);
+	put(s, (uint8_t)desc);
+	append(SORT, r, s);
+}
+
+/**
+ * Journal size of a column or row set;
+ * `op' is COL_SIZ or ROW_SIZ
+ */
+void
+Journal::resize(Op op, unsigned idx, unsigned siz)
+{
+	Cell::Range r;
+	r.begin.row = r.begin.col = r.end.row = r.end.col = idx;
+	std::string s;
+	put(s, (uint32_t)siz);
+	append(op, r, s);
+}
+
+/**
+ * Journal cells replaced by those of a CSV file,
+ * which replay imports again
+ */
+void
+Journal::import(const std::string &file)
+{
+	std::string s;
+	put(s, Value(file));
+	append(IMPORT, Cell::Range(), s);
+}
+
+/**
+ * Add a record to be written: its length, checksum and
+ * body, which is the edit, the range and what follows
+ */
+void
+Journal::append(Op op, const Cell::Range &r, const std::string &rest)
+{
+	std::string body;
+	put(body, (uint8_t)op);
+	put(body, (uint32_t)r.begin.row);
+	put(body, (uint32_t)r.begin.col);
+	put(body, (uint32_t)r.end.row);
+	put(body, (uint32_t)r.end.col);
+	body += rest;
+	std::lock_guard<std::mutex> l(m_lock);
+	size_t at = m_buf.size();
+	put(m_buf, (uint32_t)body.size());
+	put(m_buf, checksum(body));
+	m_buf += body;
+	if (m_checkpoint)
+		m_held.append(m_buf, at, std::string::npos);
+	m_size += m_buf.size() - at;
+	if (!at && !m_writing)
+		m_work.notify_one(); /* else it's awake and takes these along */
+}
+
+/**
+ * Write records out as they come, syncing every batch;
+ * a failed write leaves the journal behind until the
+ * next checkpoint
+ */
+void
+Journal::run(void)
+{
+	std::unique_lock<std::mutex> l(m_lock);
+	auto synced = std::chrono::steady_clock::now();
+	for (;;) {
+		m_work.wait(l, [this] { return !m_buf.empty() || m_stop; });
+		m_work.wait_until(l, synced + std::chrono::milliseconds(SYNC_MS), [this] { return m_stop; });
+		if (m_stop)
+			return;
+		std::string batch;
+		batch.swap(m_buf);
+		int fd = m_fd;
+		m_writing = true;
+		l.unlock();
+		bool ok = put(fd, batch) && fdatasync(fd) == 0;
+		int err = errno;
+		l.lock();
+		synced = std::chrono::steady_clock::now();
+		m_writing = false;
+		if (!ok && !m_err)
+			m_err = err;
+		m_idle.notify_all();
+	}
+}
+
+/**
+ * Journal undoing or redoing the last edit
+ * of history; `op' is UNDO or REDO
+ */
+void
+Journal::step(Op op, const Cell::Range &r)
+{
+	std::string s;
+	put(s, (uint8_t)op);
+	append(op, r, s);
+}
+
+/**
+ * Journal undoing or redoing an edit that came before
+ * the last checkpoint, so that a replay wouldn't have it
+ * in history: with cells the range was left with if `of'
+ * is INSERT, or size of a column or row for COL_SIZ and
+ * ROW_SIZ, as it'd be set by `resize'
+ */
+void
+Journal::restore(Op op, Op of, const Cell::Range &r, unsigned siz,
+                 const std::vector<std::pair<Cell::Pos, Value>> &cells)
+{
+	std::string s;
+	put(s, (uint8_t)of);
+	if (of == INSERT) {
+		put(s, (uint32_t)cells.size());
+		for (auto &c : cells) {
+			put(s, (uint32_t)c.first.row);
+			put(s, (uint32_t)c.first.col);
+			put(s, c.second);
+		}
+	} else
+		put(s, (uint32_t)siz);
+	append(op, r, s);
+}
+
+/**
+ * Number of checkpoints begun; edits made before
+ * the last one aren't replayed from the journal
+ */
+size_t
+Journal::epoch(void) const
+{
+	return m_epoch;
+}
+
+/**
+ * Bytes of records journaled since the last checkpoint
+ * or since the journal was started
+ */
+size_t
+Journal::size(void) const
+{
+	std::lock_guard<std::mutex> l(m_lock);
+	return m_size;
+}
+
+/**
+ * Check if the journal is kept over a checkpoint,
+ * needing no sheet file to be replayed over
+ */
+bool
+Journal::standalone(void) const
+{
+	std::lock_guard<std::mutex> l(m_lock);
+	return m_standalone;
+}
+
+/**
+ * Tell why writing the journal failed, if it did,
+ * and only once
+ */
+std::string
+Journal::get_error(void)
+{
+	std::lock_guard<std::mutex> l(m_lock);
+	std::string err = m_err ? m_path + ": " + strerror(m_err) : std::string();
+	m_err = 0;
+	return err;
+}
+
+/**
+ * Begin a checkpoint: edits from now on are journaled
+ * for a new journal too. Returns the file the copy of
+ * the sheet as it is now is to be written to, in binary
+ * format; it's then committed or aborted.
+ */
+std::string
+Journal::checkpoint(void)
+{
+	std::lock_guard<std::mutex> l(m_lock);
+	++m_epoch;
+	m_checkpoint = true;
+	m_held.clear();
+	return m_path + ".tmp";
+}
+
+/**
+ * Finish a checkpoint whose copy of the sheet is written:
+ * edits journaled since it began are added, and once it's
+ * all synced the new journal replaces the old one.
+ * Records of the last moment are left for the writer.
+ */
+void
+Journal::commit(void)
+{
+	std::string tmp = m_path + ".tmp";
+	std::unique_lock<std::mutex> l(m_lock);
+	std::string part = m_held;
+	l.unlock();
+	int fd = open(tmp.c_str(), O_WRONLY | O_APPEND);
+	bool ok = fd != -1 && put(fd, part) && fdatasync(fd) == 0;
+	l.lock();
+	m_idle.wait(l, [this] { return !m_writing; });
+	if (!ok || std::rename(tmp.c_str(), m_path.c_str()) == -1) {
+		std::string err = strerror(errno);
+		l.unlock();
+		if (fd != -1)
+			close(fd);
+		abort();
+		throw std::runtime_error(m_path + ": " + err);
+	}
+	if (m_fd != -1)
+		close(m_fd);
+	m_fd = fd;
+	m_buf = m_held.substr(part.size());
+	m_size = m_held.size();
+	m_held.clear();
+	m_checkpoint = false;
+	m_standalone = true;
+	m_err = 0;
+	l.unlock();
+	m_work.notify_one();
+	sync_dir(m_path);
+}
+
+/**
+ * Give up a checkpoint that couldn't be written
+ */
+void
+Journal::abort(void)
+{
+	{
+		std::lock_guard<std::mutex> l(m_lock);
+		m_checkpoint = false;
+		m_held.clear();
+	}
+	unlink((m_path + ".tmp").c_str());
+}
+
+/**
+ * Check if a journal is kept over a sheet file as it is
+ * now; returns the size of its head if it is, zero if
+ * it's not or it's kept over a checkpoint
+ */
+size_t
+Journal::head(std::string_view data, const std::string &file)
+{
+	Head h = identify(file);
+	if (data.size() < sizeof(h) || std::memcmp(data.data(), &h, sizeof(h)))
+		return 0;
+	return sizeof(h);
+}
+
+/**
+ * Call `fn' for every edit of records of a journal, up
+ * to the first one torn by a crash or otherwise invalid.
+ * Returns number of bytes of good records.
+ */
+size_t
+Journal::replay(std::string_view data, const std::function<void(const Edit &)> &fn)
+{
+	size_t used = 0;
+	for (std::string_view rest = data; rest.size() >= RECORD_HEAD;) {
+		uint32_t len, sum;
+		take(rest, len);
+		take(rest, sum);
+		if (len > rest.size() || checksum(rest.substr(0, len)) != sum)
+			break;
+		std::string_view body = rest.substr(0, len);
+		rest.remove_prefix(len);
+		Edit e;
+		uint8_t op;
+		uint32_t r[4];
+		if (!take(body, op) || op > IMPORT)
+			break;
+		for (auto &n : r)
+			if (!take(body, n))
+				return used;
+		e.op = (Op)op;
+		e.range.begin.row = r[0];
+		e.range.begin.col = r[1];
+		e.range.end.row = r[2];
+		e.range.end.col = r[3];
+		e.n = 0;
+		e.desc = false;
+		e.of = e.op;
+		bool ok = true;
+		if (e.op == INSERT || e.op == IMPORT)
+			ok = take(body, e.value);
+		else if (e.op == SORT) {
+			uint32_t col = 0;
+			uint8_t desc = 0;
+			ok = take(body, col) && take(body, desc);
+			e.n = col;
+			e.desc = desc;
+		} else if (e.op == UNDO || e.op == REDO) {
+			uint8_t of = 0;
+			uint32_t n = 0;
+			ok = take(body, of) && (of == op || of == INSERT || of == COL_SIZ || of == ROW_SIZ);
+			e.of = (Op)of;
+			if (ok && e.of == INSERT)
+				ok = take(body, n);
+			for (uint32_t i = 0; ok && i < n; ++i) {
+				uint32_t row = 0, col = 0;
+				Value v;
+				ok = take(body, row) && take(body, col) && take(body, v);
+				e.cells.emplace_back(Cell::Pos(), std::move(v));
+				e.cells.back().first.row = row;
+				e.cells.back().first.col = col;
+			}
+			if (ok && (e.of == COL_SIZ || e.of == ROW_SIZ)) {
+				uint32_t siz = 0;
+				ok = take(body, siz);
+				e.n = siz;
+			}
+		} else if (e.op != REMOVE) {
+			uint32_t siz = 0;
+			ok = take(body, siz);
+			e.n = siz;
+		}
+		if (!ok)
+			break;
+		fn(e);
+		used = data.size() - rest.size();
+	}
+	return used;
+}
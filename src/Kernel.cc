@@ -0,0 +1,221 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNEL_X86
+#endif
+#include <Prof.h>
+#include <Value.h>
+#include <Cell.h>
+#include <Store.h>
+#include <Kernel.h>
+
+typedef void (*Fold)(Store::Summary &, const double *, uint64_t);
+
+/**
+ * Add partial sums of a block to a summary
+ */
+static void
+merge(Store::Summary &s, double sum, double dsum, double dsq, double lo, double hi)
+{
+	s.sum += sum;
+	s.dsum += dsum;
+	s.dsq += dsq;
+	s.min = std::min(s.min, lo);
+	s.max = std::max(s.max, hi);
+}
+
+static void
+fold_scalar(Store::Summary &s, const double *x, uint64_t mask)
+{
+	double sum = 0, dsum = 0, dsq = 0, lo = s.min, hi = s.max;
+	for (; mask; mask &= mask - 1) {
+		double v = x[__builtin_ctzll(mask)], d = v - s.shift;
+		sum += v;
+		dsum += d;
+		dsq += d * d;
+		lo = v < lo ? v : lo;
+		hi = v > hi ? v : hi;
+	}
+	merge(s, sum, dsum, dsq, lo, hi);
+}
+
+#ifdef KERNEL_X86
+/**
+ * Two rows at a time; rows left out of a pair are
+ * masked to zero for sums and to infinities for extremes
+ */
+__attribute__((target("sse2"))) static void
+fold_sse2(Store::Summary &s, const double *x, uint64_t mask)
+{
+	const __m128d sh = _mm_set1_pd(s.shift), inf = _mm_set1_pd(HUGE_VAL), ninf = _mm_set1_pd(-HUGE_VAL);
+	__m128d sum = _mm_setzero_pd(), dsum = sum, dsq = sum, lo = inf, hi = ninf;
+	for (unsigned i = 0; i < Store::TILE_SIZ; i += 2) {
+		unsigned m = mask >> i & 3;
+		if (!m)
+			continue;
+		__m128d v = _mm_loadu_pd(x + i), d = _mm_sub_pd(v, sh), vlo = v, vhi = v;
+		if (m != 3) {
+			__m128d keep = _mm_castsi128_pd(_mm_set_epi64x(-(int64_t)(m >> 1), -(int64_t)(m & 1)));
+			v = _mm_and_pd(v, keep);
+			d = _mm_and_pd(d, keep);
+			vlo = _mm_or_pd(v, _mm_andnot_pd(keep, inf));
+			vhi = _mm_or_pd(v, _mm_andnot_pd(keep, ninf));
+		}
+		sum = _mm_add_pd(sum, v);
+		dsum = _mm_add_pd(dsum, d);
+		dsq = _mm_add_pd(dsq, _mm_mul_pd(d, d));
+		lo = _mm_min_pd(lo, vlo);
+		hi = _mm_max_pd(hi, vhi);
+	}
+	double a[5][2];
+	_mm_storeu_pd(a[0], sum);
+	_mm_storeu_pd(a[1], dsum);
+	_mm_storeu_pd(a[2], dsq);
+	_mm_storeu_pd(a[3], lo);
+	_mm_storeu_pd(a[4], hi);
+	merge(s, a[0][0] + a[0][1], a[1][0] + a[1][1], a[2][0] + a[2][1],
+	      std::min(a[3][0], a[3][1]), std::max(a[4][0], a[4][1]));
+}
+
+/**
+ * Four rows at a time, same as fold_sse2
+ */
+__attribute__((target("avx2"))) static void
+fold_avx2(Store::Summary &s, const double *x, uint64_t mask)
+{
+	const __m256d sh = _mm256_set1_pd(s.shift), inf = _mm256_set1_pd(HUGE_VAL), ninf = _mm256_set1_pd(-HUGE_VAL);
+	const __m256i bit = _mm256_set_epi64x(8, 4, 2, 1);
+	__m256d sum = _mm256_setzero_pd(), dsum = sum, dsq = sum, lo = inf, hi = ninf;
+	if (!~mask) {
+		/* two lanes of sums, so additions don't wait for each other */
+		__m256d sum2 = sum, dsum2 = sum, dsq2 = sum;
+		for (unsigned i = 0; i < Store::TILE_SIZ; i += 8) {
+			__m256d v = _mm256_loadu_pd(x + i), w = _mm256_loadu_pd(x + i + 4);
+			__m256d d = _mm256_sub_pd(v, sh), e = _mm256_sub_pd(w, sh);
+			sum = _mm256_add_pd(sum, v);
+			sum2 = _mm256_add_pd(sum2, w);
+			dsum = _mm256_add_pd(dsum, d);
+			dsum2 = _mm256_add_pd(dsum2, e);
+			dsq = _mm256_add_pd(dsq, _mm256_mul_pd(d, d));
+			dsq2 = _mm256_add_pd(dsq2, _mm256_mul_pd(e, e));
+			lo = _mm256_min_pd(lo, _mm256_min_pd(v, w));
+			hi = _mm256_max_pd(hi, _mm256_max_pd(v, w));
+		}
+		sum = _mm256_add_pd(sum, sum2);
+		dsum = _mm256_add_pd(dsum, dsum2);
+		dsq = _mm256_add_pd(dsq, dsq2);
+		mask = 0;
+	}
+	for (unsigned i = 0; mask && i < Store::TILE_SIZ; i += 4) {
+		unsigned m = mask >> i & 15;
+		if (!m)
+			continue;
+		__m256d v = _mm256_loadu_pd(x + i), d = _mm256_sub_pd(v, sh), vlo = v, vhi = v;
+		if (m != 15) {
+			__m256i b = _mm256_and_si256(_mm256_set1_epi64x(m), bit);
+			__m256d keep = _mm256_castsi256_pd(_mm256_cmpeq_epi64(b, bit));
+			v = _mm256_and_pd(v, keep);
+			d = _mm256_and_pd(d, keep);
+			vlo = _mm256_blendv_pd(inf, v, keep);
+			vhi = _mm256_blendv_pd(ninf, v, keep);
+		}
+		sum = _mm256_add_pd(sum, v);
+		dsum = _mm256_add_pd(dsum, d);
+		dsq = _mm256_add_pd(dsq, _mm256_mul_pd(d, d));
+		lo = _mm256_min_pd(lo, vlo);
+		hi = _mm256_max_pd(hi, vhi);
+	}
+	double a[5][4];
+	_mm256_storeu_pd(a[0], sum);
+	_mm256_storeu_pd(a[1], dsum);
+	_mm256_storeu_pd(a[2], dsq);
+	_mm256_storeu_pd(a[3], lo);
+	_mm256_storeu_pd(a[4], hi);
+	merge(s, (a[0][0] + a[0][1]) + (a[0][2] + a[0][3]), (a[1][0] + a[1][1]) + (a[1][2] + a[1][3]),
+	      (a[2][0] + a[2][1]) + (a[2][2] + a[2][3]),
+	      std::min(std::min(a[3][0], a[3][1]), std::min(a[3][2], a[3][3])),
+	      std::max(std::max(a[4][0], a[4][1]), std::max(a[4][2], a[4][3])));
+}
+#endif
+
+/**
+ * Widest kernel the processor runs
+ */
+static Kernel::Level
+best(void)
+{
+#ifdef KERNEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return Kernel::AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return Kernel::SSE2;
+#endif
+	return Kernel::SCALAR;
+}
+
+static const Kernel::Level supported = best();
+static Kernel::Level level = supported;
+static const Fold kernels[] = {
+	fold_scalar,
+#ifdef KERNEL_X86
+	fold_sse2,
+	fold_avx2,
+#endif
+};
+
+/**
+ * Fold numbers of a block marked in `mask' into a summary;
+ * the first of them becomes its shift if it has none yet
+ */
+void
+Kernel::fold(Store::Summary &s, const double *x, uint64_t mask)
+{
+	if (!mask)
+		return;
+	if (!s.count)
+		s.shift = x[__builtin_ctzll(mask)];
+	kernels[level](s, x, mask);
+	s.count += __builtin_popcountll(mask);
+}
+
+Kernel::Level
+Kernel::get_level(void)
+{
+	return level;
+}
+
+/**
+ * Pick kernels of a given level, or the widest
+ * supported below it; returns level picked
+ */
+Kernel::Level
+Kernel::set_level(Level l)
+{
+	return level = std::min(l, supported);
+}
+
+const char *
+Kernel::name(Level l)
+{
+	static const char *names[] = { "scalar", "sse2", "avx2" };
+	return names[l];
+}
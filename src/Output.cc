@@ -0,0 +1,77 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <unistd.h>
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <Output.h>
+
+#define INITIAL_SIZ 65536
+
+Output::Output(int fd) : m_fd(fd)
+{
+	m_buf.reserve(INITIAL_SIZ);
+}
+
+/**
+ * Append decimal number
+ */
+void
+Output::put_uint(unsigned n)
+{
+	char tmp[10];
+	int i = sizeof(tmp);
+	do
+		tmp[--i] = '0' + n % 10;
+	while (n /= 10);
+	m_buf.append(tmp + i, sizeof(tmp) - i);
+}
+
+/**
+ * Append cursor movement escape sequence
+ */
+void
+Output::move(unsigned x, unsigned y)
+{
+	put("\33[", 2);
+	put_uint(y);
+	put(';');
+	put_uint(x);
+	put('H');
+}
+
+/**
+ * Write out buffered data and empty the buffer
+ * Returns number of bytes flushed.
+ */
+size_t
+Output::flush(void)
+{
+	size_t n = m_buf.size();
+	const char *p = m_buf.data();
+	if (m_fd >= 0)
+		for (size_t left = n; left > 0;) {
+			ssize_t w = write(m_fd, p, left);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			p += w;
+			left -= w;
+		}
+	m_buf.clear();
+	return n;
+}
+
+/**
+ * Number of bytes waiting to be flushed
+ */
+size_t
+Output::size(void) const
+{
+	return m_buf.size();
+}
@@ -0,0 +1,166 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <Pool.h>
+
+#define CHUNKS_PER_THREAD 4 /* more chunks balance better, fewer cost less */
+
+/**
+ * Start a pool of given size; zero means
+ * as many threads as there are cores
+ */
+Pool::Pool(unsigned n) : m_job(nullptr), m_left(0), m_gen(0), m_quit(false)
+{
+	start(n);
+}
+
+Pool::~Pool(void)
+{
+	stop();
+}
+
+/**
+ * Change number of threads; must not be called
+ * while a job is running
+ */
+void
+Pool::resize(unsigned n)
+{
+	stop();
+	start(n);
+}
+
+/**
+ * Number of threads working on a job,
+ * including the one submitting it
+ */
+unsigned
+Pool::size(void) const
+{
+	return m_queues.size();
+}
+
+void
+Pool::start(unsigned n)
+{
+	if (n == 0)
+		n = std::max(1u, std::thread::hardware_concurrency());
+	m_quit = false;
+	for (unsigned i = 0; i < n; ++i)
+		m_queues.push_back(std::make_unique<Queue>());
+	for (unsigned i = 0; i + 1 < n; ++i)
+		m_threads.emplace_back(&Pool::work, this, i);
+}
+
+void
+Pool::stop(void)
+{
+	{
+		std::lock_guard<std::mutex> l(m_lock);
+		m_quit = true;
+	}
+	m_wake.notify_all();
+	for (auto &t : m_threads)
+		t.join();
+	m_threads.clear();
+	m_queues.clear();
+}
+
+/**
+ * Deal chunks of a job out to all the queues, wake
+ * the threads up and help them until all is done
+ */
+void
+Pool::exec(size_t n, const std::function<void(size_t)> &fn)
+{
+	size_t q = m_queues.size(), step = std::max((size_t)1, n / (q * CHUNKS_PER_THREAD));
+	{
+		std::lock_guard<std::mutex> l(m_lock);
+		m_job = &fn;
+		m_left = n;
+		size_t i = 0;
+		for (size_t b = 0; b < n; b += step, i = (i + 1) % q) {
+			std::lock_guard<std::mutex> ql(m_queues[i]->lock);
+			m_queues[i]->chunks.push_back(Chunk{b, std::min(b + step, n)});
+		}
+		++m_gen;
+	}
+	m_wake.notify_all();
+	drain(q - 1);
+	std::unique_lock<std::mutex> l(m_lock);
+	m_done.wait(l, [this] { return m_left == 0; });
+	m_job = nullptr;
+}
+
+/**
+ * Body of a pool thread; sleeps until there's a new job
+ */
+void
+Pool::work(unsigned id)
+{
+	unsigned gen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> l(m_lock);
+			m_wake.wait(l, [this, gen] { return m_quit || m_gen != gen; });
+			if (m_quit)
+				return;
+			gen = m_gen;
+		}
+		drain(id);
+	}
+}
+
+/**
+ * Run chunks until there are none left anywhere
+ */
+void
+Pool::drain(unsigned id)
+{
+	Chunk c;
+	while (take(id, c)) {
+		for (size_t i = c.begin; i < c.end; ++i)
+			(*m_job)(i);
+		if ((m_left -= c.end - c.begin) == 0) {
+			std::lock_guard<std::mutex> l(m_lock);
+			m_done.notify_all();
+		}
+	}
+}
+
+/**
+ * Take chunk off the back of own queue or,
+ * failing that, steal one from the front of another
+ */
+bool
+Pool::take(unsigned id, Chunk &c)
+{
+	size_t q = m_queues.size();
+	for (size_t n = 0; n < q; ++n) {
+		Queue &qu = *m_queues[(id + n) % q];
+		std::lock_guard<std::mutex> l(qu.lock);
+		if (qu.chunks.empty())
+			continue;
+		if (n == 0) {
+			c = qu.chunks.back();
+			qu.chunks.pop_back();
+		} else {
+			c = qu.chunks.front();
+			qu.chunks.pop_front();
+		}
+		return true;
+	}
+	return false;
+}
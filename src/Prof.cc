@@ -0,0 +1,256 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <Prof.h>
+
+#define TRACE_MAX (1 << 20) /* events recorded at most */
+
+/* what's been recorded of a timed scope or a frame */
+struct Event {
+	uint64_t start, dur;
+	unsigned tid;
+	Prof::Probe probe;
+	size_t counters; /* of a frame, where they start among those of frames */
+};
+
+static std::atomic<bool> on(false);
+static thread_local uint64_t sums[Prof::PROBES]; /* of probes of the thread */
+static thread_local unsigned tid; /* of the trace, zero until the thread records */
+static std::atomic<uint64_t> latest_dur[Prof::TIMERS];
+static uint64_t last_frame[Prof::PROBES];
+static Prof::Histogram histograms[Prof::PROBES];
+
+static struct {
+	std::atomic<bool> on;
+	std::mutex lock;
+	std::string file;
+	std::vector<Event> events;
+	std::vector<uint64_t> counters; /* of frames, one after another */
+	unsigned tids;
+	uint64_t origin;
+} tracer;
+
+/**
+ * Count a value in its bucket
+ */
+void
+Prof::Histogram::add(uint64_t v)
+{
+	++buckets[v ? 64 - __builtin_clzll(v) : 0];
+	++count;
+}
+
+/**
+ * Value which `q' of those counted don't go over,
+ * up to the bound of its bucket
+ */
+uint64_t
+Prof::Histogram::quantile(double q) const
+{
+	uint64_t n = 0, want = q * count;
+	for (unsigned b = 0; b < BUCKETS; ++b)
+		if ((n += buckets[b]) > want || n == count)
+			return b < 64 ? (uint64_t(1) << b) - 1 : ~uint64_t(0);
+	return 0;
+}
+
+Prof::Scope::Scope(Probe p) : m_probe(p), m_start(on.load(std::memory_order_relaxed) ? now() : 0)
+{}
+
+Prof::Scope::~Scope(void)
+{
+	if (!m_start)
+		return;
+	uint64_t dur = now() - m_start;
+	sums[m_probe] += dur;
+	latest_dur[m_probe].store(dur, std::memory_order_relaxed);
+	if (tracer.on.load(std::memory_order_relaxed))
+		record(m_probe, m_start, dur);
+}
+
+Prof::Frame::Frame(void) : m_start(on.load(std::memory_order_relaxed) ? now() : 0)
+{
+	if (m_start)
+		std::memcpy(m_sums, sums, sizeof(m_sums));
+}
+
+/**
+ * Frames are drawn by a single thread, which
+ * keeps their values and histograms
+ */
+Prof::Frame::~Frame(void)
+{
+	if (!m_start)
+		return;
+	uint64_t values[PROBES];
+	values[FRAME] = now() - m_start;
+	for (unsigned p = FRAME + 1; p < PROBES; ++p)
+		values[p] = sums[p] - m_sums[p];
+	for (unsigned p = 0; p < PROBES; ++p)
+		histograms[p].add(last_frame[p] = values[p]);
+	if (tracer.on.load(std::memory_order_relaxed))
+		record(FRAME, m_start, values[FRAME], values);
+}
+
+/**
+ * Turn timers on or off; they stay on while tracing
+ */
+void
+Prof::enable(bool e)
+{
+	on = e || tracing();
+}
+
+bool
+Prof::enabled(void)
+{
+	return on;
+}
+
+/**
+ * Add to a probe of this thread
+ */
+void
+Prof::count(Probe p, uint64_t n)
+{
+	sums[p] += n;
+}
+
+/**
+ * Value of a probe in the last frame drawn
+ */
+uint64_t
+Prof::last(Probe p)
+{
+	return last_frame[p];
+}
+
+/**
+ * Duration of the latest scope timed by a probe,
+ * on any thread, like the last load of a file
+ */
+uint64_t
+Prof::latest(Probe p)
+{
+	return p < TIMERS ? latest_dur[p].load(std::memory_order_relaxed) : 0;
+}
+
+const Prof::Histogram &
+Prof::histogram(Probe p)
+{
+	return histograms[p];
+}
+
+const char *
+Prof::name(Probe p)
+{
+	static const char *names[PROBES] = {
+		"frame", "cells", "emit", "load",
+		"bytes", "visited", "drawn", "lookups", "abs pos"
+	};
+	return names[p];
+}
+
+/**
+ * Record timed scopes and frames, to be written
+ * to a file once finished; turns timers on
+ */
+void
+Prof::trace(const std::string &filename)
+{
+	std::lock_guard<std::mutex> lock(tracer.lock);
+	tracer.file = filename;
+	tracer.origin = now();
+	tracer.on = true;
+	on = true;
+}
+
+bool
+Prof::tracing(void)
+{
+	return tracer.on;
+}
+
+/**
+ * Write out the trace recorded, as Chrome's trace events;
+ * times are in microseconds
+ */
+void
+Prof::finish(void)
+{
+	std::lock_guard<std::mutex> lock(tracer.lock);
+	if (!tracer.on)
+		return;
+	tracer.on = false;
+	FILE *f = std::fopen(tracer.file.c_str(), "w");
+	if (!f)
+		throw std::runtime_error("can't write " + tracer.file);
+	std::fputs("{\"traceEvents\":[", f);
+	const char *sep = "\n";
+	for (const Event &e : tracer.events) {
+		double ts = (e.start - tracer.origin) / 1e3;
+		std::fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+		    sep, name(e.probe), e.tid, ts, e.dur / 1e3);
+		sep = ",\n";
+		if (e.probe != FRAME)
+			continue;
+		std::fprintf(f, "%s{\"name\":\"frame\",\"ph\":\"C\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{",
+		    sep, e.tid, ts);
+		for (unsigned p = TIMERS; p < PROBES; ++p)
+			std::fprintf(f, "%s\"%s\":%" PRIu64, p == TIMERS ? "" : ",", name(Probe(p)),
+			    tracer.counters[e.counters + p - TIMERS]);
+		std::fputs("}}", f);
+	}
+	std::fputs("\n],\"displayTimeUnit\":\"ms\"}\n", f);
+	tracer.events.clear();
+	tracer.events.shrink_to_fit();
+	tracer.counters.clear();
+	tracer.counters.shrink_to_fit();
+	if (std::fclose(f))
+		throw std::runtime_error("can't write " + tracer.file);
+}
+
+/**
+ * Nanoseconds of a steady clock, never zero
+ */
+uint64_t
+Prof::now(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now().time_since_epoch()).count() | 1;
+}
+
+/**
+ * Record a timed scope, or a frame along with its counters,
+ * for the trace unless it's got as many events as it can take
+ */
+void
+Prof::record(Probe p, uint64_t start, uint64_t dur, const uint64_t *values)
+{
+	std::lock_guard<std::mutex> lock(tracer.lock);
+	if (!tracer.on || tracer.events.size() >= TRACE_MAX)
+		return;
+	if (!tid)
+		tid = ++tracer.tids;
+	Event e;
+	e.start = start;
+	e.dur = dur;
+	e.tid = tid;
+	e.probe = p;
+	e.counters = tracer.counters.size();
+	if (values)
+		tracer.counters.insert(tracer.counters.end(), values + TIMERS, values + PROBES);
+	tracer.events.push_back(e);
+}
@@ -0,0 +1,206 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <Prof.h>
+#include <Output.h>
+#include <Screen.h>
+
+#define MERGE_GAP 4 /* unchanged glyphs worth rewriting instead of moving */
+
+bool
+Screen::Glyph::operator==(const Glyph &g) const
+{
+	return ch == g.ch && style == g.style;
+}
+
+/**
+ * Init screen writing to a given file descriptor;
+ * style 0 is the terminal default.
+ */
+Screen::Screen(int fd) : m_out(fd), m_cols(0), m_lines(0), m_valid(false), m_bytes(0), m_frame_bytes(0)
+{
+	style(Attr{-1, -1, false, false});
+}
+
+/**
+ * Register text attributes and build their
+ * escape code
+ */
+Screen::Style
+Screen::style(const Attr &a)
+{
+	std::string sgr = "\33[0";
+	if (a.bold)
+		sgr += ";1";
+	if (a.inverse)
+		sgr += ";7";
+	if (a.fg >= 0)
+		sgr += ";38;5;" + std::to_string(a.fg);
+	if (a.bg >= 0)
+		sgr += ";48;5;" + std::to_string(a.bg);
+	sgr += "m";
+	for (size_t i = 0; i < m_sgr.size(); ++i)
+		if (m_sgr[i] == sgr)
+			return i;
+	m_sgr.push_back(sgr);
+	return m_sgr.size() - 1;
+}
+
+/**
+ * Set screen dimensions; contents of the terminal
+ * are considered lost when they change.
+ */
+void
+Screen::resize(unsigned cols, unsigned lines)
+{
+	if (cols == m_cols && lines == m_lines)
+		return;
+	m_cols = cols;
+	m_lines = lines;
+	m_back.assign(cols * lines, Glyph{' ', 0});
+	m_front = m_back;
+	m_valid = false;
+}
+
+/**
+ * Blank the whole back buffer
+ */
+void
+Screen::clear(void)
+{
+	std::fill(m_back.begin(), m_back.end(), Glyph{' ', 0});
+}
+
+/**
+ * Blank a single line of the back buffer
+ */
+void
+Screen::clear_line(unsigned y)
+{
+	if (Glyph *g = at(m_back, 1, y))
+		std::fill(g, g + m_cols, Glyph{' ', 0});
+}
+
+/**
+ * Put text into the back buffer
+ * Text is cut to `width' characters. If `fill' is set it is
+ * right-aligned and padded to the full width, otherwise
+ * the rest of the space is left untouched.
+ */
+void
+Screen::put(unsigned x, unsigned y, std::string_view s, unsigned width, Style st, bool fill)
+{
+	if (y < 1 || y > m_lines || x < 1 || x > m_cols)
+		return;
+	if (width > m_cols - x + 1) /* clip at the right edge */
+		width = m_cols - x + 1;
+	size_t n = s.size() < width ? s.size() : width;
+	Glyph *g = at(m_back, x, y);
+	if (fill)
+		for (unsigned i = n; i < width; ++i)
+			*g++ = Glyph{' ', st};
+	for (size_t i = 0; i < n; ++i)
+		*g++ = Glyph{s[i], st};
+}
+
+/**
+ * Forget what the terminal shows; next flush
+ * rewrites the whole screen.
+ */
+void
+Screen::invalidate(void)
+{
+	m_valid = false;
+}
+
+/**
+ * Write out the differences between back buffer and the
+ * terminal, then place terminal cursor at given position.
+ * The whole frame goes out in a single write.
+ * Returns number of bytes written.
+ */
+size_t
+Screen::flush(unsigned cx, unsigned cy)
+{
+	PROF_SCOPE(EMIT);
+	int cur = -1; /* style the terminal is in, if known */
+	for (unsigned y = 1; y <= m_lines; ++y) {
+		Glyph *back = at(m_back, 1, y), *front = at(m_front, 1, y);
+		for (unsigned x = 0; x < m_cols; ++x) {
+			if (m_valid && back[x] == front[x])
+				continue;
+			/* extend span over short runs of unchanged glyphs */
+			unsigned last = x;
+			for (unsigned i = x + 1; i < m_cols && i - last <= MERGE_GAP; ++i)
+				if (!m_valid || !(back[i] == front[i]))
+					last = i;
+			m_out.move(x + 1, y);
+			PROF_COUNT(DRAWN, last - x + 1);
+			for (; x <= last; ++x) {
+				if (back[x].style != cur) {
+					cur = back[x].style;
+					m_out.put(m_sgr[cur]);
+				}
+				m_out.put(back[x].ch);
+				front[x] = back[x];
+			}
+			--x;
+		}
+	}
+	if (cur > 0)
+		m_out.put(m_sgr[0]);
+	m_out.move(cx, cy);
+	m_valid = true;
+	m_frame_bytes = m_out.flush();
+	m_bytes += m_frame_bytes;
+	PROF_COUNT(BYTES, m_frame_bytes);
+	return m_frame_bytes;
+}
+
+/**
+ * Write raw escape sequence or text right away,
+ * bypassing the buffers
+ */
+void
+Screen::write(std::string_view s)
+{
+	m_out.put(s);
+	m_bytes += m_out.flush();
+}
+
+/**
+ * Total number of bytes written to the terminal
+ */
+size_t
+Screen::get_bytes(void) const
+{
+	return m_bytes;
+}
+
+/**
+ * Number of bytes written by the last flush
+ */
+size_t
+Screen::get_frame_bytes(void) const
+{
+	return m_frame_bytes;
+}
+
+/**
+ * Glyph at given terminal coordinates or null
+ * if they are off the screen
+ */
+Screen::Glyph *
+Screen::at(std::vector<Glyph> &buf, unsigned x, unsigned y)
+{
+	if (x < 1 || y < 1 || x > m_cols || y > m_lines)
+		return nullptr;
+	return &buf[(y - 1) * m_cols + x - 1];
+}
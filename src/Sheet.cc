@@ -3,37 +3,127 @@
  * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <ostream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <Prof.h>
 #include <Value.h>
 #include <Cell.h>
+#include <Axis.h>
+#include <Store.h>
+#include <Formula.h>
+#include <Deps.h>
+#include <Pool.h>
+#include <Journal.h>
+#include <History.h>
 #include <Sheet.h>
 
 #define DEFAULT_WIDTH 10
 #define DEFAULT_HEIGHT 1
+#define PARALLEL_MIN 64 /* smaller levels aren't worth waking threads up */
+#define NOTIFY_MS 30 /* least time between notifications of landed values */
+#define PREFETCH 16 /* rows ahead whose values are fetched while moving cells */
+#define TEXT_MAGIC "CELLSF"
+#define BINARY_MAGIC "CELLSB\0\3" /* version 3 */
+#define BINARY_EXT ".cellsb"
+#define BYTE_ORDER_MARK 0x01020304
+#define JOURNAL_MAX (1 << 20) /* bytes of edits journaled before a checkpoint is taken */
+#define CSV_PIECE (1 << 22) /* bytes of a CSV file parsed by a thread at a time */
+#define CSV_BAND 64 /* rows of a CSV file written at a time, a row of tiles */
+#define TSV_EXT ".tsv"
+
+/*
+ * Copy of a sheet being saved; cells share tiles
+ * with the sheet, so it's cheap to take and stays
+ * the same as the sheet is edited.
+ */
+struct Sheet::Image {
+	Image(const Sheet &);
+	void advance(size_t);
+	Axis col_siz, row_siz;
+	Store cells;
+	std::unordered_map<Cell::Pos, std::shared_ptr<const Formula>, Cell::Pos::Hash> formulas;
+	bool stale; /* taken amid recalculation */
+	size_t total; /* cells to write */
+	std::atomic<size_t> done; /* of them written */
+	std::atomic<bool> finished;
+	std::string file; /* saved to, if not just checkpointed */
+	std::string err; /* why it couldn't be written, once finished */
+	std::function<void(void)> notify; /* called as every percent is written */
+};
 
 Sheet::Sheet(void)
+	: m_col_siz(DEFAULT_WIDTH), m_row_siz(DEFAULT_HEIGHT), m_stats{0, 0, 0},
+	  m_busy(false), m_cancel(false)
 {}
 
 Sheet::~Sheet(void)
-{}
+{
+	stop();
+	if (m_saver.joinable())
+		m_saver.join();
+}
 
 /**
  * Insert value[s] into given cell range of the sheet
  * For a given cell value is increased by its index
  * i.e. distance from the starting point.
+ * A formula is compiled once for the first cell of the range
+ * and shared by the rest, its relative references following
+ * each cell like they would if formula was entered by hand.
  */
 void
 Sheet::insert(const Cell::Range &range, const Value &value)
 {
-	for (Cell::Pos cur = range.begin; cur.col <= range.end.col; ++cur.col)
-		for (cur.row = range.begin.row; cur.row <= range.end.row; ++cur.row)
-			m_cells[cur] = Cell(cur, value + range.index_of(cur));
+	std::shared_ptr<const Formula> f;
+	if (value.get_type() == Value::FORMULA)
+		f = std::make_shared<const Formula>(value.eval(), range.begin); /* not journaled unless it compiles */
+	if (m_journal)
+		m_journal->insert(range, value);
+	if (f) {
+		stop();
+		if (m_history.get_max())
+			m_history.add(keep(range));
+		for (Cell::Pos cur = range.begin; cur.col <= range.end.col; ++cur.col)
+			for (cur.row = range.begin.row; cur.row <= range.end.row; ++cur.row)
+				bind(cur, f);
+		m_cells.fill(range, Value(), true);
+	} else {
+		stop();
+		if (m_history.get_max())
+			m_history.add(keep(range));
+		drop_formulas(range);
+		m_cells.fill(range, value);
+	}
+	recalc(range);
+	checkpoint();
 }
 
 /**
@@ -42,47 +132,785 @@ Sheet::insert(const Cell::Range &range, const Value &value)
 void
 Sheet::remove(const Cell::Range &range)
 {
-	for (Cell::Pos cur = range.begin; cur.col <= range.end.col; ++cur.col)
-		for (cur.row = range.begin.row; cur.row <= range.end.row; ++cur.row)
-			m_cells.erase(cur);
+	if (m_journal)
+		m_journal->remove(range);
+	stop();
+	if (m_history.get_max())
+		m_history.add(keep(range));
+	drop_formulas(range);
+	m_cells.erase(range);
+	recalc(range);
+	checkpoint();
 }
 
+/*
+ * Sort keys: rows holding numbers or errors, and strings
+ */
+struct Key {
+	double num; /* number or error code */
+	unsigned row; /* within range sorted */
+};
+struct Text {
+	std::string_view str;
+	unsigned row;
+};
+
 /**
- * Parse input value;
- * convert it either to int, double
- * or leave it as a string.
+ * Sort rows of a range by values of one of its columns,
+ * in ascending or descending order: numbers, then strings,
+ * then errors, empty cells coming last either way. Rows with
+ * equal keys keep their order. Formulas move with their cells,
+ * relative references following them.
+ * Keys of each type are sorted in a flat array of their own,
+ * then cells are moved a column at a time through an array
+ * of values of its rows.
  */
-Value
-Sheet::parse(const std::string &s)
+void
+Sheet::sort(const Cell::Range &range, unsigned col, bool desc)
+{
+	if (range.end.row <= range.begin.row || col < range.begin.col || col > range.end.col)
+		return;
+	if (m_journal)
+		m_journal->sort(range, col, desc);
+	wait();
+	unsigned n = range.end.row - range.begin.row + 1;
+	std::vector<Key> nums, errs;
+	std::vector<Text> strs;
+	std::vector<bool> held(n);
+	Cell::Range part = range;
+	part.begin.col = part.end.col = col;
+	m_cells.for_each(part, [&](const Cell::Pos &p, const Value &v) {
+		unsigned row = p.row - range.begin.row;
+		switch (v.get_type()) {
+		case Value::INTEGER:
+		case Value::DOUBLE:
+			nums.push_back(Key{v.get_num(), row});
+			break;
+		case Value::STRING:
+			strs.push_back(Text{v.get_str(), row});
+			break;
+		case Value::ERROR:
+			errs.push_back(Key{(double)v.get_error(), row});
+			break;
+		default:
+			return;
+		}
+		held[row] = true;
+	});
+	auto by_num = [desc](const Key &a, const Key &b) { return desc ? b.num < a.num : a.num < b.num; };
+	m_pool.sort(nums, by_num);
+	m_pool.sort(errs, by_num);
+	m_pool.sort(strs, [desc](const Text &a, const Text &b) { return desc ? b.str < a.str : a.str < b.str; });
+
+	/* from[i] is where row i of the range comes from */
+	std::vector<unsigned> from;
+	from.reserve(n);
+	auto take = [&from](const auto &keys) {
+		for (auto &k : keys)
+			from.push_back(k.row);
+	};
+	take(desc ? errs : nums);
+	take(strs);
+	take(desc ? nums : errs);
+	for (unsigned i = 0; i < n; ++i)
+		if (!held[i])
+			from.push_back(i);
+	bool moved = false;
+	for (unsigned i = 0; i < n && !moved; ++i)
+		moved = from[i] != i;
+	if (!moved)
+		return;
+	nums = errs = std::vector<Key>();
+	strs = std::vector<Text>();
+
+	if (m_history.get_max())
+		m_history.add(keep(range));
+	History::Formulas moving = formulas(range);
+	drop_formulas(range);
+	std::vector<Value> vals(n);
+	held.assign(n, false);
+	for (unsigned c = range.begin.col; c <= range.end.col; ++c) {
+		part.begin.col = part.end.col = c;
+		bool any = false;
+		m_cells.for_each(part, [&vals, &held, &any, &range](const Cell::Pos &p, const Value &v) {
+			vals[p.row - range.begin.row] = v;
+			held[p.row - range.begin.row] = true;
+			any = true;
+		});
+		if (!any)
+			continue;
+		m_cells.erase(part);
+		Store::Bulk bulk(m_cells);
+		Cell::Pos p;
+		p.col = c;
+		for (unsigned i = 0; i < n; ++i) {
+			if (i + PREFETCH < n)
+				__builtin_prefetch(&vals[from[i + PREFETCH]]);
+			if (!held[from[i]])
+				continue;
+			p.row = range.begin.row + i;
+			bulk.set(p, std::move(vals[from[i]]));
+			held[from[i]] = false;
+		}
+	}
+	std::vector<unsigned> to(n);
+	for (unsigned i = 0; i < n; ++i)
+		to[from[i]] = range.begin.row + i;
+	for (auto &f : moving) {
+		Cell::Pos p = f.first;
+		p.row = to[p.row - range.begin.row];
+		Value v = *m_cells.get(p);
+		bind(p, std::move(f.second));
+		m_cells.set(p, v, true);
+	}
+	recalc(range);
+	checkpoint();
+}
+
+/**
+ * Undo the last edit not undone yet;
+ * returns false if there's none
+ */
+bool
+Sheet::undo(void)
+{
+	return step(false);
+}
+
+/**
+ * Redo the last edit undone;
+ * returns false if there's none
+ */
+bool
+Sheet::redo(void)
+{
+	return step(true);
+}
+
+/**
+ * Apply the latest history entry to undo, or to redo:
+ * contents of its range are put back, cells and formulas
+ * of the range being swapped with those the entry keeps,
+ * so that it can be applied again the other way round.
+ * Cells kept by tiles bring back values of formulas of
+ * their tiles as they were, so those are recomputed.
+ */
+bool
+Sheet::step(bool redo)
+{
+	if (m_history.empty(redo))
+		return false;
+	History::Entry e = m_history.take(redo);
+	Journal::Op op = redo ? Journal::REDO : Journal::UNDO;
+	bool held = m_journal && e.epoch == m_journal->epoch();
+	if (held)
+		m_journal->step(op, e.range);
+	if (e.kind == History::CELLS) {
+		stop();
+		History::Formulas fs = formulas(e.range);
+		drop_formulas(e.range);
+		m_cells.restore(e.cells);
+		for (auto &f : e.formulas)
+			bind(f.first, std::move(f.second));
+		e.formulas = std::move(fs);
+		recalc(e.cells.extent());
+	} else {
+		Axis &axis = e.kind == History::COL_SIZ ? m_col_siz : m_row_siz;
+		unsigned siz = axis.get(e.range.begin.row);
+		axis.set(e.range.begin.row, e.siz);
+		e.siz = siz;
+	}
+	if (m_journal && !held) {
+		/* replay won't have it in history; journal what it's undone to */
+		std::vector<std::pair<Cell::Pos, Value>> cells;
+		if (e.kind == History::CELLS)
+			m_cells.for_each(e.range, [this, &cells](const Cell::Pos &p, const Value &v) {
+				auto f = m_formulas.find(p);
+				cells.emplace_back(p, f == m_formulas.end() ? v : Value::formula(f->second->get_src(p)));
+			});
+		Journal::Op of = e.kind == History::CELLS ? Journal::INSERT :
+		                 e.kind == History::COL_SIZ ? Journal::COL_SIZ : Journal::ROW_SIZ;
+		unsigned siz = e.kind == History::COL_SIZ ? m_col_siz.get(e.range.begin.row) :
+		               m_row_siz.get(e.range.begin.row);
+		m_journal->restore(op, of, e.range, siz, cells);
+	}
+	e.epoch = m_journal ? m_journal->epoch() : 0;
+	m_history.put(std::move(e), !redo);
+	checkpoint();
+	return true;
+}
+
+/**
+ * Undo or redo an edit journaled along with what it left
+ * its range with, as it came before the journal began:
+ * the range is set to that and what it held goes to
+ * history, as if the edit had been taken from there
+ */
+void
+Sheet::revert(const Journal::Edit &e)
+{
+	bool redo = e.op == Journal::REDO;
+	if (e.of == Journal::INSERT) {
+		stop();
+		History::Entry h = keep(e.range);
+		drop_formulas(e.range);
+		m_cells.erase(e.range);
+		for (auto &c : e.cells)
+			if (c.second.get_type() == Value::FORMULA)
+				set_formula(c.first, std::make_shared<const Formula>(c.second.eval(), c.first));
+			else if (c.second.get_type() == Value::STRING)
+				m_cells.set(c.first, m_cells.intern(c.second.get_str()));
+			else
+				m_cells.set(c.first, c.second);
+		recalc(e.range);
+		m_history.put(std::move(h), !redo);
+	} else {
+		History::Kind kind = e.of == Journal::COL_SIZ ? History::COL_SIZ : History::ROW_SIZ;
+		m_history.put(keep(kind, e.range.begin.row), !redo);
+		(kind == History::COL_SIZ ? m_col_siz : m_row_siz).set(e.range.begin.row, e.n);
+	}
+}
+
+/**
+ * Set how much memory history of edits may take;
+ * zero turns it off
+ */
+void
+Sheet::set_undo(size_t bytes)
+{
+	m_history.set_max(bytes);
+}
+
+size_t
+Sheet::get_undo(void) const
+{
+	return m_history.get_max();
+}
+
+/**
+ * Recompute all formula cells
+ */
+void
+Sheet::recalc(void)
+{
+	stop();
+	std::vector<Cell::Pos> dirty;
+	dirty.reserve(m_formulas.size());
+	for (auto &f : m_formulas)
+		dirty.push_back(f.first);
+	start(dirty);
+}
+
+/**
+ * Recompute formula cells affected by an edit of a range:
+ * formulas entered into it and everything depending on it.
+ */
+void
+Sheet::recalc(const Cell::Range &range)
+{
+	std::vector<Cell::Pos> dirty;
+	if (!m_formulas.empty()) {
+		m_cells.for_each(range, [&dirty](const Cell::Pos &p, const Value &) {
+			dirty.push_back(p);
+		}, &Store::Column::formula);
+		m_deps.dependents(range, [&dirty](const Cell::Pos &p) {
+			dirty.push_back(p);
+		});
+	}
+	start(dirty);
+}
+
+/**
+ * Recompute given cells along with those an interrupted
+ * recalculation left behind; in the background if the sheet
+ * was told to, otherwise right away.
+ * Recalculation must not be running.
+ */
+void
+Sheet::start(std::vector<Cell::Pos> &dirty)
+{
+	for (auto &p : m_left)
+		if (m_formulas.count(p))
+			dirty.push_back(p);
+	m_left.clear();
+	if (!m_notify) {
+		recompute(dirty);
+		return;
+	}
+	m_busy = true;
+	m_job = std::thread([this, dirty = std::move(dirty)] {
+		recompute(dirty);
+		m_busy = false;
+		m_notify();
+	});
+}
+
+/**
+ * Interrupt background recalculation; cells it
+ * didn't get to are recomputed along with the next edit.
+ */
+void
+Sheet::stop(void)
+{
+	if (!m_job.joinable())
+		return;
+	m_cancel = true;
+	m_job.join();
+	m_cancel = false;
+}
+
+/**
+ * Wait for background recalculation to finish
+ */
+void
+Sheet::wait(void)
+{
+	if (m_job.joinable())
+		m_job.join();
+}
+
+/**
+ * Check if recalculation is running in the background
+ */
+bool
+Sheet::busy(void) const
+{
+	return m_busy;
+}
+
+/**
+ * Make recalculation run in the background, calling `fn'
+ * every now and then as values land and once it's done;
+ * empty function brings recalculation back to foreground.
+ * `fn' is called from another thread.
+ */
+void
+Sheet::set_background(std::function<void(void)> fn)
+{
+	wait();
+	if (m_saver.joinable())
+		m_saver.join(); /* it notifies too */
+	m_notify = std::move(fn);
+}
+
+/**
+ * Set number of threads evaluating formulas;
+ * zero means one per core
+ */
+void
+Sheet::set_threads(unsigned n)
+{
+	wait();
+	m_pool.resize(n);
+}
+
+unsigned
+Sheet::get_threads(void) const
+{
+	return m_pool.size();
+}
+
+/**
+ * Lock the sheet against background recalculation
+ * writing results; needed for reading cell values
+ * while it may be running.
+ */
+std::unique_lock<std::mutex>
+Sheet::lock(void) const
+{
+	return std::unique_lock<std::mutex>(m_lock);
+}
+
+/*
+ * Formula cell being recomputed
+ */
+struct Node {
+	unsigned in; /* dirty precedents not recomputed yet */
+	bool done;
+	std::vector<Cell::Pos> out; /* dirty dependents */
+};
+typedef std::unordered_map<Cell::Pos, Node, Cell::Pos::Hash> Nodes;
+
+/**
+ * Split nodes left with unfinished precedents into strongly
+ * connected components (Tarjan); components come out in order
+ * opposite to that of evaluation.
+ */
+static std::vector<std::vector<Cell::Pos>>
+components(Nodes &nodes)
+{
+	struct Mark {
+		unsigned idx, low;
+		bool on_stack;
+	};
+	std::unordered_map<Cell::Pos, Mark, Cell::Pos::Hash> mark;
+	std::vector<std::pair<Cell::Pos, size_t>> path; /* node and its next edge */
+	std::vector<Cell::Pos> stack;
+	std::vector<std::vector<Cell::Pos>> comps;
+	auto visit = [&](const Cell::Pos &p) {
+		unsigned idx = mark.size();
+		mark[p] = Mark{idx, idx, true};
+		stack.push_back(p);
+		path.emplace_back(p, 0);
+	};
+	for (auto &root : nodes) {
+		if (!root.second.in || mark.count(root.first))
+			continue;
+		visit(root.first);
+		while (!path.empty()) {
+			Cell::Pos p = path.back().first;
+			auto &out = nodes[p].out;
+			if (path.back().second < out.size()) {
+				Cell::Pos d = out[path.back().second++];
+				auto m = mark.find(d);
+				if (m == mark.end())
+					visit(d);
+				else if (m->second.on_stack)
+					mark[p].low = std::min(mark[p].low, m->second.idx);
+				continue;
+			}
+			path.pop_back();
+			Mark &mp = mark[p];
+			if (!path.empty()) {
+				Mark &up = mark[path.back().first];
+				up.low = std::min(up.low, mp.low);
+			}
+			if (mp.low != mp.idx)
+				continue;
+			comps.emplace_back();
+			do {
+				comps.back().push_back(stack.back());
+				mark[stack.back()].on_stack = false;
+				stack.pop_back();
+			} while (!(comps.back().back() == p));
+		}
+	}
+	return comps;
+}
+
+/**
+ * Recompute given formula cells and all their transitive
+ * dependents, each after the cells it refers to.
+ * Cells are taken level by level: a level holds cells whose
+ * precedents are all done, so its cells can be evaluated in
+ * parallel. Results of a level are written out at once.
+ * Cells referring to themselves, directly or through
+ * other cells, evaluate to #CYCLE!.
+ */
+void
+Sheet::recompute(const std::vector<Cell::Pos> &seeds)
+{
+	Nodes nodes(seeds.size());
+	std::vector<Cell::Pos> dirty;
+	for (auto &p : seeds)
+		if (nodes.emplace(p, Node{0, false, {}}).second)
+			dirty.push_back(p);
+	/* find everything affected, noting edges on the way */
+	for (size_t n = 0; n < dirty.size(); ++n) {
+		Cell::Pos p = dirty[n];
+		m_deps.dependents(Cell::Range(p, p), [&](const Cell::Pos &d) {
+			auto it = nodes.emplace(d, Node{0, false, {}});
+			if (it.second)
+				dirty.push_back(d);
+			++it.first->second.in;
+			nodes[p].out.push_back(d);
+		});
+	}
+	/* topological order (Kahn), a level at a time */
+	std::vector<Cell::Pos> level, next;
+	std::vector<Value> vals;
+	for (auto &n : nodes)
+		if (!n.second.in)
+			level.push_back(n.first);
+	size_t done = 0;
+	auto notified = std::chrono::steady_clock::now();
+	auto eval = [&](size_t i) {
+		if (!m_cancel)
+			vals[i] = m_formulas.at(level[i])->eval(level[i], m_cells);
+	};
+	while (!level.empty()) {
+		vals.assign(level.size(), Value());
+		if (level.size() < PARALLEL_MIN)
+			for (size_t i = 0; i < level.size(); ++i)
+				eval(i);
+		else
+			m_pool.run(level.size(), eval);
+		if (m_cancel)
+			break;
+		std::unique_lock<std::mutex> l(m_lock);
+		for (size_t i = 0; i < level.size(); ++i)
+			m_cells.set(level[i], vals[i], true);
+		l.unlock();
+		done += level.size();
+		next.clear();
+		for (auto &p : level) {
+			Node &n = nodes[p];
+			n.done = true;
+			for (auto &d : n.out)
+				if (--nodes[d].in == 0)
+					next.push_back(d);
+		}
+		level.swap(next);
+		auto now = std::chrono::steady_clock::now();
+		if (m_notify && !level.empty() && now - notified > std::chrono::milliseconds(NOTIFY_MS)) {
+			m_notify();
+			notified = now;
+		}
+	}
+	std::lock_guard<std::mutex> l(m_lock);
+	if (m_cancel) {
+		for (auto &n : nodes)
+			if (!n.second.done)
+				m_left.push_back(n.first);
+		return;
+	}
+	m_stats.cycles = 0;
+	if (done < nodes.size()) {
+		/* what's left are cycles and cells depending on them */
+		auto comps = components(nodes);
+		for (auto c = comps.rbegin(); c != comps.rend(); ++c) {
+			const Cell::Pos &p = c->front();
+			auto &out = nodes[p].out;
+			if (c->size() > 1 || std::find(out.begin(), out.end(), p) != out.end()) {
+				for (auto &q : *c)
+					m_cells.set(q, Value::error(Value::CYCLE), true);
+				m_stats.cycles += c->size();
+			} else
+				m_cells.set(p, m_formulas.at(p)->eval(p, m_cells), true);
+		}
+	}
+	m_stats.cells = nodes.size();
+	m_stats.total += nodes.size();
+}
+
+/**
+ * Number of cells recomputed after the last edit
+ */
+Sheet::Stats
+Sheet::get_stats(void) const
+{
+	std::lock_guard<std::mutex> l(m_lock);
+	return m_stats;
+}
+
+/**
+ * Put formula into a cell, replacing any other;
+ * its value is left empty until recomputed.
+ */
+void
+Sheet::set_formula(const Cell::Pos &p, std::shared_ptr<const Formula> f)
+{
+	bind(p, std::move(f));
+	m_cells.set(p, Value(), true);
+}
+
+/**
+ * Attach formula to a cell, replacing any other,
+ * without touching value of the cell
+ */
+void
+Sheet::bind(const Cell::Pos &p, std::shared_ptr<const Formula> f)
+{
+	auto it = m_formulas.find(p);
+	if (it != m_formulas.end())
+		it->second->each_ref(p, [this, &p](const Cell::Range &r) { m_deps.remove(p, r); });
+	f->each_ref(p, [this, &p](const Cell::Range &r) { m_deps.add(p, r); });
+	m_formulas[p] = std::move(f);
+}
+
+/**
+ * Forget formulas of cells within a range
+ */
+void
+Sheet::drop_formulas(const Cell::Range &range)
+{
+	if (m_formulas.empty())
+		return;
+	m_cells.for_each(range, [this](const Cell::Pos &p, const Value &) {
+		auto it = m_formulas.find(p);
+		it->second->each_ref(p, [this, &p](const Cell::Range &r) { m_deps.remove(p, r); });
+		m_formulas.erase(it);
+	}, &Store::Column::formula);
+}
+
+/**
+ * Get formulas of cells within a range
+ */
+History::Formulas
+Sheet::formulas(const Cell::Range &range) const
+{
+	History::Formulas fs;
+	if (!m_formulas.empty())
+		m_cells.for_each(range, [this, &fs](const Cell::Pos &p, const Value &) {
+			fs.emplace_back(p, m_formulas.at(p));
+		}, &Store::Column::formula);
+	return fs;
+}
+
+/**
+ * Make a history entry of what a range of cells
+ * holds before it's edited
+ */
+History::Entry
+Sheet::keep(const Cell::Range &range) const
+{
+	History::Entry e;
+	e.kind = History::CELLS;
+	e.range = range;
+	e.cells = m_cells.keep(range);
+	e.formulas = formulas(range);
+	e.siz = 0;
+	e.epoch = m_journal ? m_journal->epoch() : 0;
+	return e;
+}
+
+/**
+ * Make a history entry of size of a column
+ * or row before it's set; `kind' is COL_SIZ
+ * or ROW_SIZ
+ */
+History::Entry
+Sheet::keep(History::Kind kind, unsigned idx) const
+{
+	History::Entry e;
+	e.kind = kind;
+	e.range.begin.row = e.range.begin.col = e.range.end.row = e.range.end.col = idx;
+	e.siz = kind == History::COL_SIZ ? m_col_siz.get(idx) : m_row_siz.get(idx);
+	e.epoch = m_journal ? m_journal->epoch() : 0;
+	return e;
+}
+
+/**
+ * Read a number the way parse does: digits with at most
+ * one point, as int if it fits and is whole, else as double
+ */
+static bool
+number(std::string_view s, Value &v)
 {
-	if (s.empty())
-		return Value();
 	bool frac = false;
 	for (auto &c : s)
 		if (!std::isdigit(c)) {
 			if (c == '.' && !frac)
 				frac = true;
 			else
-				return Value(s);
+				return false;
+		}
+	const char *b = s.data(), *e = b + s.size();
+	if (!frac) {
+		int i;
+		if (std::from_chars(b, e, i).ec == std::errc()) {
+			v = Value(i);
+			return true;
 		}
-	return frac ? Value(std::stod(s)) : Value(std::stoi(s));
+	}
+	double d; /* fractions and integers too big for int */
+	if (std::from_chars(b, e, d).ec == std::errc()) {
+		v = Value(d);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Parse input value;
+ * convert it either to int, double
+ * or leave it as a string.
+ * Text starting with `=' is a formula.
+ */
+Value
+Sheet::parse(std::string_view s)
+{
+	if (s.empty())
+		return Value();
+	if (s[0] == '=')
+		return Value::formula(std::string(s));
+	Value v;
+	if (number(s, v))
+		return v;
+	return m_cells.intern(s);
+}
+
+/**
+ * Get value of a cell or null if it's empty
+ */
+const Value *
+Sheet::get(const Cell::Pos &p) const
+{
+	return m_cells.get(p);
+}
+
+/**
+ * Get a view of cells from a given range;
+ * like for_each_in nothing is copied.
+ */
+Store::Query
+Sheet::query(const Cell::Range &r) const
+{
+	return m_cells.query(r);
 }
 
 /**
- * Get cells from a given range
+ * Sum up numbers within a range
  */
-std::vector<Cell>
-Sheet::get_cells(const Cell::Range &r) const
+Store::Summary
+Sheet::summarize(const Cell::Range &r) const
 {
-	std::vector<Cell> cells;
-	if (r.end < r.begin)
-		return cells; /*should probably rise exception */
-	/* get lower and upper bound map iterators */
-	auto itl = m_cells.lower_bound(r.begin);
-	auto itu = m_cells.upper_bound(r.end);
-	for (; itl != itu; ++itl)
-		cells.push_back(itl->second);
-	return cells;
+	return m_cells.summarize(r);
+}
+
+/**
+ * Smallest range holding all the cells
+ */
+Cell::Range
+Sheet::bounds(void) const
+{
+	return m_cells.bounds();
+}
+
+/**
+ * Number of changes made to cells; see Store::version
+ */
+uint64_t
+Sheet::version(void) const
+{
+	return m_cells.version();
+}
+
+/**
+ * Find the next cell after a given one, going row by row and
+ * wrapping around, that holds a number equal to what's looked
+ * for or a string beginning with it. Columns searched are
+ * indexed, so searching again is quick.
+ */
+bool
+Sheet::find(std::string_view what, const Cell::Pos &from, Cell::Pos &found)
+{
+	if (what.empty())
+		return false;
+	Value key = parse(what);
+	if (key.get_type() == Value::FORMULA)
+		key = m_cells.intern(what);
+	Store::Match m = key.is_num() ? Store::EXACT : Store::PREFIX;
+	Cell::Range b = m_cells.bounds();
+	for (int wrap = 0; wrap < 2; ++wrap) {
+		bool hit = false;
+		Cell::Range col = b;
+		for (; col.begin.col <= b.end.col; ++col.begin.col) {
+			col.end.col = col.begin.col;
+			if (!wrap)
+				col.begin.row = std::max(b.begin.row, col.begin.col > from.col ? from.row : from.row + 1);
+			col.end.row = hit ? found.row : b.end.row; /* nothing below what's found counts */
+			unsigned row;
+			if (m_cells.find(col, key, m, row) && (!hit || row < found.row)) {
+				found.row = row;
+				found.col = col.begin.col;
+				hit = true;
+			}
+		}
+		if (hit)
+			return true;
+	}
+	return false;
 }
 
 /**
@@ -91,7 +919,7 @@ Sheet::get_cells(const Cell::Range &r) const
 unsigned
 Sheet::get_col_siz(unsigned idx) const
 {
-	return m_col_siz.count(idx) > 0 ? m_col_siz.at(idx) : DEFAULT_WIDTH;
+	return m_col_siz.get(idx);
 }
 
 /**
@@ -100,7 +928,7 @@ Sheet::get_col_siz(unsigned idx) const
 unsigned
 Sheet::get_row_siz(unsigned idx) const
 {
-	return m_row_siz.count(idx) > 0 ? m_row_siz.at(idx) : DEFAULT_HEIGHT;
+	return m_row_siz.get(idx);
 }
 
 /**
@@ -109,7 +937,12 @@ Sheet::get_row_siz(unsigned idx) const
 void
 Sheet::set_col_siz(unsigned idx, unsigned siz)
 {
-	m_col_siz[idx] = siz;
+	if (m_journal)
+		m_journal->resize(Journal::COL_SIZ, idx, siz);
+	if (m_history.get_max())
+		m_history.add(keep(History::COL_SIZ, idx));
+	m_col_siz.set(idx, siz);
+	checkpoint();
 }
 
 /**
@@ -118,7 +951,12 @@ Sheet::set_col_siz(unsigned idx, unsigned siz)
 void
 Sheet::set_row_siz(unsigned idx, unsigned siz)
 {
-	m_row_siz[idx] = siz;
+	if (m_journal)
+		m_journal->resize(Journal::ROW_SIZ, idx, siz);
+	if (m_history.get_max())
+		m_history.add(keep(History::ROW_SIZ, idx));
+	m_row_siz.set(idx, siz);
+	checkpoint();
 }
 
 /**
@@ -127,20 +965,19 @@ Sheet::set_row_siz(unsigned idx, unsigned siz)
 void
 Sheet::increase_col_siz(unsigned idx)
 {
-	if (m_col_siz.count(idx) < 1)
-		m_col_siz[idx] = DEFAULT_WIDTH;
-	++m_col_siz[idx];
+	set_col_siz(idx, m_col_siz.get(idx) + 1);
 }
 
 /**
- * Decrease width of a column by 1
+ * Decrease width of a column by 1;
+ * a column is never narrower than one character.
  */
 void
 Sheet::decrease_col_siz(unsigned idx)
 {
-	if (m_col_siz.count(idx) < 1)
-		m_col_siz[idx] = DEFAULT_WIDTH;
-	--m_col_siz[idx];
+	unsigned siz = m_col_siz.get(idx);
+	if (siz > 1)
+		set_col_siz(idx, siz - 1);
 }
 
 /**
@@ -149,68 +986,940 @@ Sheet::decrease_col_siz(unsigned idx)
 std::pair<unsigned, unsigned>
 Sheet::get_abs_pos(const Cell::Pos &p) const
 {
-	unsigned c, r, i;
-	c = r = 0;
-	for (i = 1; i < p.col; ++i)
-		c += get_col_siz(i);
-	for (i = 1; i < p.row; ++i)
-		r += get_row_siz(i);
-	return std::make_pair(c, r);
+	PROF_COUNT(ABS_POS, 1);
+	return std::make_pair(m_col_siz.offset(p.col), m_row_siz.offset(p.row));
+}
+
+/**
+ * Translate terminal coordinates into address
+ * of the cell found there
+ */
+Cell::Pos
+Sheet::get_pos_at(unsigned x, unsigned y) const
+{
+	Cell::Pos p;
+	p.col = m_col_siz.at(x);
+	p.row = m_row_siz.at(y);
+	return p;
+}
+
+/*
+ * Read-only memory mapping of a whole file
+ */
+class Mapping
+{
+	public:
+	Mapping(const std::string &);
+	~Mapping(void);
+	std::string_view data(void) const;
+	void advise(int) const;
+
+	private:
+	void *m_addr;
+	size_t m_len;
+};
+
+Mapping::Mapping(const std::string &filename) : m_addr(nullptr), m_len(0)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw std::runtime_error(filename + ": " + strerror(errno));
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		throw std::runtime_error(filename + ": not a regular file");
+	}
+	m_len = st.st_size;
+	if (m_len)
+		m_addr = mmap(nullptr, m_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m_addr == MAP_FAILED)
+		throw std::runtime_error(filename + ": " + strerror(errno));
+}
+
+Mapping::~Mapping(void)
+{
+	if (m_addr)
+		munmap(m_addr, m_len);
+}
+
+std::string_view
+Mapping::data(void) const
+{
+	return std::string_view((const char *)m_addr, m_len);
 }
 
 /**
- * Open a sheet file
+ * Tell the kernel how the mapping is going to be read
+ */
+void
+Mapping::advise(int advice) const
+{
+	if (m_addr)
+		madvise(m_addr, m_len, advice);
+}
+
+/*
+ * Head of a binary sheet file; offsets of sections
+ * are given from the beginning of the file.
+ */
+struct Header {
+	char magic[8];
+	uint32_t order; /* BYTE_ORDER_MARK as written by the host */
+	uint32_t stale; /* saved amid recalculation */
+	uint64_t sizes; /* column sizes, row sizes */
+	uint64_t formulas; /* formulas, cells holding them */
+	uint64_t index; /* tile index; tiles are in front of it */
+	uint64_t strings; /* string table, up to the end */
+	uint64_t end;
+};
+
+template <typename T> static void
+put(std::ostream &os, T v)
+{
+	os.write((const char *)&v, sizeof(v));
+}
+
+/**
+ * Cut a number off a section of a binary file
+ */
+template <typename T> static T
+take(std::string_view &s)
+{
+	T v;
+	if (s.size() < sizeof(v))
+		throw std::runtime_error("truncated file");
+	std::memcpy(&v, s.data(), sizeof(v));
+	s.remove_prefix(sizeof(v));
+	return v;
+}
+
+/**
+ * Cut the first line off a text
+ */
+static std::string_view
+next_line(std::string_view &s)
+{
+	size_t n = s.find('\n');
+	std::string_view ln = s.substr(0, n);
+	s.remove_prefix(n == std::string_view::npos ? s.size() : n + 1);
+	return ln;
+}
+
+/**
+ * Read list of sizes like `1:12;4:3;'
+ */
+static void
+load_sizes(std::string_view ln, Axis &axis)
+{
+	for (size_t end; (end = ln.find(';')) != std::string_view::npos; ln.remove_prefix(end + 1)) {
+		const char *b = ln.data(), *e = b + end;
+		unsigned idx, siz;
+		auto r = std::from_chars(b, e, idx);
+		if (r.ec != std::errc() || r.ptr == e || *r.ptr != ':')
+			throw std::runtime_error("invalid size " + std::string(b, e));
+		r = std::from_chars(r.ptr + 1, e, siz);
+		if (r.ec != std::errc() || r.ptr != e)
+			throw std::runtime_error("invalid size " + std::string(b, e));
+		axis.set(idx, siz);
+	}
+}
+
+/**
+ * Check if a sheet should be saved in binary format:
+ * either the name says so or it is replacing a binary file
+ */
+static bool
+is_binary(const std::string &filename)
+{
+	size_t n = sizeof(BINARY_EXT) - 1;
+	if (filename.size() > n && !filename.compare(filename.size() - n, n, BINARY_EXT))
+		return true;
+	char magic[8] = {};
+	std::ifstream fs(filename, std::ifstream::binary);
+	return fs.read(magic, sizeof(magic)) && !std::memcmp(magic, BINARY_MAGIC, sizeof(magic));
+}
+
+/**
+ * Drop cells, formulas and sizes of columns and rows,
+ * for the sheet to be read anew
+ */
+void
+Sheet::reset(void)
+{
+	m_cells.clear();
+	m_formulas.clear();
+	m_deps.clear();
+	m_col_siz = Axis(DEFAULT_WIDTH);
+	m_row_siz = Axis(DEFAULT_HEIGHT);
+}
+
+/**
+ * Open a sheet file of either format, replacing the sheet
+ * The file is mapped into memory and read in place.
+ * A journal kept is started over, edits not saved being
+ * thrown away along with the sheet they were made to.
  */
 void
 Sheet::load(const std::string &filename)
 {
-	std::fstream fs(filename, std::fstream::in);
-	std::string ln, tk; /* line, token */
-	size_t pos, pos2; /* delimiter position */
-	std::getline(fs, ln);
-	if (ln != "CELLSF") /* magic sequence; basic sanity check */
+	auto map = std::make_shared<const Mapping>(filename);
+	std::string_view data = map->data();
+	if (data.substr(0, sizeof(Header::magic)) == std::string_view(BINARY_MAGIC, sizeof(Header::magic))) {
+		map->advise(MADV_RANDOM);
+		stop();
+		reset();
+		load_binary(data, map);
+	} else if (next_line(data) == TEXT_MAGIC) { /* basic sanity check */
+		map->advise(MADV_SEQUENTIAL);
+		stop();
+		reset();
+		load_text(data);
+	} else
 		throw std::runtime_error("invalid file type");
-	/* read column sizes */
-	std::getline(fs, ln);
-	for (pos = 0; (pos = ln.find(";")) != std::string::npos && !ln.empty(); ln.erase(0, pos + 1)) {
-		tk = ln.substr(0, pos);
-		pos2 = tk.find(":");
-		m_col_siz[(unsigned)std::stoi(tk.substr(0, pos2))] = (unsigned)std::stoi(tk.substr(pos2 + 1));
-	}
-	/* read row sizes */
-	std::getline(fs, ln);
-	for (pos = 0; (pos = ln.find(";")) != std::string::npos && !ln.empty(); ln.erase(0, pos + 1)) {
-		tk = ln.substr(0, pos);
-		pos2 = tk.find(":");
-		m_row_siz[(unsigned)std::stoi(tk.substr(0, pos2))] = (unsigned)std::stoi(tk.substr(pos2 + 1));
+	m_history.clear();
+	if (m_journal) {
+		if (m_saver.joinable())
+			m_saver.join(); /* may be checkpointing it */
+		m_journal = std::make_unique<Journal>(filename);
+		m_journal->start();
+	}
+}
+
+/**
+ * Open a sheet file the way the last session left it: edits
+ * journaled and not saved are replayed over a checkpoint
+ * heading the journal, or over the file if the journal was
+ * kept over it as it is. A journal kept over another version
+ * of the file is left aside with `~' appended to its name.
+ * Edits are journaled from now on.
+ * Returns number of edits replayed.
+ */
+size_t
+Sheet::recover(const std::string &filename)
+{
+	if (m_saver.joinable())
+		m_saver.join();
+	m_journal.reset();
+	m_history.clear();
+	auto journal = std::make_unique<Journal>(filename);
+	const std::string &path = journal->get_path();
+	std::shared_ptr<const Mapping> map;
+	std::string_view data;
+	struct stat st;
+	if (stat(path.c_str(), &st) == 0) {
+		map = std::make_shared<const Mapping>(path);
+		data = map->data();
 	}
+	size_t begin = Journal::head(data, filename);
+	Header h;
+	bool standalone = data.size() >= sizeof(h) && !std::memcmp(data.data(), BINARY_MAGIC, sizeof(h.magic));
+	if (standalone) {
+		std::memcpy(&h, data.data(), sizeof(h));
+		standalone = h.end >= sizeof(h) && h.end <= data.size();
+	}
+	if (standalone) {
+		stop();
+		reset();
+		load_binary(data.substr(0, h.end), map);
+		begin = h.end;
+	} else {
+		if (!data.empty() && !begin && std::rename(path.c_str(), (path + "~").c_str()) == -1)
+			throw std::runtime_error(path + ": " + strerror(errno));
+		if (stat(filename.c_str(), &st) == 0)
+			load(filename);
+		else {
+			stop();
+			reset();
+		}
+	}
+	if (!begin) {
+		journal->start();
+		m_journal = std::move(journal);
+		return 0;
+	}
+	size_t n = 0;
+	size_t max = m_history.get_max();
+	m_history.set_max(SIZE_MAX); /* undone edits must be found where they were */
+	size_t used = Journal::replay(data.substr(begin), [this, &n](const Journal::Edit &e) {
+		try {
+			apply(e);
+			++n;
+		} catch (const std::exception &) {
+			/* failed as it was made too, changing nothing, or its file is gone */
+		}
+	});
+	m_history.set_max(max);
+	journal->resume(begin + used, used, standalone);
+	m_journal = std::move(journal);
+	return n;
+}
+
+/**
+ * Apply an edit replayed from the journal
+ */
+void
+Sheet::apply(const Journal::Edit &e)
+{
+	switch (e.op) {
+	case Journal::INSERT:
+		insert(e.range, e.value.get_type() == Value::STRING ? m_cells.intern(e.value.get_str()) : e.value);
+		break;
+	case Journal::REMOVE:
+		remove(e.range);
+		break;
+	case Journal::SORT:
+		sort(e.range, e.n, e.desc);
+		break;
+	case Journal::COL_SIZ:
+		set_col_siz(e.range.begin.col, e.n);
+		break;
+	case Journal::ROW_SIZ:
+		set_row_siz(e.range.begin.row, e.n);
+		break;
+	case Journal::IMPORT:
+		import_csv(e.value.eval());
+		break;
+	case Journal::UNDO:
+	case Journal::REDO:
+		if (e.of != e.op)
+			revert(e);
+		else
+			step(e.op == Journal::REDO);
+		break;
+	}
+}
+
+/**
+ * Read a text sheet past its magic line;
+ * cells are saved in order of the store,
+ * so they are inserted in bulk. Ranges
+ * saved as runs are filled afterwards.
+ */
+void
+Sheet::load_text(std::string_view data)
+{
+	PROF_SCOPE(LOAD);
+	load_sizes(next_line(data), m_col_siz);
+	load_sizes(next_line(data), m_row_siz);
 	/* read cell contents */
-	while (std::getline(fs, ln)) {
-		pos = ln.find(";");
-		tk = ln.substr(0, pos);
-		Cell::Pos p(tk);
-		tk = ln.substr(pos + 1);
-		m_cells[p] = Cell(p, parse(tk));
+	std::vector<std::pair<Cell::Range, Value>> runs;
+	Store::Bulk bulk(m_cells);
+	while (!data.empty()) {
+		std::string_view ln = next_line(data);
+		if (ln.empty())
+			continue;
+		size_t sep = ln.find(';');
+		std::string_view addr = ln.substr(0, sep);
+		size_t colon = addr.find(':');
+		Cell::Range r;
+		if (sep == std::string_view::npos || !Cell::Pos::parse(addr.substr(0, colon), r.begin) ||
+		    (colon != std::string_view::npos && !Cell::Pos::parse(addr.substr(colon + 1), r.end)))
+			throw Cell::Pos::address_error(std::string(addr));
+		std::string_view tk = ln.substr(sep + 1);
+		if (colon != std::string_view::npos)
+			runs.emplace_back(r, parse(tk));
+		else if (!tk.empty() && tk[0] == '=')
+			set_formula(r.begin, std::make_shared<const Formula>(std::string(tk), r.begin));
+		else
+			bulk.set(r.begin, parse(tk));
 	}
+	for (auto &run : runs)
+		m_cells.fill(run.first, run.second);
+	recalc();
 }
 
-/* Save the sheet into a file */
+/**
+ * Read a binary sheet
+ * Only sizes and formulas are read right away; cells
+ * are left to the store to decode when needed, `file'
+ * being kept alive for as long as they're not.
+ */
+void
+Sheet::load_binary(std::string_view data, std::shared_ptr<const void> file)
+{
+	PROF_SCOPE(LOAD);
+	Header h;
+	if (data.size() < sizeof(h))
+		throw std::runtime_error("truncated file");
+	std::memcpy(&h, data.data(), sizeof(h));
+	if (h.order != BYTE_ORDER_MARK)
+		throw std::runtime_error("file of different byte order");
+	if (h.end != data.size())
+		throw std::runtime_error("truncated file");
+	if (h.sizes < sizeof(h) || h.formulas < h.sizes || h.index < h.formulas ||
+	    h.strings < h.index || h.end < h.strings)
+		throw std::runtime_error("invalid file layout");
+	Store::Strings strings(data.substr(h.strings));
+	/* sizes */
+	std::string_view sec = data.substr(h.sizes, h.formulas - h.sizes);
+	Axis *axes[] = { &m_col_siz, &m_row_siz };
+	uint32_t n[2] = { take<uint32_t>(sec), take<uint32_t>(sec) };
+	for (int a = 0; a < 2; ++a)
+		for (uint32_t i = 0; i < n[a]; ++i) {
+			uint32_t idx = take<uint32_t>(sec);
+			axes[a]->set(idx, take<uint32_t>(sec));
+		}
+	/* formulas, compiled once and shared as they were */
+	sec = data.substr(h.formulas, h.index - h.formulas);
+	uint64_t nforms = take<uint64_t>(sec);
+	if (nforms > sec.size() / 16)
+		throw std::runtime_error("truncated file");
+	std::vector<std::shared_ptr<const Formula>> forms;
+	forms.reserve(nforms);
+	for (uint64_t i = 0; i < nforms; ++i) {
+		uint64_t src = take<uint64_t>(sec);
+		Cell::Pos origin;
+		origin.row = take<uint32_t>(sec);
+		origin.col = take<uint32_t>(sec);
+		forms.push_back(std::make_shared<const Formula>(std::string(strings.get(src)), origin));
+	}
+	for (uint64_t i = 0, e = take<uint64_t>(sec); i < e; ++i) {
+		Cell::Pos p;
+		p.row = take<uint32_t>(sec);
+		p.col = take<uint32_t>(sec);
+		uint64_t f = take<uint64_t>(sec);
+		if (f >= forms.size())
+			throw std::runtime_error("invalid formula index");
+		bind(p, forms[f]);
+	}
+	m_cells.attach(data.substr(0, h.strings), h.index, strings, std::move(file));
+	if (h.stale)
+		recalc();
+	else
+		m_stats.cells = m_stats.cycles = 0;
+}
+
+/*
+ * Cells of a piece of a CSV file,
+ * rows counted from its beginning
+ */
+struct Piece {
+	std::vector<std::pair<Cell::Pos, Value>> cells;
+	unsigned rows;
+};
+
+/**
+ * Tell the field delimiter of a CSV file: a tab
+ * if it's named as TSV, otherwise a comma
+ */
+static char
+delimiter(const std::string &filename)
+{
+	size_t n = sizeof(TSV_EXT) - 1;
+	if (filename.size() > n && !filename.compare(filename.size() - n, n, TSV_EXT))
+		return '\t';
+	return ',';
+}
+
+/**
+ * Find where the first record beginning after `at' does
+ * in a CSV file, `quoted' telling if `at' is within quotes
+ */
+static size_t
+next_record(std::string_view s, size_t at, bool quoted)
+{
+	for (; at < s.size(); ++at)
+		if (s[at] == '"')
+			quoted = !quoted;
+		else if (s[at] == '\n' && !quoted)
+			return at + 1;
+	return s.size();
+}
+
+/**
+ * Parse whole records of a CSV file into cells; a quote
+ * starts or ends quoting wherever it is, two of them in
+ * quotes stand for one, so quoting of any spot is told by
+ * the number of quotes ahead of it. Empty fields are left
+ * out and fields typed like by parse, strings interned
+ * into `cells'.
+ */
+static void
+read_csv(std::string_view s, char delim, Store &cells, Piece &piece)
+{
+	std::string buf;
+	Cell::Pos p;
+	p.row = 1;
+	p.col = 0;
+	for (size_t i = 0; i < s.size();) {
+		size_t b = i;
+		while (i < s.size() && s[i] != delim && s[i] != '\n' && s[i] != '"')
+			++i;
+		std::string_view field = s.substr(b, i - b);
+		if (i < s.size() && s[i] == '"') {
+			buf.assign(field);
+			for (bool quoted = false; i < s.size() && (quoted || (s[i] != delim && s[i] != '\n')); ++i)
+				if (s[i] == '"' && quoted && i + 1 < s.size() && s[i + 1] == '"')
+					buf += s[i++];
+				else if (s[i] == '"')
+					quoted = !quoted;
+				else if (quoted || s[i] != '\r' || (i + 1 < s.size() && s[i + 1] != '\n'))
+					buf += s[i]; /* not a line break of CRLF */
+			field = buf;
+		} else if (!field.empty() && field.back() == '\r' && (i == s.size() || s[i] == '\n'))
+			field.remove_suffix(1);
+		bool last = i == s.size() || s[i] == '\n';
+		++p.col;
+		if (!field.empty()) {
+			Value v;
+			if (field[0] == '=')
+				v = Value::formula(std::string(field));
+			else if (!number(field, v))
+				v = cells.intern(field);
+			piece.cells.emplace_back(p, std::move(v));
+		}
+		if (i < s.size() && last) {
+			++p.row;
+			p.col = 0;
+		}
+		++i;
+	}
+	piece.rows = p.row - (s.empty() || s.back() == '\n');
+}
+
+/**
+ * Replace cells of the sheet with a CSV file, or a TSV one
+ * if it's named so; sizes of columns and rows are kept.
+ * The file is mapped and cut into pieces at records, which
+ * are found by the number of quotes ahead of every piece.
+ * Pieces are parsed side by side, a few per thread at a
+ * time, and their cells merged in order. A formula that
+ * doesn't compile is taken as a string.
+ * Returns number of records read.
+ */
+size_t
+Sheet::import_csv(const std::string &filename)
+{
+	PROF_SCOPE(LOAD);
+	Mapping map(filename);
+	map.advise(MADV_SEQUENTIAL);
+	std::string_view data = map.data();
+	if (data.substr(0, 3) == "\xef\xbb\xbf")
+		data.remove_prefix(3); /* byte order mark */
+	char delim = delimiter(filename);
+	size_t n = (data.size() + CSV_PIECE - 1) / CSV_PIECE;
+	std::vector<unsigned char> quoted(n);
+	stop(); /* the pool isn't to be shared with recalculation */
+	m_pool.run(n, [&data, &quoted](size_t i) {
+		std::string_view s = data.substr(i * CSV_PIECE, CSV_PIECE);
+		quoted[i] = std::count(s.begin(), s.end(), '"') & 1;
+	});
+	for (size_t i = 1; i < n; ++i)
+		quoted[i] ^= quoted[i - 1];
+	std::vector<size_t> at(n + 1, data.size());
+	m_pool.run(n, [&data, &quoted, &at](size_t i) {
+		at[i] = i ? next_record(data, i * CSV_PIECE, quoted[i - 1]) : 0;
+	});
+	for (size_t i = 1; i < n; ++i)
+		at[i] = std::max(at[i], at[i - 1]); /* a record may span pieces */
+	if (m_journal) {
+		char *path = realpath(filename.c_str(), nullptr);
+		m_journal->import(path ? path : filename);
+		std::free(path);
+	}
+	m_cells.clear();
+	m_formulas.clear();
+	m_deps.clear();
+	m_history.clear();
+	std::vector<Piece> pieces(2 * m_pool.size());
+	Store::Bulk bulk(m_cells);
+	unsigned row = 0;
+	for (size_t w = 0; w < n; w += pieces.size()) {
+		size_t k = std::min(pieces.size(), n - w);
+		m_pool.run(k, [this, &data, &at, &pieces, delim, w](size_t i) {
+			read_csv(data.substr(at[w + i], at[w + i + 1] - at[w + i]), delim, m_cells, pieces[i]);
+		});
+		for (size_t i = 0; i < k; ++i) {
+			for (auto &c : pieces[i].cells) {
+				c.first.row += row;
+				if (c.second.get_type() != Value::FORMULA) {
+					bulk.set(c.first, std::move(c.second));
+					continue;
+				}
+				try {
+					set_formula(c.first, std::make_shared<const Formula>(c.second.eval(), c.first));
+				} catch (const Formula::syntax_error &) {
+					bulk.set(c.first, m_cells.intern(c.second.get_str()));
+				}
+			}
+			row += pieces[i].rows;
+			pieces[i].cells.clear();
+		}
+	}
+	recalc();
+	checkpoint(true);
+	return row;
+}
+
+/**
+ * Add a field to a record of a CSV file, quoted
+ * if it holds the delimiter, quotes or line breaks
+ */
+static void
+put_field(std::string &ln, std::string_view s, char delim)
+{
+	const char special[] = { delim, '"', '\n', '\r' };
+	if (s.find_first_of(special, 0, sizeof(special)) == std::string_view::npos) {
+		ln += s;
+		return;
+	}
+	ln += '"';
+	for (auto &c : s) {
+		if (c == '"')
+			ln += '"';
+		ln += c;
+	}
+	ln += '"';
+}
+
+/**
+ * Write values of the sheet into a CSV file, or a TSV one
+ * if it's named so, from the first row and column on so that
+ * importing the file puts cells back where they were. Rows
+ * are made a band at a time right off the store, cells of
+ * a row coming in order of columns, and written out.
+ * Recalculation is waited for.
+ * Returns number of records written.
+ */
+size_t
+Sheet::export_csv(const std::string &filename)
+{
+	wait();
+	std::ofstream fs(filename, std::ofstream::binary);
+	if (!fs)
+		throw std::runtime_error(filename + ": " + strerror(errno));
+	char delim = delimiter(filename);
+	Cell::Range b = bounds();
+	std::string lines[CSV_BAND];
+	unsigned cols[CSV_BAND];
+	for (unsigned tr = 0; tr <= b.end.row / CSV_BAND; ++tr) {
+		unsigned top = tr * CSV_BAND;
+		Cell::Range band;
+		band.begin.row = std::max(top, 1u);
+		band.end.row = std::min(top + (CSV_BAND - 1), b.end.row);
+		band.begin.col = 1;
+		band.end.col = b.end.col;
+		std::fill(cols, cols + CSV_BAND, 1);
+		m_cells.for_each(band, [&lines, &cols, top, delim](const Cell::Pos &p, const Value &v) {
+			unsigned i = p.row - top;
+			lines[i].append(p.col - cols[i], delim);
+			cols[i] = p.col;
+			if (v.get_type() == Value::DOUBLE) {
+				char num[512]; /* shortest that reads back the same, unlike eval */
+				lines[i].append(num, std::to_chars(num, num + sizeof(num), v.get_num(),
+				                                   std::chars_format::fixed).ptr);
+			} else
+				put_field(lines[i], v.eval(), delim);
+		});
+		for (unsigned r = band.begin.row; r <= band.end.row; ++r) {
+			std::string &ln = lines[r - top];
+			ln.append(b.end.col - cols[r - top], delim);
+			ln += '\n';
+			fs << ln;
+			ln.clear();
+		}
+	}
+	fs.close();
+	if (!fs)
+		throw std::runtime_error(filename + ": " + strerror(errno));
+	return b.end.row;
+}
+
+/**
+ * Take a copy of the sheet to save
+ */
+Sheet::Image::Image(const Sheet &s)
+	: col_siz(s.m_col_siz), row_siz(s.m_row_siz), cells(s.m_cells), formulas(s.m_formulas),
+	  stale(s.m_busy || !s.m_left.empty()), total(cells.size()), done(0), finished(false),
+	  notify(s.m_notify)
+{}
+
+/**
+ * Note cells written, notifying as another percent is
+ */
+void
+Sheet::Image::advance(size_t n)
+{
+	size_t d = done.fetch_add(n, std::memory_order_relaxed) + n;
+	if (notify && d * 100 / total != (d - n) * 100 / total)
+		notify();
+}
+
+/**
+ * Copy the sheet as it is now; recalculation may
+ * go on, values it wrote so far get copied
+ */
+std::unique_ptr<Sheet::Image>
+Sheet::image(void) const
+{
+	std::lock_guard<std::mutex> l(m_lock);
+	return std::make_unique<Image>(*this);
+}
+
+/**
+ * Flush a file or directory to disk
+ */
+static bool
+flush(const char *path, int flags)
+{
+	int fd = open(path, flags);
+	if (fd == -1)
+		return false;
+	bool ok = fsync(fd) == 0;
+	int err = errno;
+	close(fd);
+	errno = err;
+	return ok;
+}
+
+/**
+ * Save the sheet into a file
+ */
 void
 Sheet::save(const std::string &filename) const
 {
-	std::fstream fs(filename, std::fstream::out);
-	fs << "CELLSF\n";
+	write(*image(), filename);
+}
+
+/**
+ * Save the sheet into a file in the background; it can be
+ * edited meanwhile, the file getting the sheet as it was when
+ * saving started. Without background recalculation to notify
+ * of, the sheet is saved right away.
+ * Progress is told by saving and the outcome by saved.
+ */
+void
+Sheet::save_background(const std::string &filename)
+{
+	if (m_save && !m_save->finished && !m_save->file.empty())
+		throw std::runtime_error("still saving");
+	spawn(filename, m_journal && !m_journal->standalone());
+}
+
+/**
+ * Take a checkpoint of the journal once enough edits
+ * were journaled since the last one, or `now', unless
+ * a save is running or is yet to be told about
+ */
+void
+Sheet::checkpoint(bool now)
+{
+	if (!m_journal || (m_journal->size() < JOURNAL_MAX && !now))
+		return;
+	if (m_save) {
+		if (!m_save->finished || !m_save->file.empty() || !m_save->err.empty())
+			return; /* tried again with the next edit */
+		if (m_saver.joinable())
+			m_saver.join();
+		m_save.reset();
+	}
+	spawn(std::string(), true);
+}
+
+/**
+ * Write a copy of the sheet as it is now into a file, in
+ * the background if possible, checkpointing the journal
+ * first if `checkpoint' is set. Any save still running
+ * is waited for.
+ * The checkpoint goes first so that a journal kept over
+ * the file never outlives the version of it it was kept
+ * over, not even if the program dies in between.
+ */
+void
+Sheet::spawn(const std::string &filename, bool checkpoint)
+{
+	if (m_saver.joinable())
+		m_saver.join();
+	m_save = image();
+	Image *img = m_save.get();
+	Journal *journal = checkpoint ? m_journal.get() : nullptr;
+	std::string base = journal ? journal->checkpoint() : std::string();
+	img->file = filename;
+	img->total *= !!journal + !filename.empty();
+	auto job = [img, journal, base] {
+		if (journal)
+			try {
+				std::ofstream fs(base, std::ofstream::binary);
+				if (fs)
+					save_binary(fs, *img);
+				fs.close();
+				if (!fs)
+					throw std::runtime_error(base + ": " + strerror(errno));
+				journal->commit();
+			} catch (const std::exception &e) {
+				journal->abort();
+				img->err = e.what();
+			}
+		if (!img->file.empty())
+			try {
+				write(*img, img->file);
+			} catch (const std::exception &e) {
+				img->err = e.what();
+			}
+		img->cells.clear(); /* let the sheet have its tiles back */
+		img->formulas.clear();
+		img->finished = true;
+		if (img->notify)
+			img->notify();
+	};
+	if (m_notify)
+		m_saver = std::thread(job);
+	else
+		job();
+}
+
+/**
+ * Percent of cells a background save has written,
+ * or -1 if there's none running
+ */
+int
+Sheet::saving(void) const
+{
+	if (!m_save || m_save->finished || m_save->file.empty())
+		return -1;
+	return m_save->total ? m_save->done * 100 / m_save->total : 0;
+}
+
+/**
+ * Collect a finished background save, setting `err' to
+ * why it failed or clearing it. Returns false if there's
+ * none, it's still running or it was a checkpoint that
+ * went fine.
+ */
+bool
+Sheet::saved(std::string &err)
+{
+	if (!m_save || !m_save->finished)
+		return false;
+	if (m_saver.joinable())
+		m_saver.join();
+	bool told = !m_save->file.empty() || !m_save->err.empty();
+	err = std::move(m_save->err);
+	m_save.reset();
+	return told;
+}
+
+/**
+ * Tell why journaling edits failed, if it did; it's
+ * told once and tried again with the next checkpoint
+ */
+std::string
+Sheet::journal_error(void)
+{
+	return m_journal ? m_journal->get_error() : std::string();
+}
+
+/**
+ * Write a copy of the sheet into a file
+ * The copy is written to a temporary file first, which is
+ * flushed to disk and only then renamed over the file, so the
+ * file is never left half-written, not even by a crash; a file
+ * the sheet is still being read from stays intact, too.
+ */
+void
+Sheet::write(Image &img, const std::string &filename)
+{
+	bool binary = is_binary(filename);
+	std::string tmp = filename + ".tmp";
+	std::ofstream fs(tmp, binary ? std::ofstream::binary : std::ofstream::out);
+	if (!fs)
+		throw std::runtime_error(tmp + ": " + strerror(errno));
+	if (binary)
+		save_binary(fs, img);
+	else
+		save_text(fs, img);
+	fs.close();
+	if (!fs || !flush(tmp.c_str(), O_WRONLY) || std::rename(tmp.c_str(), filename.c_str()) == -1) {
+		std::string err = strerror(errno);
+		unlink(tmp.c_str());
+		throw std::runtime_error(filename + ": " + err);
+	}
+	size_t slash = filename.rfind('/');
+	flush(slash == std::string::npos ? "." : filename.substr(0, slash + 1).c_str(),
+	      O_RDONLY | O_DIRECTORY); /* so is the rename */
+}
+
+/**
+ * Write a copy of the sheet as text
+ */
+void
+Sheet::save_text(std::ostream &fs, Image &img)
+{
+	fs << TEXT_MAGIC "\n";
 	/* write column sizes */
-	for (auto &c : m_col_siz)
-		fs << c.first << ":" << c.second << ";";
+	for (auto &c : img.col_siz)
+		fs << c.idx << ":" << c.siz << ";";
 	fs << '\n';
 	/* write row sizes */
-	for (auto &c : m_row_siz)
-		fs << c.first << ":" << c.second << ";";
+	for (auto &c : img.row_siz)
+		fs << c.idx << ":" << c.siz << ";";
 	fs << '\n';
-	/* write cell contents */
-	for (auto &c : m_cells) {
-		auto v = c.second.get_value();
-		fs << c.first.get_addr() << ";" << v->eval() << '\n';
+	/* write cell contents, runs as ranges with their first values */
+	img.cells.for_each([&img, &fs](const Cell::Pos &p, const Value &v) {
+		auto f = img.formulas.find(p);
+		fs << p.get_addr() << ";" << (f == img.formulas.end() ? v.eval() : f->second->get_src(p)) << '\n';
+		img.advance(1);
+	}, &Store::Column::present, false);
+	for (auto &run : img.cells.runs()) {
+		const Cell::Range &r = run.first;
+		fs << r.get_addr() << ";" << run.second.eval() << '\n';
+		img.advance((size_t)(r.end.row - r.begin.row + 1) * (r.end.col - r.begin.col + 1));
+	}
+}
+
+/**
+ * Write a copy of the sheet in binary format
+ * Each formula shared by cells of a range is saved once.
+ */
+void
+Sheet::save_binary(std::ostream &fs, Image &img)
+{
+	Header h = {};
+	std::memcpy(h.magic, BINARY_MAGIC, sizeof(h.magic));
+	h.order = BYTE_ORDER_MARK;
+	h.stale = img.stale;
+	fs.write((const char *)&h, sizeof(h));
+	/* sizes */
+	h.sizes = fs.tellp();
+	const Axis *axes[] = { &img.col_siz, &img.row_siz };
+	for (auto a : axes)
+		put(fs, (uint32_t)std::distance(a->begin(), a->end()));
+	for (auto a : axes)
+		for (auto &c : *a) {
+			put(fs, (uint32_t)c.idx);
+			put(fs, (uint32_t)c.siz);
+		}
+	/* formulas */
+	h.formulas = fs.tellp();
+	Store::Strings strings;
+	std::unordered_map<const Formula *, uint64_t> ids;
+	std::vector<const Formula *> forms;
+	std::vector<std::pair<Cell::Pos, uint64_t>> cells;
+	img.cells.for_each([&](const Cell::Pos &p, const Value &) {
+		const Formula *f = img.formulas.at(p).get();
+		auto it = ids.try_emplace(f, forms.size());
+		if (it.second)
+			forms.push_back(f);
+		cells.emplace_back(p, it.first->second);
+	}, &Store::Column::formula);
+	put(fs, (uint64_t)forms.size());
+	for (auto f : forms) {
+		put(fs, strings.add(f->get_src(f->get_origin())));
+		put(fs, (uint32_t)f->get_origin().row);
+		put(fs, (uint32_t)f->get_origin().col);
+	}
+	put(fs, (uint64_t)cells.size());
+	for (auto &c : cells) {
+		put(fs, (uint32_t)c.first.row);
+		put(fs, (uint32_t)c.first.col);
+		put(fs, c.second);
 	}
+	/* cells */
+	h.index = img.cells.encode(fs, strings, [&img](size_t n) { img.advance(n); });
+	h.strings = fs.tellp();
+	strings.encode(fs);
+	h.end = fs.tellp();
+	fs.seekp(0);
+	fs.write((const char *)&h, sizeof(h));
 }
@@ -0,0 +1,1751 @@
+/*
+ * TUI spreadsheet
+ * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <Prof.h>
+#include <Value.h>
+#include <Cell.h>
+#include <Store.h>
+#include <Kernel.h>
+
+Store::Column::Column(void) : present(0), numeric(0), formula(0), num()
+{}
+
+Store::Tile::Tile(void) : count(0), src(nullptr), len(0)
+{}
+
+/**
+ * Copy a tile, columns and all; encoded
+ * contents are copied as they are
+ */
+Store::Tile::Tile(const Tile &t)
+	: runs(t.runs), count(t.count), src(t.src.load(std::memory_order_relaxed)), len(t.len)
+{
+	for (unsigned c = 0; t.col && c < TILE_SIZ; ++c)
+		if (t.col[c])
+			make(c) = *t.col[c];
+}
+
+/**
+ * Get column of a tile or null if it holds no values
+ */
+Store::Column *
+Store::Tile::get(unsigned c) const
+{
+	return col ? col[c].get() : nullptr;
+}
+
+/**
+ * Get column of a tile, allocating it if needed
+ */
+Store::Column &
+Store::Tile::make(unsigned c)
+{
+	if (!col)
+		col = std::make_unique<std::unique_ptr<Column>[]>(TILE_SIZ);
+	if (!col[c])
+		col[c] = std::make_unique<Column>();
+	return *col[c];
+}
+
+/**
+ * Get bitmap of rows of a column held by runs, numeric
+ * ones only if `nums' is set, noting in `which' the index
+ * of the run holding each of them
+ */
+uint64_t
+Store::Tile::run_rows(unsigned c, bool nums, unsigned char *which) const
+{
+	uint64_t rows = 0;
+	for (unsigned i = 0; i < runs.size(); ++i) {
+		const Run &u = runs[i];
+		if (c < u.c0 || c > u.c1 || (nums && !u.base.is_num()))
+			continue;
+		rows |= row_mask(u.r0, u.r1);
+		std::memset(which + u.r0, i, u.r1 - u.r0 + 1);
+	}
+	return rows;
+}
+
+/**
+ * Check if a run covers a cell of its tile
+ */
+bool
+Store::Run::has(unsigned r, unsigned c) const
+{
+	return r >= r0 && r <= r1 && c >= c0 && c <= c1;
+}
+
+/**
+ * Value of a cell of a run
+ */
+Value
+Store::Run::at(unsigned r, unsigned c) const
+{
+	return base + (r - r0 + c - c0);
+}
+
+#define PURGE_MIN 1024 /* least strings dropped before purging the pool */
+#define RUN_MIN 16 /* least cells of a tile filled at once to be kept as a run */
+#define RUNS_MAX 16 /* most runs of a tile before they're turned into cells */
+#define INDEX_MIN 64 /* least rows searched worth indexing a column for */
+#define INDEX_DROP 4096 /* most rows of an indexed column written at once to keep its index */
+#define KEEP_CELLS 1024 /* most cells of a range kept one by one rather than by tiles */
+
+Store::Store(void)
+	: m_count(0), m_version(0), m_dropped(0), m_purge_at(PURGE_MIN), m_decode(std::make_shared<std::mutex>())
+{}
+
+/**
+ * Take a snapshot of a store; it costs a copy of the
+ * map of tiles, the tiles themselves being shared.
+ * Strings of cells the snapshot decodes go to a pool
+ * of its own and columns are indexed anew.
+ */
+Store::Store(const Store &s)
+	: m_tiles(s.m_tiles), m_count(s.m_count), m_version(s.m_version), m_dropped(0),
+	  m_purge_at(PURGE_MIN), m_strings(s.m_strings), m_file(s.m_file), m_decode(s.m_decode)
+{}
+
+/**
+ * Get a tile about to be written, allocating it if there's
+ * none yet or copying it if a snapshot still shares it.
+ * Tiles are copied under the lock they're decoded with,
+ * as a snapshot may be decoding the same tile.
+ */
+Store::Tile &
+Store::own(std::shared_ptr<Tile> &t)
+{
+	if (!t)
+		t = std::make_shared<Tile>();
+	else if (t.use_count() > 1) {
+		std::lock_guard<std::mutex> l(*m_decode);
+		t = std::make_shared<Tile>(*t);
+	}
+	return *t;
+}
+
+/**
+ * Put value into a cell, allocating its tile
+ * and column on first use
+ */
+void
+Store::set(const Cell::Pos &p, const Value &v, bool formula)
+{
+	put(own(m_tiles[key(p.row >> TILE_BITS, p.col >> TILE_BITS)]), p, v, formula);
+}
+
+/**
+ * Put value into a cell of a given tile
+ */
+void
+Store::put(Tile &t, const Cell::Pos &p, Value v, bool formula)
+{
+	fetch(t);
+	++m_version;
+	if (Index *ix = indexed(p.col)) {
+		if (const Value *old = get(p))
+			ix->remove(*old, p.row);
+		ix->add(v, p.row);
+	}
+	unsigned r = p.row & TILE_MASK, c = p.col & TILE_MASK;
+	Column &col = t.make(c);
+	uint64_t bit = (uint64_t)1 << r;
+	if (!(col.present & bit)) {
+		if (!t.runs.empty())
+			cut(t, r, r, c, c);
+		col.present |= bit;
+		++t.count;
+		++m_count;
+	} else
+		drop(col.val[r].get_type() == Value::STRING);
+	col.num[r] = v.get_num();
+	if (v.is_num())
+		col.numeric |= bit;
+	else
+		col.numeric &= ~bit;
+	if (formula)
+		col.formula |= bit;
+	else
+		col.formula &= ~bit;
+	col.val[r] = std::move(v);
+}
+
+Store::Bulk::Bulk(Store &s) : m_store(s), m_tile(nullptr), m_key(0)
+{}
+
+/**
+ * Put value into a cell; see Store::set
+ */
+void
+Store::Bulk::set(const Cell::Pos &p, Value v, bool formula)
+{
+	uint64_t k = key(p.row >> TILE_BITS, p.col >> TILE_BITS);
+	if (!m_tile || k != m_key) {
+		auto &tiles = m_store.m_tiles;
+		m_tile = &m_store.own(tiles.try_emplace(tiles.end(), k)->second); /* hint is right for ordered cells */
+		m_key = k;
+	}
+	m_store.put(*m_tile, p, std::move(v), formula);
+}
+
+/**
+ * Put value into every cell of a range, as Sheet::insert
+ * does: numbers grow by distance of the cell from the
+ * beginning of the range. Parts of the range big enough
+ * are kept as runs, other rows are written a tile column
+ * at a time. Tiles entirely covered don't have to be decoded,
+ * nor copied if they're shared.
+ */
+void
+Store::fill(const Cell::Range &r, const Value &v, bool formula)
+{
+	if (r.end.row < r.begin.row || r.end.col < r.begin.col)
+		return;
+	++m_version;
+	unindex(r);
+	for (auto &it : m_index)
+		if (it.first >= r.begin.col && it.first <= r.end.col)
+			for (unsigned row = r.begin.row; row <= r.end.row; ++row)
+				it.second->add(v + (row - r.begin.row + it.first - r.begin.col), row);
+	unsigned tr0 = r.begin.row >> TILE_BITS, tr1 = r.end.row >> TILE_BITS;
+	unsigned tc0 = r.begin.col >> TILE_BITS, tc1 = r.end.col >> TILE_BITS;
+	for (unsigned tr = tr0; tr <= tr1; ++tr) {
+		unsigned r0 = tr == tr0 ? r.begin.row & TILE_MASK : 0;
+		unsigned r1 = tr == tr1 ? r.end.row & TILE_MASK : TILE_MASK;
+		uint64_t rows = row_mask(r0, r1);
+		auto hint = m_tiles.lower_bound(key(tr, tc0));
+		for (unsigned tc = tc0; tc <= tc1; ++tc) {
+			unsigned c0 = tc == tc0 ? r.begin.col & TILE_MASK : 0;
+			unsigned c1 = tc == tc1 ? r.end.col & TILE_MASK : TILE_MASK;
+			hint = m_tiles.try_emplace(hint, key(tr, tc));
+			std::shared_ptr<Tile> &p = hint->second;
+			++hint;
+			if (p && (p->src.load(std::memory_order_relaxed) || p.use_count() > 1) &&
+			    rows == ~(uint64_t)0 && c0 == 0 && c1 == TILE_MASK) {
+				/* all of it is overwritten */
+				m_count -= p->count;
+				p.reset();
+			}
+			Tile &t = own(p);
+			fetch(t);
+			/* distance of the first row of the run */
+			unsigned base = (tr << TILE_BITS | r0) - r.begin.row + ((tc << TILE_BITS | c0) - r.begin.col);
+			unsigned area = (r1 - r0 + 1) * (c1 - c0 + 1);
+			if (!formula && area >= RUN_MIN) {
+				erase(t, c0, c1, rows);
+				t.runs.push_back(Run{v + base, (unsigned char)r0, (unsigned char)r1,
+				                     (unsigned char)c0, (unsigned char)c1});
+				t.count += area;
+				m_count += area;
+				if (t.runs.size() > RUNS_MAX)
+					spill(t);
+				continue;
+			}
+			if (!t.runs.empty())
+				cut(t, r0, r1, c0, c1);
+			for (unsigned c = c0; c <= c1; ++c, ++base) {
+				Column &col = t.make(c);
+				unsigned added = __builtin_popcountll(rows & ~col.present);
+				t.count += added;
+				m_count += added;
+				fill(col, rows, base, v, formula);
+			}
+		}
+	}
+}
+
+/**
+ * Fill rows of a column, the first of them being
+ * `base' cells away from the beginning of the range
+ */
+void
+Store::fill(Column &col, uint64_t rows, unsigned base, const Value &v, bool formula)
+{
+	for (uint64_t bits = rows & col.present; bits; bits &= bits - 1)
+		drop(col.val[__builtin_ctzll(bits)].get_type() == Value::STRING);
+	unsigned first = __builtin_ctzll(rows);
+	switch (v.get_type()) {
+	case Value::INTEGER: {
+		int n = (int)v.get_num() + (int)base - (int)first;
+		for (uint64_t bits = rows; bits; bits &= bits - 1) {
+			unsigned r = __builtin_ctzll(bits);
+			col.val[r] = Value(n + (int)r);
+			col.num[r] = n + (int)r;
+		}
+		break;
+	}
+	case Value::DOUBLE: {
+		double d = v.get_num();
+		for (uint64_t bits = rows; bits; bits &= bits - 1) {
+			unsigned r = __builtin_ctzll(bits);
+			col.val[r] = Value(d + (double)(base + r - first));
+			col.num[r] = col.val[r].get_num();
+		}
+		break;
+	}
+	default:
+		for (uint64_t bits = rows; bits; bits &= bits - 1) {
+			unsigned r = __builtin_ctzll(bits);
+			col.val[r] = v;
+			col.num[r] = 0;
+		}
+	}
+	col.present |= rows;
+	if (v.is_num())
+		col.numeric |= rows;
+	else
+		col.numeric &= ~rows;
+	if (formula)
+		col.formula |= rows;
+	else
+		col.formula &= ~rows;
+}
+
+/**
+ * Remove values from a range; tiles the range covers
+ * are dropped whole, without looking at their cells.
+ * Returns number of cells removed.
+ */
+size_t
+Store::erase(const Cell::Range &r)
+{
+	if (r.end.row < r.begin.row || r.end.col < r.begin.col)
+		return 0;
+	++m_version;
+	unindex(r);
+	size_t n = 0;
+	unsigned tr0 = r.begin.row >> TILE_BITS, tr1 = r.end.row >> TILE_BITS;
+	unsigned tc0 = r.begin.col >> TILE_BITS, tc1 = r.end.col >> TILE_BITS;
+	for (unsigned tr = tr0; tr <= tr1; ++tr) {
+		uint64_t rows = row_mask(tr == tr0 ? r.begin.row & TILE_MASK : 0,
+		                         tr == tr1 ? r.end.row & TILE_MASK : TILE_MASK);
+		auto it = m_tiles.lower_bound(key(tr, tc0));
+		while (it != m_tiles.end() && it->first <= key(tr, tc1)) {
+			unsigned tc = it->first & 0xffffffff;
+			unsigned c0 = tc == tc0 ? r.begin.col & TILE_MASK : 0;
+			unsigned c1 = tc == tc1 ? r.end.col & TILE_MASK : TILE_MASK;
+			if (rows != ~(uint64_t)0 || c0 != 0 || c1 != TILE_MASK) {
+				Tile &t = own(it->second);
+				fetch(t);
+				n += erase(t, c0, c1, rows);
+				if (t.count) {
+					++it;
+					continue;
+				}
+			} else {
+				const Tile &t = *it->second;
+				if (!t.src.load(std::memory_order_relaxed)) {
+					for (unsigned c = 0; c < TILE_SIZ; ++c)
+						if (const Column *col = t.get(c))
+							drop(__builtin_popcountll(col->present & ~col->numeric));
+					drop(t.runs.size());
+				}
+				n += t.count;
+				m_count -= t.count;
+			}
+			it = m_tiles.erase(it);
+		}
+	}
+	return n;
+}
+
+/**
+ * Remove rows of columns `c0' to `c1' of a tile
+ */
+size_t
+Store::erase(Tile &t, unsigned c0, unsigned c1, uint64_t rows)
+{
+	size_t n = 0;
+	for (unsigned c = c0; c <= c1; ++c) {
+		Column *col = t.get(c);
+		uint64_t m = col ? col->present & rows : 0;
+		if (!m)
+			continue;
+		for (uint64_t bits = m; bits; bits &= bits - 1) {
+			unsigned r = __builtin_ctzll(bits);
+			drop(col->val[r].get_type() == Value::STRING);
+			col->val[r] = Value();
+			col->num[r] = 0;
+		}
+		col->present &= ~m;
+		col->numeric &= ~m;
+		col->formula &= ~m;
+		if (!col->present)
+			t.col[c].reset();
+		n += __builtin_popcountll(m);
+	}
+	t.count -= n;
+	m_count -= n;
+	if (!t.runs.empty())
+		n += cut(t, __builtin_ctzll(rows), TILE_MASK - __builtin_clzll(rows), c0, c1);
+	return n;
+}
+
+/**
+ * Take rows `r0' to `r1' of columns `c0' to `c1' of a tile
+ * out of its runs, splitting those covered in part.
+ * Returns number of cells taken.
+ */
+size_t
+Store::cut(Tile &t, unsigned r0, unsigned r1, unsigned c0, unsigned c1)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < t.runs.size();) {
+		Run &u = t.runs[i];
+		unsigned ir0 = std::max<unsigned>(r0, u.r0), ir1 = std::min<unsigned>(r1, u.r1);
+		unsigned ic0 = std::max<unsigned>(c0, u.c0), ic1 = std::min<unsigned>(c1, u.c1);
+		if (ir0 > ir1 || ic0 > ic1) {
+			++i;
+			continue;
+		}
+		n += (ir1 - ir0 + 1) * (ic1 - ic0 + 1);
+		Run old = std::move(u);
+		if (i + 1 < t.runs.size())
+			u = std::move(t.runs.back());
+		t.runs.pop_back();
+		/* what's left around the cut */
+		auto piece = [&t, &old](unsigned a0, unsigned a1, unsigned b0, unsigned b1) {
+			t.runs.push_back(Run{old.at(a0, b0), (unsigned char)a0, (unsigned char)a1,
+			                     (unsigned char)b0, (unsigned char)b1});
+		};
+		if (old.r0 < ir0)
+			piece(old.r0, ir0 - 1, old.c0, old.c1);
+		if (ir1 < old.r1)
+			piece(ir1 + 1, old.r1, old.c0, old.c1);
+		if (old.c0 < ic0)
+			piece(ir0, ir1, old.c0, ic0 - 1);
+		if (ic1 < old.c1)
+			piece(ir0, ir1, ic1 + 1, old.c1);
+		drop(old.base.get_type() == Value::STRING);
+	}
+	t.count -= n;
+	m_count -= n;
+	if (t.runs.size() > RUNS_MAX)
+		spill(t);
+	return n;
+}
+
+/**
+ * Turn runs of a tile into cells of its columns
+ */
+void
+Store::spill(Tile &t)
+{
+	for (auto &u : t.runs)
+		for (unsigned c = u.c0; c <= u.c1; ++c)
+			fill(t.make(c), row_mask(u.r0, u.r1), c - u.c0, u.base, false);
+	t.runs.clear();
+}
+
+/**
+ * Remove value from a cell; columns and tiles
+ * are freed as soon as they become empty.
+ * Returns false if there was nothing to remove.
+ */
+bool
+Store::erase(const Cell::Pos &p)
+{
+	auto it = m_tiles.find(key(p.row >> TILE_BITS, p.col >> TILE_BITS));
+	if (it == m_tiles.end())
+		return false;
+	Tile &t = own(it->second);
+	fetch(t);
+	if (Index *ix = indexed(p.col))
+		if (const Value *old = get(p))
+			ix->remove(*old, p.row);
+	unsigned r = p.row & TILE_MASK, c = p.col & TILE_MASK;
+	Column *col = t.get(c);
+	uint64_t bit = (uint64_t)1 << r;
+	if (col && (col->present & bit)) {
+		drop(col->val[r].get_type() == Value::STRING);
+		col->present &= ~bit;
+		col->numeric &= ~bit;
+		col->formula &= ~bit;
+		col->num[r] = 0;
+		col->val[r] = Value();
+		if (!col->present)
+			t.col[c].reset();
+		--m_count;
+		--t.count;
+	} else if (t.runs.empty() || !cut(t, r, r, c, c))
+		return false;
+	++m_version;
+	if (t.count == 0)
+		m_tiles.erase(it);
+	return true;
+}
+
+/**
+ * Note strings about to be dropped; once enough
+ * were, pool is purged of those unused
+ */
+void
+Store::drop(size_t n)
+{
+	m_dropped += n;
+	if (m_dropped < m_purge_at)
+		return;
+	m_intern.purge();
+	m_dropped = 0;
+	m_purge_at = std::max(m_intern.size(), (size_t)PURGE_MIN);
+}
+
+/**
+ * Get string value sharing text with equal
+ * strings of the store
+ */
+Value
+Store::intern(std::string_view s)
+{
+	return m_intern.get(s);
+}
+
+/**
+ * Get value of a cell or null if the cell is empty
+ * Values of cells of numeric runs are made as they're
+ * asked for and only last until the next call of the
+ * same thread.
+ */
+const Value *
+Store::get(const Cell::Pos &p) const
+{
+	PROF_COUNT(LOOKUPS, 1);
+	auto it = m_tiles.find(key(p.row >> TILE_BITS, p.col >> TILE_BITS));
+	if (it == m_tiles.end())
+		return nullptr;
+	const Tile &t = fetch(*it->second);
+	unsigned r = p.row & TILE_MASK, c = p.col & TILE_MASK;
+	const Column *col = t.get(c);
+	if (col && (col->present & (uint64_t)1 << r))
+		return &col->val[r];
+	for (auto &u : t.runs)
+		if (u.has(r, c)) {
+			if (!u.base.is_num())
+				return &u.base;
+			static thread_local Value v;
+			v = u.at(r, c);
+			return &v;
+		}
+	return nullptr;
+}
+
+/**
+ * Check if cell value comes from a formula
+ */
+bool
+Store::is_formula(const Cell::Pos &p) const
+{
+	PROF_COUNT(LOOKUPS, 1);
+	auto it = m_tiles.find(key(p.row >> TILE_BITS, p.col >> TILE_BITS));
+	if (it == m_tiles.end())
+		return false;
+	const Column *col = fetch(*it->second).get(p.col & TILE_MASK);
+	return col && (col->formula & (uint64_t)1 << (p.row & TILE_MASK));
+}
+
+/**
+ * Number of cells holding a value
+ */
+size_t
+Store::size(void) const
+{
+	return m_count;
+}
+
+/**
+ * Smallest range holding all the cells; its end
+ * comes before its beginning if there are none
+ */
+Cell::Range
+Store::bounds(void) const
+{
+	unsigned r0 = ~0u, r1 = 0, c0 = ~0u, c1 = 0;
+	for (auto &it : m_tiles) {
+		const Tile &t = fetch(*it.second);
+		if (!t.count)
+			continue;
+		uint64_t rows = 0, cols = 0;
+		for (unsigned c = 0; c < TILE_SIZ; ++c) {
+			const Column *col = t.get(c);
+			if (col && col->present) {
+				rows |= col->present;
+				cols |= 1ull << c;
+			}
+		}
+		for (auto &u : t.runs) {
+			rows |= row_mask(u.r0, u.r1);
+			cols |= row_mask(u.c0, u.c1);
+		}
+		unsigned trow = it.first >> 32 << TILE_BITS, tcol = (it.first & 0xffffffff) << TILE_BITS;
+		r0 = std::min(r0, trow | __builtin_ctzll(rows));
+		r1 = std::max(r1, trow | (63 - __builtin_clzll(rows)));
+		c0 = std::min(c0, tcol | __builtin_ctzll(cols));
+		c1 = std::max(c1, tcol | (63 - __builtin_clzll(cols)));
+	}
+	Cell::Range r;
+	r.begin.row = r0;
+	r.begin.col = c0;
+	r.end.row = r1;
+	r.end.col = c1;
+	return r;
+}
+
+/**
+ * Number of changes made to the store; anything
+ * derived from its cells is current as long as
+ * this stays the same
+ */
+uint64_t
+Store::version(void) const
+{
+	return m_version;
+}
+
+/**
+ * Drop all the cells
+ */
+void
+Store::clear(void)
+{
+	++m_version;
+	m_tiles.clear();
+	m_index.clear();
+	m_count = 0;
+	m_intern.purge();
+	m_strings.reset();
+	m_file.reset();
+}
+
+Store::Region::Region(void) : whole(false)
+{}
+
+/**
+ * Cells that putting a region back may change: its range,
+ * or all of the tiles overlapping it if it's kept by them
+ */
+Cell::Range
+Store::Region::extent(void) const
+{
+	if (!whole)
+		return range;
+	Cell::Range r = range;
+	r.begin.row &= ~TILE_MASK;
+	r.begin.col &= ~TILE_MASK;
+	r.end.row |= TILE_MASK;
+	r.end.col |= TILE_MASK;
+	return r;
+}
+
+/**
+ * Estimate of memory taken by a region; tiles are
+ * counted whole, as the store they were taken from
+ * holds copies of them once it writes to them.
+ * Tiles not decoded yet take nothing but themselves.
+ */
+size_t
+Store::Region::bytes(void) const
+{
+	size_t n = sizeof(*this) + tiles.capacity() * sizeof(tiles[0]) + cells.capacity() * sizeof(cells[0]) +
+	           formula.capacity() / 8;
+	for (auto &it : tiles) {
+		const Tile &t = *it.second;
+		n += sizeof(t);
+		if (t.src.load(std::memory_order_acquire))
+			continue;
+		n += t.runs.capacity() * sizeof(Run);
+		for (unsigned c = 0; t.col && c < TILE_SIZ; ++c)
+			n += sizeof(t.col[c]) + (t.col[c] ? sizeof(Column) : 0);
+	}
+	return n;
+}
+
+/**
+ * Keep contents of a range to be put back with restore;
+ * cells of small ranges are copied, tiles overlapping
+ * big ones are shared with the store, so it takes no
+ * more than a lookup per tile.
+ */
+Store::Region
+Store::keep(const Cell::Range &r) const
+{
+	Region g;
+	g.range = r;
+	g.whole = (uint64_t)(r.end.row - r.begin.row + 1) * (r.end.col - r.begin.col + 1) > KEEP_CELLS;
+	if (!g.whole) {
+		for_each(r, [this, &g](const Cell::Pos &p, const Value &v) {
+			g.cells.emplace_back(p, v);
+			g.formula.push_back(is_formula(p));
+		});
+		return g;
+	}
+	unsigned tr0 = r.begin.row >> TILE_BITS, tr1 = r.end.row >> TILE_BITS;
+	unsigned tc0 = r.begin.col >> TILE_BITS, tc1 = r.end.col >> TILE_BITS;
+	for (unsigned tr = tr0; tr <= tr1; ++tr)
+		for (auto it = m_tiles.lower_bound(key(tr, tc0)); it != m_tiles.end() && it->first <= key(tr, tc1); ++it)
+			g.tiles.push_back(*it);
+	return g;
+}
+
+/**
+ * Put contents of a region back in place of what its range
+ * holds now, which the region is left with instead, so it
+ * can be put back in turn. Tiles are swapped without looking
+ * at their cells; indexes of their columns are dropped, as
+ * the tiles may change rows out of the range too.
+ */
+void
+Store::restore(Region &g)
+{
+	const Cell::Range &r = g.range;
+	if (!g.whole) {
+		Region now = keep(r);
+		erase(r);
+		Bulk bulk(*this);
+		for (size_t i = 0; i < g.cells.size(); ++i)
+			bulk.set(g.cells[i].first, std::move(g.cells[i].second), g.formula[i]);
+		g = std::move(now);
+		return;
+	}
+	++m_version;
+	Cell::Range ext = g.extent();
+	for (auto it = m_index.begin(); it != m_index.end();)
+		if (it->first >= ext.begin.col && it->first <= ext.end.col)
+			it = m_index.erase(it);
+		else
+			++it;
+	std::vector<std::pair<uint64_t, std::shared_ptr<Tile>>> now;
+	unsigned tr0 = r.begin.row >> TILE_BITS, tr1 = r.end.row >> TILE_BITS;
+	unsigned tc0 = r.begin.col >> TILE_BITS, tc1 = r.end.col >> TILE_BITS;
+	for (unsigned tr = tr0; tr <= tr1; ++tr) {
+		auto it = m_tiles.lower_bound(key(tr, tc0));
+		while (it != m_tiles.end() && it->first <= key(tr, tc1)) {
+			m_count -= it->second->count;
+			now.emplace_back(it->first, std::move(it->second));
+			it = m_tiles.erase(it);
+		}
+	}
+	auto hint = g.tiles.empty() ? m_tiles.end() : m_tiles.lower_bound(g.tiles[0].first);
+	for (auto &t : g.tiles) {
+		m_count += t.second->count;
+		hint = std::next(m_tiles.emplace_hint(hint, t.first, std::move(t.second)));
+	}
+	g.tiles = std::move(now);
+}
+
+/**
+ * Get a view of cells within a range
+ */
+Store::Query
+Store::query(const Cell::Range &r) const
+{
+	return Query(this, r);
+}
+
+/**
+ * Check if two values are the same
+ */
+static bool
+same(const Value &a, const Value &b)
+{
+	if (a.get_type() != b.get_type())
+		return false;
+	switch (a.get_type()) {
+	case Value::INTEGER:
+	case Value::DOUBLE:
+		return a.get_num() == b.get_num();
+	case Value::ERROR:
+		return a.get_error() == b.get_error();
+	default:
+		return a.get_str() == b.get_str();
+	}
+}
+
+/**
+ * Join ranges of runs continuing one another
+ * down columns or, if `across', along rows
+ */
+static void
+join(std::vector<std::pair<Cell::Range, Value>> &runs, bool across)
+{
+	auto order = [across](const std::pair<Cell::Range, Value> &a, const std::pair<Cell::Range, Value> &b) {
+		const Cell::Range &x = a.first, &y = b.first;
+		if (across)
+			return std::tie(x.begin.row, x.end.row, x.begin.col) < std::tie(y.begin.row, y.end.row, y.begin.col);
+		return std::tie(x.begin.col, x.end.col, x.begin.row) < std::tie(y.begin.col, y.end.col, y.begin.row);
+	};
+	std::sort(runs.begin(), runs.end(), order);
+	size_t n = 0;
+	for (size_t i = 0; i < runs.size(); ++i) {
+		if (n) {
+			Cell::Range &x = runs[n - 1].first, &y = runs[i].first;
+			bool next = across
+			            ? x.begin.row == y.begin.row && x.end.row == y.end.row && x.end.col + 1 == y.begin.col
+			            : x.begin.col == y.begin.col && x.end.col == y.end.col && x.end.row + 1 == y.begin.row;
+			unsigned k = across ? y.begin.col - x.begin.col : y.begin.row - x.begin.row;
+			if (next && same(runs[n - 1].second + k, runs[i].second)) {
+				x.end = y.end;
+				continue;
+			}
+		}
+		if (n != i)
+			runs[n] = std::move(runs[i]);
+		++n;
+	}
+	runs.resize(n);
+}
+
+/**
+ * Get ranges of cells kept as runs along with values
+ * of their first cells; runs spanning many tiles are
+ * given as a single range, as far as they can be.
+ */
+std::vector<std::pair<Cell::Range, Value>>
+Store::runs(void) const
+{
+	std::vector<std::pair<Cell::Range, Value>> runs;
+	for (auto &it : m_tiles) {
+		unsigned trow = it.first >> 32, tcol = it.first & 0xffffffff;
+		for (auto &u : fetch(*it.second).runs) {
+			Cell::Range r;
+			r.begin.row = trow << TILE_BITS | u.r0;
+			r.begin.col = tcol << TILE_BITS | u.c0;
+			r.end.row = trow << TILE_BITS | u.r1;
+			r.end.col = tcol << TILE_BITS | u.c1;
+			runs.emplace_back(r, u.base);
+		}
+	}
+	join(runs, false);
+	join(runs, true);
+	return runs;
+}
+
+/**
+ * Sum up numbers of a range; errors are noted,
+ * anything else is skipped. Columns are folded
+ * by kernels, runs by formulas of their sums.
+ */
+Store::Summary
+Store::summarize(const Cell::Range &r) const
+{
+	Summary s;
+	if (r.end.row < r.begin.row || r.end.col < r.begin.col)
+		return s;
+	unsigned tr0 = r.begin.row >> TILE_BITS, tr1 = r.end.row >> TILE_BITS;
+	unsigned tc0 = r.begin.col >> TILE_BITS, tc1 = r.end.col >> TILE_BITS;
+	for (unsigned tr = tr0; tr <= tr1; ++tr) {
+		unsigned r0 = tr == tr0 ? r.begin.row & TILE_MASK : 0;
+		unsigned r1 = tr == tr1 ? r.end.row & TILE_MASK : TILE_MASK;
+		uint64_t rows = row_mask(r0, r1);
+		PROF_COUNT(LOOKUPS, 1);
+		auto it = m_tiles.lower_bound(key(tr, tc0));
+		for (; it != m_tiles.end() && it->first <= key(tr, tc1); ++it) {
+			unsigned tc = it->first & 0xffffffff;
+			unsigned c0 = tc == tc0 ? r.begin.col & TILE_MASK : 0;
+			unsigned c1 = tc == tc1 ? r.end.col & TILE_MASK : TILE_MASK;
+			const Tile &t = fetch(*it->second);
+			for (unsigned c = c0; c <= c1; ++c) {
+				const Column *col = t.get(c);
+				if (!col)
+					continue;
+				Kernel::fold(s, col->num, col->numeric & rows);
+				for (uint64_t bits = col->present & ~col->numeric & rows; bits && s.err < 0; bits &= bits - 1) {
+					const Value &v = col->val[__builtin_ctzll(bits)];
+					if (v.get_type() == Value::ERROR)
+						s.err = v.get_error();
+				}
+			}
+			for (auto &u : t.runs) {
+				unsigned ra = std::max<unsigned>(u.r0, r0), rb = std::min<unsigned>(u.r1, r1);
+				unsigned ca = std::max<unsigned>(u.c0, c0), cb = std::min<unsigned>(u.c1, c1);
+				if (ra > rb || ca > cb)
+					continue;
+				if (u.base.is_num())
+					for (unsigned c = ca; c <= cb; ++c)
+						s.add(u.base.get_num() + (ra - u.r0 + c - u.c0), rb - ra + 1);
+				else if (u.base.get_type() == Value::ERROR && s.err < 0)
+					s.err = u.base.get_error();
+			}
+		}
+	}
+	return s;
+}
+
+/**
+ * Find the first row of a range whose cell in the first
+ * column of the range matches a key; for BELOW matches, the
+ * first row holding the greatest value not above the key.
+ * Columns are indexed as they're searched, unless the range
+ * is too short for that to pay off.
+ */
+bool
+Store::find(const Cell::Range &r, const Value &v, Match m, unsigned &row) const
+{
+	if (r.end.row < r.begin.row || (m == PREFIX && v.get_type() != Value::STRING))
+		return false;
+	{
+		std::lock_guard<std::mutex> l(m_index_lock);
+		if (r.end.row - r.begin.row >= INDEX_MIN || m_index.count(r.begin.col))
+			return index(r.begin.col).find(v, m, r.begin.row, r.end.row, row);
+	}
+	Cell::Range col = r;
+	col.end.col = col.begin.col;
+	Value best;
+	bool found = false;
+	for_each(col, [&](const Cell::Pos &p, const Value &x) {
+		if ((found && m != BELOW) || !Index::matches(x, v, m))
+			return;
+		if (found && Index::compare(x, best) <= 0)
+			return;
+		best = x;
+		row = p.row;
+		found = true;
+	});
+	return found;
+}
+
+/**
+ * Index of a column if it has one
+ */
+Store::Index *
+Store::indexed(unsigned c) const
+{
+	if (m_index.empty())
+		return nullptr;
+	auto it = m_index.find(c);
+	return it == m_index.end() ? nullptr : it->second.get();
+}
+
+/**
+ * Get index of a column, building it if there's none;
+ * index lock must be held
+ */
+Store::Index &
+Store::index(unsigned c) const
+{
+	auto &ix = m_index[c];
+	if (ix)
+		return *ix;
+	ix = std::make_unique<Index>();
+	auto add = [&ix](const Cell::Pos &p, const Value &v) { ix->add(v, p.row); };
+	for (auto &it : m_tiles)
+		if ((it.first & 0xffffffff) == c >> TILE_BITS)
+			visit(it.first >> 32, c >> TILE_BITS, fetch(*it.second), c & TILE_MASK, c & TILE_MASK,
+			      ~(uint64_t)0, &Column::present, true, add);
+	return *ix;
+}
+
+/**
+ * Take cells of a range about to be written over out
+ * of indexes; indexes of columns having too many rows
+ * written are dropped instead
+ */
+void
+Store::unindex(const Cell::Range &r)
+{
+	for (auto it = m_index.begin(); it != m_index.end();) {
+		if (it->first < r.begin.col || it->first > r.end.col) {
+			++it;
+			continue;
+		}
+		if (r.end.row - r.begin.row >= INDEX_DROP) {
+			it = m_index.erase(it);
+			continue;
+		}
+		Cell::Range col = r;
+		col.begin.col = col.end.col = it->first;
+		Index &ix = *it->second;
+		for_each(col, [&ix](const Cell::Pos &p, const Value &v) { ix.remove(v, p.row); });
+		++it;
+	}
+}
+
+Store::Summary::Summary(void)
+	: count(0), sum(0), min(HUGE_VAL), max(-HUGE_VAL), shift(0), dsum(0), dsq(0), err(-1)
+{}
+
+/**
+ * Add a number
+ */
+void
+Store::Summary::add(double v)
+{
+	if (!count)
+		shift = v;
+	double d = v - shift;
+	sum += v;
+	dsum += d;
+	dsq += d * d;
+	min = std::min(min, v);
+	max = std::max(max, v);
+	++count;
+}
+
+/**
+ * Add `n' numbers growing by one from `first' on
+ */
+void
+Store::Summary::add(double first, size_t n)
+{
+	if (!n)
+		return;
+	if (!count)
+		shift = first;
+	double a = first - shift, k = (double)n * (n - 1) / 2; /* sum of 0 to n - 1 */
+	sum += n * first + k;
+	dsum += n * a + k;
+	dsq += n * a * a + 2 * a * k + k * (2 * n - 1) / 3;
+	min = std::min(min, first);
+	max = std::max(max, first + (n - 1));
+	count += n;
+}
+
+/**
+ * Add numbers of another summary
+ */
+void
+Store::Summary::add(const Summary &s)
+{
+	if (err < 0)
+		err = s.err;
+	if (!s.count)
+		return;
+	if (!count)
+		shift = s.shift;
+	double delta = s.shift - shift; /* moves differences of `s' to our shift */
+	sum += s.sum;
+	dsum += s.dsum + s.count * delta;
+	dsq += s.dsq + 2 * delta * s.dsum + s.count * delta * delta;
+	min = std::min(min, s.min);
+	max = std::max(max, s.max);
+	count += s.count;
+}
+
+/**
+ * Take back numbers of a summary added before; extremes
+ * can't be taken back, so they're left as they were
+ */
+void
+Store::Summary::remove(const Summary &s)
+{
+	if (!s.count)
+		return;
+	double delta = s.shift - shift;
+	sum -= s.sum;
+	dsum -= s.dsum + s.count * delta;
+	dsq -= s.dsq + 2 * delta * s.dsum + s.count * delta * delta;
+	count -= s.count;
+	if (!count) {
+		int e = err;
+		*this = Summary();
+		err = e;
+	}
+}
+
+/**
+ * Sample variance of numbers, 0 if there are less than two
+ */
+double
+Store::Summary::variance(void) const
+{
+	if (count < 2)
+		return 0;
+	return std::max(0.0, (dsq - dsum * dsum / count) / (count - 1));
+}
+
+Store::Query::Query(const Store *s, const Cell::Range &r) : m_store(s), m_range(r)
+{}
+
+Store::Query::iterator
+Store::Query::begin(void) const
+{
+	return iterator(m_store, m_range);
+}
+
+Store::Query::iterator
+Store::Query::end(void) const
+{
+	return iterator();
+}
+
+/**
+ * Past-the-end iterator
+ */
+Store::Query::iterator::iterator(void) : m_store(nullptr), m_col(nullptr), m_bits(0), m_held(0)
+{}
+
+/**
+ * Position iterator at the first cell within range
+ */
+Store::Query::iterator::iterator(const Store *s, const Cell::Range &r)
+	: m_store(s), m_range(r), m_col(nullptr), m_bits(0), m_held(0)
+{
+	if (r.end.row < r.begin.row || r.end.col < r.begin.col)
+		return;
+	m_tr = r.begin.row >> TILE_BITS;
+	if (seek_row()) {
+		seek_tile();
+		seek_col();
+	}
+}
+
+Store::Entry
+Store::Query::iterator::operator*(void) const
+{
+	unsigned r = m_pos.row & TILE_MASK;
+	if (!(m_held >> r & 1))
+		return Entry{m_pos, m_col->val[r]};
+	const Run &u = m_tile->second->runs[m_which[r]];
+	if (!u.base.is_num())
+		return Entry{m_pos, u.base};
+	m_num = u.at(r, m_cur);
+	return Entry{m_pos, m_num};
+}
+
+Store::Query::iterator &
+Store::Query::iterator::operator++(void)
+{
+	m_bits &= m_bits - 1;
+	if (m_bits)
+		m_pos.row = (m_tr << TILE_BITS) | __builtin_ctzll(m_bits);
+	else {
+		++m_cur;
+		seek_col();
+	}
+	return *this;
+}
+
+bool
+Store::Query::iterator::operator!=(const iterator &it) const
+{
+	return m_col != it.m_col || m_bits != it.m_bits;
+}
+
+/**
+ * Find the first tile overlapping range in the current
+ * or any following row of tiles.
+ * Returns false if there are none left.
+ */
+bool
+Store::Query::iterator::seek_row(void)
+{
+	unsigned tr1 = m_range.end.row >> TILE_BITS;
+	unsigned tc0 = m_range.begin.col >> TILE_BITS, tc1 = m_range.end.col >> TILE_BITS;
+	auto &tiles = m_store->m_tiles;
+	for (; m_tr <= tr1; ++m_tr) {
+		m_tile = tiles.lower_bound(key(m_tr, tc0));
+		if (m_tile == tiles.end())
+			break;
+		if (m_tile->first > key(m_tr, tc1)) {
+			/* skip rows of tiles with nothing in range */
+			unsigned next = m_tile->first >> 32;
+			if (next > m_tr)
+				m_tr = next - 1;
+			continue;
+		}
+		m_rows = row_mask(m_tr == m_range.begin.row >> TILE_BITS ? m_range.begin.row & TILE_MASK : 0,
+		                  m_tr == tr1 ? m_range.end.row & TILE_MASK : TILE_MASK);
+		return true;
+	}
+	m_col = nullptr;
+	m_bits = m_held = 0;
+	return false;
+}
+
+/**
+ * Set up column span of the current tile
+ */
+void
+Store::Query::iterator::seek_tile(void)
+{
+	m_store->fetch(*m_tile->second);
+	unsigned tc = m_tile->first & 0xffffffff;
+	m_cur = tc == m_range.begin.col >> TILE_BITS ? m_range.begin.col & TILE_MASK : 0;
+	m_last = tc == m_range.end.col >> TILE_BITS ? m_range.end.col & TILE_MASK : TILE_MASK;
+}
+
+/**
+ * Find the next column holding values within range,
+ * moving on to following tiles if needed
+ */
+void
+Store::Query::iterator::seek_col(void)
+{
+	for (;;) {
+		const Tile &t = *m_tile->second;
+		for (; m_cur <= m_last; ++m_cur) {
+			m_col = t.get(m_cur);
+			m_held = t.runs.empty() ? 0 : t.run_rows(m_cur, false, m_which) & m_rows;
+			if ((m_bits = (m_col ? m_col->present & m_rows : 0) | m_held)) {
+				m_pos.col = (unsigned)(m_tile->first & 0xffffffff) << TILE_BITS | m_cur;
+				m_pos.row = (m_tr << TILE_BITS) | __builtin_ctzll(m_bits);
+				return;
+			}
+		}
+		if (++m_tile == m_store->m_tiles.end() ||
+		    m_tile->first > key(m_tr, m_range.end.col >> TILE_BITS)) {
+			++m_tr;
+			if (!seek_row())
+				return;
+		}
+		seek_tile();
+	}
+}
+
+/*
+ * Binary encoding
+ * A tile is encoded as a bitmap of its columns holding
+ * values followed by every such column: bitmaps of present
+ * rows, rows computed by formulas, and of rows holding
+ * integers, doubles and strings, the rest of present rows
+ * being errors, and of rows making an arithmetic progression
+ * (like those filled by Sheet::insert), all of them integers
+ * or all doubles. The progression takes 16 bytes: its first
+ * value and step. After that go 8 bytes per every other
+ * present row: the number, index of the string or error code.
+ * Columns are followed by the number of runs of the tile and
+ * the runs, 16 bytes each: first and last row and first and
+ * last column, a byte apiece, and type of the value in the high
+ * half of the first 8 bytes; the value takes the other 8.
+ * Tiles are followed by an index telling where each of them
+ * is and how many values it holds.
+ * Everything is in byte order of the host.
+ */
+
+#define COL_HEAD 6 /* bitmaps heading an encoded column */
+#define PROG_MIN 3 /* least rows worth encoding as a progression */
+#define EXTENT_SIZ 24 /* index entry: key, offset, length, count */
+#define RUNS_READ 255 /* most runs of a tile read, as indexed by a byte */
+
+template <typename T> static void
+put_raw(std::ostream &os, T v)
+{
+	os.write((const char *)&v, sizeof(v));
+}
+
+template <typename T> static T
+get_raw(const char *p)
+{
+	T v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * Write all the tiles and their index at the current
+ * position of a stream, adding strings to a table;
+ * `progress' is told how many cells every tile held.
+ * Returns position of the index.
+ */
+uint64_t
+Store::encode(std::ostream &os, Strings &strings, const std::function<void(size_t)> &progress) const
+{
+	struct Extent {
+		uint64_t key, offset;
+		uint32_t len, count;
+	};
+	std::vector<Extent> index;
+	index.reserve(m_tiles.size());
+	for (auto &it : m_tiles) {
+		const Tile &t = fetch(*it.second);
+		uint64_t offset = os.tellp(), cols = 0;
+		for (unsigned c = 0; c < TILE_SIZ; ++c)
+			if (t.get(c))
+				cols |= (uint64_t)1 << c;
+		put_raw(os, cols);
+		for (unsigned c = 0; c < TILE_SIZ; ++c) {
+			const Column *col = t.get(c);
+			if (!col)
+				continue;
+			uint64_t type[Value::ERROR + 1] = {};
+			for (uint64_t bits = col->present; bits; bits &= bits - 1) {
+				unsigned r = __builtin_ctzll(bits);
+				type[col->val[r].get_type()] |= (uint64_t)1 << r;
+			}
+			uint64_t prog = progression(*col, type[Value::INTEGER] == col->present);
+			put_raw(os, col->present);
+			put_raw(os, col->formula);
+			put_raw(os, type[Value::INTEGER]);
+			put_raw(os, type[Value::DOUBLE]);
+			put_raw(os, type[Value::STRING] | type[Value::FORMULA]);
+			put_raw(os, prog);
+			if (prog) {
+				unsigned r0 = __builtin_ctzll(prog), r1 = __builtin_ctzll(prog & (prog - 1));
+				if (type[Value::INTEGER] == col->present) {
+					put_raw(os, (int64_t)col->num[r0]);
+					put_raw(os, (int64_t)col->num[r1] - (int64_t)col->num[r0]);
+				} else {
+					put_raw(os, col->num[r0]);
+					put_raw(os, col->num[r1] - col->num[r0]);
+				}
+			}
+			for (uint64_t bits = col->present & ~prog; bits; bits &= bits - 1)
+				put_raw(os, pack(col->val[__builtin_ctzll(bits)], strings));
+		}
+		put_raw(os, (uint64_t)t.runs.size());
+		for (auto &u : t.runs) {
+			uint64_t type = u.base.get_type() == Value::FORMULA ? Value::STRING : u.base.get_type();
+			put_raw(os, type << 32 | u.c1 << 24 | u.c0 << 16 | u.r1 << 8 | u.r0);
+			put_raw(os, pack(u.base, strings));
+		}
+		index.push_back(Extent{it.first, offset, (uint32_t)((uint64_t)os.tellp() - offset), t.count});
+		if (progress)
+			progress(t.count);
+	}
+	uint64_t pos = os.tellp();
+	put_raw(os, (uint64_t)index.size());
+	for (auto &e : index) {
+		put_raw(os, e.key);
+		put_raw(os, e.offset);
+		put_raw(os, e.len);
+		put_raw(os, e.count);
+	}
+	return pos;
+}
+
+/**
+ * Get 8 bytes a value is encoded as: the number itself,
+ * error code or index of the string in a table
+ */
+uint64_t
+Store::pack(const Value &v, Strings &strings)
+{
+	uint64_t raw;
+	switch (v.get_type()) {
+	case Value::INTEGER:
+		return (uint64_t)(int64_t)v.get_num();
+	case Value::DOUBLE: {
+		double d = v.get_num();
+		std::memcpy(&raw, &d, sizeof(raw));
+		return raw;
+	}
+	case Value::ERROR:
+		return v.get_error();
+	default:
+		return strings.add(v.eval());
+	}
+}
+
+/**
+ * Make value of a given type out of its encoding
+ */
+Value
+Store::unpack(unsigned type, uint64_t raw) const
+{
+	switch (type) {
+	case Value::INTEGER:
+		return Value((int)(int64_t)raw);
+	case Value::DOUBLE: {
+		double d;
+		std::memcpy(&d, &raw, sizeof(d));
+		return Value(d);
+	}
+	case Value::STRING:
+		return m_intern.get(m_strings ? m_strings->get(raw) : std::string_view());
+	default:
+		return Value::error(raw <= Value::NA ? (Value::Error)raw : Value::VALUE);
+	}
+}
+
+/**
+ * Check if numbers of a column make an arithmetic progression
+ * as decoded; returns its rows or 0 if they don't.
+ * Only columns of all integers or all doubles are taken.
+ */
+uint64_t
+Store::progression(const Column &col, bool ints)
+{
+	if (col.formula || col.numeric != col.present || __builtin_popcountll(col.present) < PROG_MIN)
+		return 0;
+	if (!ints)
+		for (uint64_t bits = col.present; bits; bits &= bits - 1)
+			if (col.val[__builtin_ctzll(bits)].get_type() != Value::DOUBLE)
+				return 0;
+	uint64_t bits = col.present;
+	unsigned r0 = __builtin_ctzll(bits);
+	bits &= bits - 1;
+	double first = col.num[r0], step = col.num[__builtin_ctzll(bits)] - first;
+	int64_t ifirst = (int64_t)first, istep = (int64_t)step;
+	for (unsigned k = 1; bits; bits &= bits - 1, ++k) {
+		double n = col.num[__builtin_ctzll(bits)];
+		if (ints ? (int64_t)n != ifirst + (int64_t)k * istep : n != first + k * step)
+			return 0;
+	}
+	return col.present;
+}
+
+/**
+ * Take tiles encoded in a file, the index of which is
+ * at a given offset. Tiles are left encoded until first
+ * accessed, meanwhile `file' is kept alive.
+ * Tiles already present are merged with those from
+ * the file right away.
+ */
+void
+Store::attach(std::string_view data, uint64_t index, const Strings &strings,
+              std::shared_ptr<const void> file)
+{
+	if (index > data.size() || data.size() - index < sizeof(uint64_t))
+		throw std::runtime_error("invalid tile index");
+	uint64_t n = get_raw<uint64_t>(data.data() + index);
+	if (n > (data.size() - index - sizeof(uint64_t)) / EXTENT_SIZ)
+		throw std::runtime_error("invalid tile index");
+	++m_version;
+	m_index.clear();
+	for (auto &t : m_tiles)
+		fetch(*t.second); /* still refer to a previous file */
+	m_strings = std::make_shared<const Strings>(strings);
+	m_file = std::move(file);
+	const char *e = data.data() + index + sizeof(uint64_t);
+	for (uint64_t i = 0; i < n; ++i, e += EXTENT_SIZ) {
+		uint64_t key = get_raw<uint64_t>(e), offset = get_raw<uint64_t>(e + 8);
+		uint32_t len = get_raw<uint32_t>(e + 16), count = get_raw<uint32_t>(e + 20);
+		if (offset > data.size() || data.size() - offset < len)
+			throw std::runtime_error("invalid tile index");
+		auto it = m_tiles.try_emplace(m_tiles.end(), key);
+		if (it->second) {
+			/* merge cells into a tile already in place */
+			Tile tmp;
+			decode(tmp, data.substr(offset, len));
+			unsigned trow = key >> 32, tcol = key & 0xffffffff;
+			Tile &t = own(it->second);
+			auto merge = [this, &t, &tmp](const Cell::Pos &p, const Value &v) {
+				const Column *col = tmp.get(p.col & TILE_MASK);
+				put(t, p, v, col && col->formula & (uint64_t)1 << (p.row & TILE_MASK));
+			};
+			visit(trow, tcol, tmp, 0, TILE_MASK, ~(uint64_t)0, &Column::present, true, merge);
+			continue;
+		}
+		it->second = std::make_shared<Tile>();
+		Tile &t = *it->second;
+		t.src = data.data() + offset;
+		t.len = len;
+		t.count = count;
+		m_count += count;
+	}
+}
+
+/**
+ * Decode a tile left encoded; safe to call from
+ * many threads reading the store at once.
+ */
+void
+Store::decode(const Tile &t) const
+{
+	std::lock_guard<std::mutex> l(*m_decode);
+	const char *src = t.src.load(std::memory_order_relaxed);
+	if (!src)
+		return;
+	Tile &dst = const_cast<Tile &>(t);
+	decode(dst, std::string_view(src, t.len));
+	dst.src.store(nullptr, std::memory_order_release);
+}
+
+/**
+ * Decode encoded contents into a tile.
+ * Encoded data is not trusted: values that don't
+ * fit in it are left empty, as are runs overlapping
+ * other cells.
+ */
+void
+Store::decode(Tile &t, std::string_view data) const
+{
+	const char *p = data.data(), *end = p + data.size();
+	auto next = [&p, end](void) -> uint64_t {
+		if (end - p < 8)
+			return 0;
+		p += 8;
+		return get_raw<uint64_t>(p - 8);
+	};
+	uint64_t taken[TILE_SIZ] = {};
+	for (uint64_t cols = next(); cols; cols &= cols - 1) {
+		unsigned c = __builtin_ctzll(cols);
+		Column *col = &t.make(c);
+		uint64_t type[COL_HEAD];
+		for (auto &b : type)
+			b = next();
+		col->present = type[0];
+		col->formula = type[1] & col->present;
+		uint64_t prog = type[5] & col->present, first = prog ? next() : 0, step = prog ? next() : 0;
+		unsigned k = 0;
+		for (uint64_t bits = col->present; bits; bits &= bits - 1) {
+			unsigned r = __builtin_ctzll(bits);
+			uint64_t bit = (uint64_t)1 << r, raw = prog & bit ? 0 : next();
+			Value &v = col->val[r];
+			if (prog & bit) {
+				if (type[2] & bit)
+					v = Value((int)(int64_t)(first + k * step));
+				else {
+					double d0, ds;
+					std::memcpy(&d0, &first, sizeof(d0));
+					std::memcpy(&ds, &step, sizeof(ds));
+					v = Value(d0 + k * ds);
+				}
+				++k;
+			} else
+				v = unpack(type[2] & bit ? Value::INTEGER : type[3] & bit ? Value::DOUBLE
+				           : type[4] & bit ? Value::STRING : Value::ERROR, raw);
+			if (v.is_num())
+				col->numeric |= bit;
+			col->num[r] = v.get_num();
+		}
+		taken[c] = col->present;
+		if (!col->present)
+			t.col[c].reset();
+	}
+	for (uint64_t i = 0, n = next(); i < n && end - p >= 16; ++i) {
+		uint64_t head = next(), raw = next();
+		unsigned r0 = head & 0xff, r1 = head >> 8 & 0xff, c0 = head >> 16 & 0xff, c1 = head >> 24 & 0xff;
+		if (r0 > r1 || r1 > TILE_MASK || c0 > c1 || c1 > TILE_MASK || t.runs.size() == RUNS_READ)
+			continue;
+		uint64_t rows = row_mask(r0, r1);
+		bool fits = true;
+		for (unsigned c = c0; c <= c1; ++c)
+			fits = fits && !(taken[c] & rows);
+		if (!fits)
+			continue;
+		for (unsigned c = c0; c <= c1; ++c)
+			taken[c] |= rows;
+		t.runs.push_back(Run{unpack(head >> 32, raw), (unsigned char)r0, (unsigned char)r1,
+		                     (unsigned char)c0, (unsigned char)c1});
+	}
+}
+
+Store::Strings::Strings(void) : m_size(0)
+{}
+
+/**
+ * Read a table in place
+ */
+Store::Strings::Strings(std::string_view data) : m_data(data), m_size(0)
+{
+	uint64_t words = data.size() / sizeof(uint64_t);
+	if (words < 2 || (m_size = get_raw<uint64_t>(data.data())) > words - 2)
+		throw std::runtime_error("invalid string table");
+}
+
+/**
+ * Add string to the table if not already there;
+ * returns its index
+ */
+uint64_t
+Store::Strings::add(const std::string &s)
+{
+	auto it = m_ids.try_emplace(s, m_list.size());
+	if (it.second)
+		m_list.push_back(s);
+	return it.first->second;
+}
+
+/**
+ * Get string of a read table;
+ * indexes out of range give empty string
+ */
+std::string_view
+Store::Strings::get(uint64_t i) const
+{
+	if (i >= m_size)
+		return std::string_view();
+	const char *off = m_data.data() + sizeof(uint64_t) * (i + 1);
+	uint64_t b = get_raw<uint64_t>(off), e = get_raw<uint64_t>(off + sizeof(uint64_t));
+	uint64_t text = sizeof(uint64_t) * (m_size + 2);
+	if (b > e || e > m_data.size() - text)
+		return std::string_view();
+	return m_data.substr(text + b, e - b);
+}
+
+/**
+ * Write table of added strings
+ */
+void
+Store::Strings::encode(std::ostream &os) const
+{
+	uint64_t off = 0;
+	put_raw(os, (uint64_t)m_list.size());
+	for (auto &s : m_list) {
+		put_raw(os, off);
+		off += s.size();
+	}
+	put_raw(os, off);
+	for (auto &s : m_list)
+		os.write(s.data(), s.size());
+}
+
+/**
+ * Note a value in a row
+ */
+void
+Store::Index::add(const Value &v, unsigned row)
+{
+	auto h = m_hash.find(&v);
+	if (h == m_hash.end()) {
+		auto it = m_sorted.emplace(v, std::vector<unsigned>()).first;
+		h = m_hash.emplace(&it->first, it).first;
+	}
+	std::vector<unsigned> &rows = h->second->second;
+	if (rows.empty() || rows.back() < row)
+		rows.push_back(row);
+	else
+		rows.insert(std::lower_bound(rows.begin(), rows.end(), row), row);
+}
+
+/**
+ * Forget a value of a row
+ */
+void
+Store::Index::remove(const Value &v, unsigned row)
+{
+	auto h = m_hash.find(&v);
+	if (h == m_hash.end())
+		return;
+	auto it = h->second;
+	std::vector<unsigned> &rows = it->second;
+	auto r = std::lower_bound(rows.begin(), rows.end(), row);
+	if (r != rows.end() && *r == row)
+		rows.erase(r);
+	if (rows.empty()) {
+		m_hash.erase(h);
+		m_sorted.erase(it);
+	}
+}
+
+/**
+ * Find the first row from `r0' to `r1' matching
+ * a key; see Store::find
+ */
+bool
+Store::Index::find(const Value &v, Match m, unsigned r0, unsigned r1, unsigned &row) const
+{
+	switch (m) {
+	case EXACT: {
+		auto h = m_hash.find(&v);
+		return h != m_hash.end() && first(h->second->second, r0, r1, row);
+	}
+	case BELOW:
+		for (auto it = m_sorted.upper_bound(v); it != m_sorted.begin();) {
+			--it;
+			if (!matches(it->first, v, BELOW))
+				return false;
+			if (first(it->second, r0, r1, row))
+				return true;
+		}
+		return false;
+	case PREFIX: {
+		bool found = false;
+		unsigned r;
+		for (auto it = m_sorted.lower_bound(v); it != m_sorted.end() && matches(it->first, v, PREFIX); ++it)
+			if (first(it->second, r0, found ? row : r1, r)) {
+				row = r;
+				found = true;
+			}
+		return found;
+	}
+	}
+	return false;
+}
+
+/**
+ * Order of types of values: numbers, strings, errors
+ */
+static int
+rank(const Value &v)
+{
+	switch (v.get_type()) {
+	case Value::INTEGER:
+	case Value::DOUBLE:
+		return 0;
+	case Value::ERROR:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/**
+ * Compare two values, by type and then by value;
+ * strings are compared byte by byte
+ */
+int
+Store::Index::compare(const Value &a, const Value &b)
+{
+	int ra = rank(a), rb = rank(b);
+	if (ra != rb)
+		return ra < rb ? -1 : 1;
+	if (ra == 1)
+		return a.get_str().compare(b.get_str());
+	double x = ra ? a.get_error() : a.get_num(), y = ra ? b.get_error() : b.get_num();
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Check if value matches a key
+ */
+bool
+Store::Index::matches(const Value &v, const Value &key, Match m)
+{
+	switch (m) {
+	case EXACT:
+		return !compare(v, key);
+	case BELOW:
+		return rank(v) == rank(key) && compare(v, key) <= 0;
+	case PREFIX:
+		return rank(v) == 1 && v.get_str().substr(0, key.get_str().size()) == key.get_str();
+	}
+	return false;
+}
+
+/**
+ * First of sorted rows from `r0' to `r1'
+ */
+bool
+Store::Index::first(const std::vector<unsigned> &rows, unsigned r0, unsigned r1, unsigned &row)
+{
+	auto it = std::lower_bound(rows.begin(), rows.end(), r0);
+	if (it == rows.end() || *it > r1)
+		return false;
+	row = *it;
+	return true;
+}
+
+bool
+Store::Index::Less::operator()(const Value &a, const Value &b) const
+{
+	return compare(a, b) < 0;
+}
+
+size_t
+Store::Index::Hash::operator()(const Value *v) const
+{
+	switch (rank(*v)) {
+	case 0:
+		return std::hash<double>()(v->get_num() + 0.0); /* -0 hashes as 0 */
+	case 1:
+		return std::hash<std::string_view>()(v->get_str());
+	default:
+		return v->get_error();
+	}
+}
+
+bool
+Store::Index::Equal::operator()(const Value *a, const Value *b) const
+{
+	return !compare(*a, *b);
+}
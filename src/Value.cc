@@ -3,72 +3,180 @@
  * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
  */
 
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <mutex>
+#include <new>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <Value.h>
 
+static const char *error_str[] = {
+	"#DIV/0!",
+	"#VALUE!",
+	"#REF!",
+	"#NUM!",
+	"#CYCLE!",
+	"#N/A"
+};
+
 /**
  * Init value as `0' integer by default
  */
-Value::Value(void)
+Value::Value(void) : m_data(), m_len(0), m_type(INTEGER)
+{}
+
+/**
+ * Copy constructor; shared text is not copied,
+ * only counted once more
+ */
+Value::Value(const Value &v) : m_len(v.m_len), m_type(v.m_type)
 {
-	m_value.i = 0;
-	m_type = INTEGER;
+	std::memcpy(m_data, v.m_data, sizeof(m_data));
+	if (is_shared())
+		get_text()->refs.fetch_add(1, std::memory_order_relaxed);
 }
 
 /**
- * Copy constructor
+ * Take over value of another, leaving it `0'
  */
-Value::Value(const Value &v)
+Value::Value(Value &&v) noexcept : m_len(v.m_len), m_type(v.m_type)
 {
-	m_type = v.m_type;
-	if (m_type == STRING)
-		m_value.s = new std::string(*v.m_value.s);
-	else
-		m_value = v.m_value;
+	std::memcpy(m_data, v.m_data, sizeof(m_data));
+	v.m_len = 0;
+	v.m_type = INTEGER;
+	std::memset(v.m_data, 0, sizeof(v.m_data));
 }
 
 /**
  * Init non-integer number
  */
-Value::Value(double value)
+Value::Value(double value) : m_len(0), m_type(DOUBLE)
 {
-	m_value.d = value;
-	m_type = DOUBLE;
+	std::memcpy(m_data, &value, sizeof(value));
 }
 
 /**
  * Init integer
  */
-Value::Value(int value)
+Value::Value(int value) : m_len(0), m_type(INTEGER)
 {
-	m_value.i = value;
-	m_type = INTEGER;
+	std::memcpy(m_data, &value, sizeof(value));
 }
 
 /**
  * Init string; every value that's not a number
- * Requires additional space to be allocated.
+ * Strings longer than SHORT_MAX are allocated.
  */
-Value::Value(const std::string &value)
+Value::Value(const std::string &value) : Value(STRING, value)
+{}
+
+Value::Value(const char *value) : Value(STRING, value)
+{}
+
+/**
+ * Init text of a given type
+ */
+Value::Value(Type type, std::string_view s) : m_type(type)
 {
-	m_value.s = new std::string(value);
-	m_type = STRING;
+	if (s.size() <= SHORT_MAX) {
+		s.copy(m_data, s.size());
+		m_len = s.size();
+	} else
+		set_text(make_text(s));
 }
 
-Value::Value(const char *value)
+Value::~Value(void)
 {
-	m_value.s = new std::string(value);
-	m_type = STRING;
+	release();
 }
 
 /**
- * Deallocation is required in case of string value
+ * Allocate text with a single reference
  */
-Value::~Value(void)
+Value::Text *
+Value::make_text(std::string_view s)
 {
-	if (m_type == STRING)
-		delete m_value.s;
+	Text *t = (Text *)::operator new(sizeof(Text) + s.size());
+	new (&t->refs) std::atomic<unsigned>(1);
+	t->len = s.size();
+	std::memcpy((char *)(t + 1), s.data(), s.size());
+	return t;
+}
+
+/**
+ * Drop reference to shared text, if any;
+ * the last one frees it
+ */
+void
+Value::release(void)
+{
+	if (!is_shared())
+		return;
+	Text *t = get_text();
+	if (t->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		::operator delete(t);
+}
+
+bool
+Value::is_shared(void) const
+{
+	return m_len > SHORT_MAX;
+}
+
+Value::Text *
+Value::get_text(void) const
+{
+	Text *t;
+	std::memcpy(&t, m_data, sizeof(t));
+	return t;
+}
+
+/**
+ * Point at shared text, taking over a reference to it
+ */
+void
+Value::set_text(Text *t)
+{
+	std::memcpy(m_data, &t, sizeof(t));
+	m_len = SHORT_MAX + 1;
+}
+
+/**
+ * Init formula from its text, including leading `='
+ */
+Value
+Value::formula(const std::string &src)
+{
+	return Value(FORMULA, src);
+}
+
+/**
+ * Init formula evaluation error
+ */
+Value
+Value::error(Error e)
+{
+	Value v((int)e);
+	v.m_type = ERROR;
+	return v;
+}
+
+/**
+ * Init number resulting from a calculation;
+ * whole numbers become integers.
+ */
+Value
+Value::number(double d)
+{
+	if (std::isnan(d) || std::isinf(d))
+		return error(NUM);
+	if (d == std::trunc(d) && d >= -2147483648.0 && d <= 2147483647.0)
+		return Value((int)d);
+	return Value(d);
 }
 
 /**
@@ -77,13 +185,32 @@ Value::~Value(void)
 Value &
 Value::operator=(const Value &v)
 {
-	if (m_type == STRING)
-		delete m_value.s;
+	if (this == &v)
+		return *this;
+	if (v.is_shared())
+		v.get_text()->refs.fetch_add(1, std::memory_order_relaxed);
+	release();
+	std::memcpy(m_data, v.m_data, sizeof(m_data));
+	m_len = v.m_len;
+	m_type = v.m_type;
+	return *this;
+}
+
+/**
+ * Take over value of another, leaving it `0'
+ */
+Value &
+Value::operator=(Value &&v) noexcept
+{
+	if (this == &v)
+		return *this;
+	release();
+	std::memcpy(m_data, v.m_data, sizeof(m_data));
+	m_len = v.m_len;
 	m_type = v.m_type;
-	if (m_type == STRING)
-		m_value.s = new std::string(*v.m_value.s);
-	else
-		m_value = v.m_value;
+	v.m_len = 0;
+	v.m_type = INTEGER;
+	std::memset(v.m_data, 0, sizeof(v.m_data));
 	return *this;
 }
 
@@ -97,11 +224,13 @@ Value::operator+(unsigned ui) const
 {
 	switch (m_type) {
 	case STRING:
-		return Value(*m_value.s);
+	case FORMULA:
+	case ERROR:
+		return *this;
 	case INTEGER:
-		return Value(m_value.i + (int)ui);
+		return Value((int)get_num() + (int)ui);
 	case DOUBLE:
-		return Value(m_value.d + (double)ui);
+		return Value(get_num() + (double)ui);
 	}
 	return Value();
 }
@@ -114,17 +243,138 @@ Value::eval(void) const
 {
 	switch (m_type) {
 	case Type::INTEGER:
-		return std::to_string(m_value.i);
+		return std::to_string((int)get_num());
 	case Type::DOUBLE:
-		return std::to_string(m_value.d);
+		return std::to_string(get_num());
 	case Type::STRING:
-		return *m_value.s;
+	case Type::FORMULA:
+		return std::string(get_str());
+	case Type::ERROR:
+		return error_str[get_error()];
 	}
 	return "";
 }
 
+/**
+ * Text of a string or formula; empty for anything else.
+ * Valid for as long as the value is not changed.
+ */
+std::string_view
+Value::get_str(void) const
+{
+	if (m_type != STRING && m_type != FORMULA)
+		return std::string_view();
+	if (!is_shared())
+		return std::string_view(m_data, m_len);
+	Text *t = get_text();
+	return std::string_view((const char *)(t + 1), t->len);
+}
+
 Value::Type
 Value::get_type(void) const
 {
 	return m_type;
 }
+
+/**
+ * Check if value is a number
+ */
+bool
+Value::is_num(void) const
+{
+	return m_type == INTEGER || m_type == DOUBLE;
+}
+
+/**
+ * Kind of error held by an error value
+ */
+Value::Error
+Value::get_error(void) const
+{
+	int e;
+	std::memcpy(&e, m_data, sizeof(e));
+	return (Error)e;
+}
+
+/**
+ * Numeric value; anything else counts as 0
+ */
+double
+Value::get_num(void) const
+{
+	switch (m_type) {
+	case Type::INTEGER: {
+		int i;
+		std::memcpy(&i, m_data, sizeof(i));
+		return i;
+	}
+	case Type::DOUBLE: {
+		double d;
+		std::memcpy(&d, m_data, sizeof(d));
+		return d;
+	}
+	default:
+		return 0;
+	}
+}
+
+Value::Intern::Intern(void)
+{}
+
+Value::Intern::~Intern(void)
+{
+	for (auto &t : m_texts)
+		if (t.second->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			::operator delete(t.second);
+}
+
+/**
+ * Get string value, sharing text with other
+ * values of the same string
+ */
+Value
+Value::Intern::get(std::string_view s)
+{
+	if (s.size() <= SHORT_MAX)
+		return Value(STRING, s);
+	std::lock_guard<std::mutex> l(m_lock);
+	auto it = m_texts.find(s);
+	if (it == m_texts.end()) {
+		Text *t = make_text(s);
+		it = m_texts.emplace(std::string_view((const char *)(t + 1), t->len), t).first;
+	}
+	Value v;
+	v.m_type = STRING;
+	it->second->refs.fetch_add(1, std::memory_order_relaxed);
+	v.set_text(it->second);
+	return v;
+}
+
+/**
+ * Number of texts in the pool
+ */
+size_t
+Value::Intern::size(void) const
+{
+	std::lock_guard<std::mutex> l(m_lock);
+	return m_texts.size();
+}
+
+/**
+ * Drop texts no value holds anymore;
+ * returns number of them
+ */
+size_t
+Value::Intern::purge(void)
+{
+	std::lock_guard<std::mutex> l(m_lock);
+	size_t n = 0;
+	for (auto it = m_texts.begin(); it != m_texts.end(); )
+		if (it->second->refs.load(std::memory_order_acquire) == 1) {
+			::operator delete(it->second);
+			it = m_texts.erase(it);
+			++n;
+		} else
+			++it;
+	return n;
+}
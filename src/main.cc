@@ -3,24 +3,133 @@
  * 2021 Maksymilian Mruszczak <u at one u x dot o r g>
  */
 
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <Prof.h>
 #include <Value.h>
 #include <Cell.h>
+#include <Axis.h>
+#include <Store.h>
+#include <Formula.h>
+#include <Deps.h>
+#include <Pool.h>
+#include <Journal.h>
+#include <History.h>
 #include <Sheet.h>
+#include <Batch.h>
+#include <Output.h>
+#include <Screen.h>
 #include <Display.h>
 
-int
-main(int argc, char *argv[])
+/**
+ * Run without the interface: read the sheet file if there
+ * is one, import a CSV file over it if asked to, run a
+ * script of commands on it, from standard input if it's
+ * given as `-', and export it
+ */
+static int
+batch(const char *file, const char *in, const char *script, const char *out)
 {
 	auto sheet = std::make_shared<Sheet>();
-	Display d(sheet);
-	if (argc > 1) {
-		d.set_sheet_filename(argv[1]);
-		d.load_sheet();
+	Batch b(sheet, std::cout);
+	try {
+		struct stat st;
+		if (file) {
+			b.set_filename(file);
+			if (stat(file, &st) == 0)
+				sheet->load(file);
+		}
+		if (in)
+			sheet->import_csv(in);
+		if (script && !std::strcmp(script, "-"))
+			b.run(std::cin);
+		else if (script) {
+			std::ifstream fs(script);
+			if (!fs)
+				throw std::runtime_error(std::string(script) + ": " + std::strerror(errno));
+			b.run(fs);
+		}
+		if (out)
+			sheet->export_csv(out);
+	} catch (const std::exception &e) {
+		std::cerr << "cells: " << e.what() << '\n';
+		return 1;
 	}
-	d.take_input();
 	return 0;
 }
+
+/**
+ * Write out the trace, if one's been recorded
+ */
+static int
+finish(int ret)
+{
+	try {
+		Prof::finish();
+	} catch (const std::exception &e) {
+		std::cerr << "cells: " << e.what() << '\n';
+		return 1;
+	}
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *in = nullptr, *out = nullptr, *script = nullptr;
+	for (int c; (c = getopt(argc, argv, "b:i:o:t:")) != -1;)
+		switch (c) {
+		case 'b':
+			script = optarg;
+			break;
+		case 'i':
+			in = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 't':
+			Prof::trace(optarg);
+			break;
+		default:
+			std::cerr << "usage: cells [-b script] [-i file.csv] [-o file.csv] [-t trace.json] [file]\n";
+			return 1;
+		}
+	const char *file = optind < argc ? argv[optind] : nullptr;
+	if (script || out)
+		return finish(batch(file, in, script, out));
+	{
+		auto sheet = std::make_shared<Sheet>();
+		Display d(sheet);
+		if (file) {
+			d.set_sheet_filename(file);
+			d.recover_sheet();
+		}
+		if (in)
+			d.import_sheet(in);
+		d.take_input();
+	}
+	return finish(0);
+}
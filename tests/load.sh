@@ -0,0 +1,22 @@
+#!/bin/sh
+# TUI spreadsheet
+# 2021 Maksymilian Mruszczak <u at one u x dot o r g>
+#
+# Reading a sheet over one holding other cells leaves
+# only those of the file, in either format.
+
+cells=${1:-./cells}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+status=0
+for file in "$dir/sheet.cells" "$dir/sheet.cellsb"; do
+	got=$(printf 'i A1 1\ni B2 =A1*2\nw %s\nd A1:B2\ni C3 3\ni A1 5\nr\np A1:C3\n' "$file" |
+	      "$cells" -b - "$file") || status=1
+	want=$(printf '1\t\t\n\t2\t\n\t\t')
+	if [ "$got" != "$want" ]; then
+		echo "load over a sheet: ${file##*/} read as:" >&2
+		echo "$got" >&2
+		status=1
+	fi
+done
+exit $status